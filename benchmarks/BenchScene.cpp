@@ -0,0 +1,74 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "BenchScene.h"
+#include "engine/Engine.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+/* written as OBJ, since that is what the engine loads */
+static void writeScene(FILE *f)
+{
+	const int rings = 32, segments = 64;
+	int base = 1;
+
+	fprintf(f, "o floor\n");
+	fprintf(f, "v -4 0 -4\nv 4 0 -4\nv 4 0 4\nv -4 0 4\nvn 0 1 0\n");
+	fprintf(f, "f 1//1 4//1 3//1 2//1\n");
+	base += 4;
+
+	for (int sphere = 0 ; sphere < 6 ; sphere++)
+	{
+		Vector3 center((sphere % 3) * 2.0 - 2, 0.8 + (sphere % 2) * 0.6, (sphere / 3) * 2.0 - 1);
+		fprintf(f, "o sphere%d\n", sphere);
+
+		for (int r = 0 ; r <= rings ; r++)
+			for (int s = 0 ; s <= segments ; s++) {
+				double theta = M_PI * r / rings, phi = 2 * M_PI * s / segments;
+				Vector3 n(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+				Vector3 p = center + n * 0.7;
+				fprintf(f, "v %f %f %f\nvn %f %f %f\n", p.x(), p.y(), p.z(), n.x(), n.y(), n.z());
+			}
+
+		for (int r = 0 ; r < rings ; r++)
+			for (int s = 0 ; s < segments ; s++) {
+				int a = base + r * (segments + 1) + s, b = a + segments + 1;
+				fprintf(f, "f %d//%d %d//%d %d//%d %d//%d\n", a, a, b, b, b + 1, b + 1, a + 1, a + 1);
+			}
+
+		base += (rings + 1) * (segments + 1);
+	}
+}
+
+bool loadBenchScene(Engine &engine)
+{
+	char path[] = "/tmp/cgbench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return false;
+
+	FILE *f = fdopen(fd, "w");
+	writeScene(f);
+	fclose(f);
+
+	bool loaded = engine.loadSceneFromOBJ(path);
+	unlink(path);
+	return loaded;
+}
@@ -0,0 +1,63 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <sys/time.h>
+#include <stdio.h>
+
+/*
+ * Minimal benchmark framework: each benchmark is a function registered with BENCHMARK(name)
+ * and cgbench runs all of them, or only those whose names are given on the command line.
+ * Benchmarks that also check results report failures with benchmarkFail, and cgbench then exits with 1
+ */
+typedef void (*BenchmarkFunction)();
+
+struct BenchmarkRegistration
+{
+	BenchmarkRegistration(const char *name, BenchmarkFunction function);
+
+	const char *name;
+	BenchmarkFunction function;
+	BenchmarkRegistration *next;
+};
+
+#define BENCHMARK(name) \
+	static void benchmark_##name(); \
+	static BenchmarkRegistration registration_##name(#name, benchmark_##name); \
+	static void benchmark_##name()
+
+/* wall clock time in milliseconds */
+static inline double benchmarkTime()
+{
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
+}
+
+/* print one result line, in a format that is easy to grep and compare between runs */
+static inline void benchmarkReport(const char *what, double value, const char *unit)
+{
+	printf("  %-48s %12.3f %s\n", what, value, unit);
+}
+
+/* a check of the results failed */
+void benchmarkFail(const char *what);
+
+#endif
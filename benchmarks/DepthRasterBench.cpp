@@ -0,0 +1,145 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Benchmark.h"
+#include "renderer/Renderer.h"
+#include "renderer/Texture.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+struct BenchVertex
+{
+	Vector3 position;
+	Vector3 normal;
+};
+
+struct BenchUniforms
+{
+	Mat4 objectToClip;
+};
+
+static void benchVertexShader(void* priv, void* in, Vector4 &pos_out, Vector3 attribs_out[])
+{
+	const BenchUniforms *u = (const BenchUniforms*)priv;
+	const BenchVertex &v = *(const BenchVertex*)in;
+	pos_out = vmul4point(v.position, u->objectToClip);
+	attribs_out[0] = v.normal;
+}
+
+static Color benchPixelShader(void* priv, const PS_INPUTS &in)
+{
+	const Vector3 &n = in.attributes[0];
+	return Color(std::abs(n.x()), std::abs(n.y()), std::abs(n.z()));
+}
+
+/* a few overlapping spheres made of quads, similar to a typical shadow caster (poles are left open) */
+static void buildScene(std::vector<BenchVertex> &vertices, std::vector<unsigned int> &polygons, int &polygonCount)
+{
+	const int rings = 64, segments = 128;
+	polygonCount = 0;
+
+	for (int sphere = 0 ; sphere < 4 ; sphere++)
+	{
+		Vector3 center(sphere * 0.4 - 0.6, sphere * 0.2 - 0.3, sphere * 0.1);
+		int base = vertices.size();
+
+		for (int r = 0 ; r <= rings ; r++)
+			for (int s = 0 ; s <= segments ; s++) {
+				double theta = 0.1 + (M_PI - 0.2) * r / rings, phi = 2 * M_PI * s / segments;
+				BenchVertex v;
+				v.normal = Vector3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+				v.position = center + v.normal * 0.35;
+				vertices.push_back(v);
+			}
+
+		for (int r = 0 ; r < rings ; r++)
+			for (int s = 0 ; s < segments ; s++) {
+				polygons.push_back(4);
+				polygons.push_back(base + r * (segments + 1) + s);
+				polygons.push_back(base + r * (segments + 1) + s + 1);
+				polygons.push_back(base + (r + 1) * (segments + 1) + s + 1);
+				polygons.push_back(base + (r + 1) * (segments + 1) + s);
+				polygonCount++;
+			}
+	}
+}
+
+/* best time of a few passes, the machine might be busy with something else */
+template <class Pass>
+static double bestPassTime(DepthTexture &depth, const Pass &pass)
+{
+	double best = 1e9;
+
+	for (int i = 0 ; i < 20 ; i++) {
+		depth.clear();
+		double start = benchmarkTime();
+		pass();
+		best = std::min(best, benchmarkTime() - start);
+	}
+	return best;
+}
+
+BENCHMARK(depthraster)
+{
+	const int size = 1024;
+
+	std::vector<BenchVertex> vertices;
+	std::vector<unsigned int> polygons;
+	int polygonCount;
+	buildScene(vertices, polygons, polygonCount);
+
+	Texture output(size, size);
+	DepthTexture depth(size, size);
+
+	Renderer renderer;
+	renderer.setViewport(size, size);
+	renderer.setAspectRatio(1);
+	renderer.setZBuffer(&depth);
+	renderer.uploadVertices(&vertices[0], sizeof(BenchVertex), vertices.size());
+
+	BenchUniforms uniforms;
+	uniforms.objectToClip = Mat4::getOrthoProjMatrix(-1, 1, 1, -1, -1, 1);
+	renderer.setVertexShader(benchVertexShader, &uniforms);
+	renderer.setPixelShader(benchPixelShader, NULL);
+
+	printf("  %d polygons, %dx%d\n", polygonCount, size, size);
+
+	/* color pass of the same geometry, as reference */
+	renderer.setOutputTexture(&output);
+	renderer.setVertexAttributes(0, 1, 0);
+	benchmarkReport("color pass", bestPassTime(depth, [&] {
+		renderer.renderPolygons(&polygons[0], polygonCount, Renderer::SOLID);
+	}), "ms");
+
+	/* generic pipeline without output texture, as shadow maps were rendered before */
+	renderer.setOutputTexture(NULL);
+	renderer.setVertexAttributes(0, 0, 0);
+	benchmarkReport("generic pipeline, depth only", bestPassTime(depth, [&] {
+		renderer.renderPolygons(&polygons[0], polygonCount, Renderer::SOLID);
+	}), "ms");
+
+	benchmarkReport("renderDepthPolygons", bestPassTime(depth, [&] {
+		renderer.renderDepthPolygons(&polygons[0], polygonCount, uniforms.objectToClip);
+	}), "ms");
+
+	renderer.setDepthBias(1.5, 0);
+	benchmarkReport("renderDepthPolygons, slope bias", bestPassTime(depth, [&] {
+		renderer.renderDepthPolygons(&polygons[0], polygonCount, uniforms.objectToClip);
+	}), "ms");
+}
@@ -0,0 +1,79 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Benchmark.h"
+#include <string.h>
+
+static BenchmarkRegistration *benchmarks = NULL;
+static int failures = 0;
+
+BenchmarkRegistration::BenchmarkRegistration(const char *name, BenchmarkFunction function) :
+	name(name), function(function), next(benchmarks)
+{
+	benchmarks = this;
+}
+
+void benchmarkFail(const char *what)
+{
+	printf("  FAIL: %s\n", what);
+	failures++;
+}
+
+static bool selected(const char *name, int argc, char **argv)
+{
+	if (argc < 2)
+		return true;
+
+	for (int i = 1 ; i < argc ; i++)
+		if (!strcmp(argv[i], name))
+			return true;
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "--list")) {
+		for (BenchmarkRegistration *b = benchmarks ; b ; b = b->next)
+			printf("%s\n", b->name);
+		return 0;
+	}
+
+	int count = 0;
+
+	for (BenchmarkRegistration *b = benchmarks ; b ; b = b->next)
+	{
+		if (!selected(b->name, argc, argv))
+			continue;
+
+		printf("%s:\n", b->name);
+		b->function();
+		fflush(stdout);
+		count++;
+	}
+
+	if (!count) {
+		fprintf(stderr, "no benchmarks matched, use --list to see them\n");
+		return 1;
+	}
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Benchmark.h"
+#include "BenchScene.h"
+#include "engine/Engine.h"
+#include "renderer/Renderer.h"
+#include "renderer/Texture.h"
+#include <algorithm>
+
+/* point lights around the scene, only the first 'count' of them are enabled */
+static void setupPointLights(Engine &engine, int count)
+{
+	for (int i = 0 ; i < MAX_LIGHT ; i++)
+	{
+		LightSource *l = engine.getLightParams(i);
+		l->enabled = i < count;
+		l->shadow = true;
+		l->type = LightSource::LIGHT_TYPE_POINT;
+		l->space = LightSource::LIGHT_SPACE_LOCAL;
+		l->position = Vector3(i - 3.5, 2.5, (i % 3) - 1);
+		l->color = Color(200, 200, 200) / count;
+	}
+}
+
+/* best time of a few frames, with the maps rendered or the BVH built again for each one, as if the scene moved */
+static double renderFrames(Engine &engine, bool rayTraced)
+{
+	ShadowParams params = engine.getShadowParams();
+	params.ray_traced = rayTraced;
+	engine.setShadowParams(&params);
+	engine.render();
+
+	double best = 1e9;
+
+	for (int i = 0 ; i < 3 ; i++) {
+		engine.invalidateShadowMaps();
+		double start = benchmarkTime();
+		engine.render();
+		best = std::min(best, benchmarkTime() - start);
+	}
+
+	return best;
+}
+
+/*
+ * Cost of shadows from the maps against ray traced ones, by the number of lights and the resolution.
+ * Maps are rendered for each light, while rays are traced for each pixel and light
+ */
+BENCHMARK(rayshadows)
+{
+	static const int resolutions[][2] = { { 320, 240 }, { 640, 480 } };
+	static const int lightCounts[] = { 1, 2, 4, 8 };
+
+	for (int r = 0 ; r < 2 ; r++)
+	{
+		const int width = resolutions[r][0], height = resolutions[r][1];
+
+		Renderer renderer;
+		Texture output(width, height);
+		Engine engine;
+		engine.setRenderer(&renderer);
+		engine.setOutput(&output, width, height);
+
+		if (!loadBenchScene(engine))
+			return;
+
+		engine.rotateObject(0, 30);
+		engine.commitRotation();
+
+		for (int l = 0 ; l < 4 ; l++)
+		{
+			char what[64];
+			setupPointLights(engine, lightCounts[l]);
+
+			snprintf(what, sizeof(what), "%dx%d, %d lights, shadow maps", width, height, lightCounts[l]);
+			benchmarkReport(what, renderFrames(engine, false), "ms");
+
+			snprintf(what, sizeof(what), "%dx%d, %d lights, ray traced", width, height, lightCounts[l]);
+			benchmarkReport(what, renderFrames(engine, true), "ms");
+		}
+	}
+}
@@ -0,0 +1,118 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Benchmark.h"
+#include "BenchScene.h"
+#include "engine/Engine.h"
+#include "renderer/Renderer.h"
+#include "renderer/Texture.h"
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+static void setupLights(Engine &engine)
+{
+	LightSource *l = engine.getLightParams(0);
+	l->enabled = true; l->shadow = true;
+	l->space = LightSource::LIGHT_SPACE_LOCAL;
+	l->direction = Vector3(-0.3, -1, -0.4);
+
+	l = engine.getLightParams(1);
+	l->enabled = true; l->shadow = true;
+	l->type = LightSource::LIGHT_TYPE_POINT; l->space = LightSource::LIGHT_SPACE_LOCAL;
+	l->position = Vector3(1, 2.5, 1); l->color = Color(120, 100, 80);
+
+	l = engine.getLightParams(2);
+	l->enabled = true; l->shadow = true;
+	l->type = LightSource::LIGHT_TYPE_SPOT; l->space = LightSource::LIGHT_SPACE_LOCAL;
+	l->position = Vector3(-2, 3, 2); l->direction = Vector3(0.5, -1, -0.5);
+	l->cutoffAngle = 60; l->color = Color(80, 80, 140);
+}
+
+/* best time of a few frames with the maps already rendered, and the last frame */
+static double renderFrames(Engine &engine, bool vertexCoords, std::vector<DEVICE_PIXEL> &image, Texture &output)
+{
+	ShadowParams params = engine.getShadowParams();
+	params.vertex_coords = vertexCoords;
+	engine.setShadowParams(&params);
+	engine.render();
+
+	double best = 1e9;
+
+	for (int i = 0 ; i < 10 ; i++) {
+		// touching the shading mode makes the frame render again, but keeps the maps
+		engine.setShadingMode(SHADING_PHONG);
+		double start = benchmarkTime();
+		engine.render();
+		best = std::min(best, benchmarkTime() - start);
+	}
+
+	image.clear();
+	for (int y = 0 ; y < output.getHeight() ; y++)
+		for (int x = 0 ; x < output.getWidth() ; x++)
+			image.push_back(output.getPixelValue(x, y));
+
+	return best;
+}
+
+/*
+ * Phong shading with the positions in the shadow maps interpolated from the vertices,
+ * against transforming each pixel to light space. Both should give the same image.
+ */
+BENCHMARK(shadowcoords)
+{
+	const int width = 640, height = 480;
+
+	Renderer renderer;
+	Texture output(width, height);
+	Engine engine;
+	engine.setRenderer(&renderer);
+	engine.setOutput(&output, width, height);
+
+	if (!loadBenchScene(engine)) {
+		benchmarkFail("scene couldn't be loaded");
+		return;
+	}
+
+	setupLights(engine);
+	engine.invalidateShadowMaps();
+	engine.rotateObject(0, 30);
+	engine.commitRotation();
+
+	std::vector<DEVICE_PIXEL> perPixel, interpolated;
+	benchmarkReport("per pixel transform", renderFrames(engine, false, perPixel, output), "ms");
+	benchmarkReport("interpolated coordinates", renderFrames(engine, true, interpolated, output), "ms");
+
+	int differentPixels = 0, maxDifference = 0;
+
+	for (size_t i = 0 ; i < perPixel.size() ; i++)
+	{
+		const DEVICE_PIXEL &a = perPixel[i], &b = interpolated[i];
+		int difference = std::max(std::abs(a.Red - b.Red), std::max(std::abs(a.Green - b.Green), std::abs(a.Blue - b.Blue)));
+
+		if (difference)
+			differentPixels++;
+		maxDifference = std::max(maxDifference, difference);
+	}
+
+	benchmarkReport("pixels that differ", differentPixels, "");
+	benchmarkReport("largest channel difference", maxDifference, "");
+
+	if (differentPixels > 0)
+		benchmarkFail("interpolated coordinates gave a different image");
+}
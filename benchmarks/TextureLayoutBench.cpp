@@ -0,0 +1,305 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Benchmark.h"
+#include "renderer/Texture.h"
+#include "renderer/Samplers.h"
+#include <algorithm>
+#include <cmath>
+
+/* noise, so nothing about the texels is predictable */
+static void fillTexture(Texture &texture)
+{
+	unsigned int seed = 1;
+
+	for (int y = 0 ; y < texture.getHeight() ; y++)
+		for (int x = 0 ; x < texture.getWidth() ; x++) {
+			seed = seed * 1103515245 + 12345;
+			texture.setPixelValue(x, y, DEVICE_PIXEL(seed >> 24, seed >> 16, seed >> 8));
+		}
+}
+
+/*
+ * Bilinear samples of a screen of size x size pixels, with the texture rotated by the angle
+ * and each pixel covering 'scale' texels. Returns the best time and the sum of the samples
+ */
+static double samplePass(const TextureSampler &sampler, int textureSize, int size, double angle, double scale, Color &sum)
+{
+	const double c = cos(angle) * scale / textureSize, s = sin(angle) * scale / textureSize;
+	double best = 1e9;
+
+	for (int pass = 0 ; pass < 5 ; pass++)
+	{
+		Color result(0, 0, 0);
+		double start = benchmarkTime();
+
+		for (int y = 0 ; y < size ; y++)
+			for (int x = 0 ; x < size ; x++) {
+				double u = 0.5 + (x - size / 2) * c - (y - size / 2) * s;
+				double v = 0.5 + (x - size / 2) * s + (y - size / 2) * c;
+				result += sampler.sampleBiLinear(u, v);
+			}
+
+		best = std::min(best, benchmarkTime() - start);
+		sum = result;
+	}
+	return best;
+}
+
+/* linear against tiled texels, for a texture much bigger than the caches */
+BENCHMARK(texturelayout)
+{
+	const int textureSize = 4096, screenSize = 512;
+
+	Texture linear(textureSize, textureSize), tiled(textureSize, textureSize);
+	fillTexture(linear);
+	fillTexture(tiled);
+	tiled.setLayout(TEXTURE_LAYOUT_TILED);
+
+	TextureSampler linearSampler, tiledSampler;
+	linearSampler.bindTexture(&linear);
+	tiledSampler.bindTexture(&tiled);
+
+	printf("  %dx%d texture, %dx%d bilinear samples\n", textureSize, textureSize, screenSize, screenSize);
+
+	const double angles[] = { 0, 30, 45, 60, 90 };
+	const double scales[] = { 1, 3 };
+
+	for (double scale : scales)
+		for (double angle : angles)
+		{
+			Color linearSum, tiledSum;
+			double linearTime = samplePass(linearSampler, textureSize, screenSize, angle * M_PI / 180, scale, linearSum);
+			double tiledTime = samplePass(tiledSampler, textureSize, screenSize, angle * M_PI / 180, scale, tiledSum);
+
+			char what[128];
+			snprintf(what, sizeof(what), "%g texels per pixel, %g degrees, linear", scale, angle);
+			benchmarkReport(what, linearTime, "ms");
+			snprintf(what, sizeof(what), "%g texels per pixel, %g degrees, tiled", scale, angle);
+			benchmarkReport(what, tiledTime, "ms");
+
+			if ((linearSum - tiledSum).len() > 1e-6)
+				printf("  tiled texture was sampled differently\n");
+		}
+}
+
+/* smooth gradients with some detail on top, closer to a real material than noise */
+static void fillSmoothTexture(Texture &texture)
+{
+	unsigned int seed = 1;
+
+	for (int y = 0 ; y < texture.getHeight() ; y++)
+		for (int x = 0 ; x < texture.getWidth() ; x++) {
+			seed = seed * 1103515245 + 12345;
+			double noise = ((seed >> 16) & 15) - 7.5;
+			double wave = sin(x * 0.05) * cos(y * 0.03) * 60;
+			texture.setPixelValue(x, y, DEVICE_PIXEL(
+				clamp((int)(128 + wave + noise), 0, 255),
+				clamp((int)(x * 255 / texture.getWidth() + noise), 0, 255),
+				clamp((int)(y * 255 / texture.getHeight() - wave * 0.5), 0, 255)));
+		}
+}
+
+/* compressed against tiled texels: memory, sampling speed, and how far the compressed texels are */
+BENCHMARK(texturecompression)
+{
+	const int textureSize = 4096, screenSize = 512;
+
+	Texture tiled(textureSize, textureSize), compressed(textureSize, textureSize);
+	fillSmoothTexture(tiled);
+	fillSmoothTexture(compressed);
+
+	double start = benchmarkTime();
+	compressed.setLayout(TEXTURE_LAYOUT_COMPRESSED);
+	benchmarkReport("compression", benchmarkTime() - start, "ms");
+
+	tiled.setLayout(TEXTURE_LAYOUT_TILED);
+
+	benchmarkReport("tiled texture", tiled.getMemoryUsage() / (1024.0 * 1024.0), "MB");
+	benchmarkReport("compressed texture", compressed.getMemoryUsage() / (1024.0 * 1024.0), "MB");
+
+	double error = 0;
+	for (int y = 0 ; y < textureSize ; y++)
+		for (int x = 0 ; x < textureSize ; x++) {
+			DEVICE_PIXEL a = tiled.getTexel(x, y), b = compressed.getTexel(x, y);
+			error += std::abs(a.Red - b.Red) + std::abs(a.Green - b.Green) + std::abs(a.Blue - b.Blue);
+		}
+	benchmarkReport("mean error of a channel", error / (textureSize * textureSize * 3.0), "of 255");
+
+	TextureSampler tiledSampler, compressedSampler;
+	tiledSampler.bindTexture(&tiled);
+	compressedSampler.bindTexture(&compressed);
+
+	const double scales[] = { 1, 3 };
+
+	for (double scale : scales)
+	{
+		Color sum;
+		char what[128];
+
+		snprintf(what, sizeof(what), "%g texels per pixel, 30 degrees, tiled", scale);
+		benchmarkReport(what, samplePass(tiledSampler, textureSize, screenSize, M_PI / 6, scale, sum), "ms");
+		snprintf(what, sizeof(what), "%g texels per pixel, 30 degrees, compressed", scale);
+		benchmarkReport(what, samplePass(compressedSampler, textureSize, screenSize, M_PI / 6, scale, sum), "ms");
+	}
+}
+
+/*
+ * Largest difference of a channel (in 1/255) between spans of samples and the same samples taken one at a time,
+ * for a screen of size x size pixels that sees the texture rotated and repeated a few times (negative coordinates too)
+ */
+static int spanDifference(const TextureSampler &sampler, int size)
+{
+	const double c = cos(0.5) * 3.0 / size, s = sin(0.5) * 3.0 / size;
+	int largest = 0;
+
+	for (int y = 0 ; y < size ; y++)
+		for (int x = 0 ; x + 7 <= size ; x += 7)
+		{
+			// 7 samples, so spans end with some taken one at a time too
+			double u[7], v[7];
+			Color colors[7];
+
+			for (int i = 0 ; i < 7 ; i++) {
+				u[i] = (x + i - size / 2) * c - (y - size / 2) * s;
+				v[i] = (x + i - size / 2) * s + (y - size / 2) * c;
+			}
+
+			sampler.sampleBiLinear(u, v, 7, colors);
+
+			for (int i = 0 ; i < 7 ; i++) {
+				Color single = sampler.sampleBiLinear(u[i], v[i]);
+				for (int channel = 0 ; channel < 3 ; channel++)
+					largest = std::max(largest, (int)(std::abs(colors[i][channel] - single[channel]) * 255 + 0.5));
+			}
+		}
+
+	return largest;
+}
+
+/* texture sizes with texel coordinates wrapped by a mask and by the reciprocal, one sample a call and a span at a time */
+BENCHMARK(bilinear)
+{
+	const int screenSize = 512;
+	const int sizes[] = { 1024, 1000 };
+
+	for (int size : sizes)
+	{
+		Texture texture(size, size);
+		fillSmoothTexture(texture);
+		texture.setLayout(TEXTURE_LAYOUT_TILED);
+
+		TextureSampler sampler;
+		sampler.bindTexture(&texture);
+
+		// a rotated, slightly magnified view
+		const double c = cos(0.5) * 0.8 / size, s = sin(0.5) * 0.8 / size;
+		double single = 1e9, span = 1e9;
+
+		for (int pass = 0 ; pass < 5 ; pass++)
+		{
+			Color sum(0, 0, 0);
+			double start = benchmarkTime();
+
+			for (int y = 0 ; y < screenSize ; y++)
+				for (int x = 0 ; x < screenSize ; x++)
+					sum += sampler.sampleBiLinear(x * c - y * s, x * s + y * c);
+
+			single = std::min(single, benchmarkTime() - start);
+			start = benchmarkTime();
+
+			for (int y = 0 ; y < screenSize ; y++)
+				for (int x = 0 ; x < screenSize ; x += 8)
+				{
+					double u[8], v[8];
+					Color colors[8];
+
+					for (int i = 0 ; i < 8 ; i++) {
+						u[i] = (x + i) * c - y * s;
+						v[i] = (x + i) * s + y * c;
+					}
+
+					sampler.sampleBiLinear(u, v, 8, colors);
+					for (int i = 0 ; i < 8 ; i++)
+						sum += colors[i];
+				}
+
+			span = std::min(span, benchmarkTime() - start);
+		}
+
+		char what[128];
+		snprintf(what, sizeof(what), "%dx%d, one sample a call", size, size);
+		benchmarkReport(what, single * 1e6 / (screenSize * screenSize), "ns");
+		snprintf(what, sizeof(what), "%dx%d, spans of 8", size, size);
+		benchmarkReport(what, span * 1e6 / (screenSize * screenSize), "ns");
+
+		// spans have to give the same samples (but for the rounding of the weights), in both layouts
+		Texture noise(size, size);
+		fillTexture(noise);
+
+		const TEXTURE_LAYOUT layouts[] = { TEXTURE_LAYOUT_LINEAR, TEXTURE_LAYOUT_TILED };
+		const char *names[] = { "linear", "tiled" };
+
+		for (int l = 0 ; l < 2 ; l++)
+		{
+			noise.setLayout(layouts[l]);
+			sampler.bindTexture(&noise);
+
+			int difference = spanDifference(sampler, screenSize);
+			snprintf(what, sizeof(what), "%dx%d, %s, largest span difference", size, size, names[l]);
+			benchmarkReport(what, difference, "of 255");
+
+			if (difference > 1)
+				benchmarkFail("spans were sampled differently");
+		}
+	}
+}
+
+/* the whole mipmap chain of a big texture, for a power of two size and for one with levels of odd sizes */
+BENCHMARK(mipmaps)
+{
+	const int sizes[] = { 4096, 4000 };
+
+	for (int size : sizes)
+	{
+		const int count = (int)log2(size);
+		Texture *texture = Texture::allocateMipmaps(size, size, count);
+		fillSmoothTexture(*texture);
+
+		double box = 1e9, gamma = 1e9;
+
+		for (int pass = 0 ; pass < 5 ; pass++)
+		{
+			double start = benchmarkTime();
+			texture->generateMipmaps(false);
+			box = std::min(box, benchmarkTime() - start);
+
+			start = benchmarkTime();
+			texture->generateMipmaps(true);
+			gamma = std::min(gamma, benchmarkTime() - start);
+		}
+
+		char what[128];
+		snprintf(what, sizeof(what), "%dx%d, %d levels", size, size, count);
+		benchmarkReport(what, box, "ms");
+		snprintf(what, sizeof(what), "%dx%d, %d levels, gamma correct", size, size, count);
+		benchmarkReport(what, gamma, "ms");
+
+		delete [] texture;
+	}
+}
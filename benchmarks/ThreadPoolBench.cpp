@@ -0,0 +1,92 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "Benchmark.h"
+#include "common/ThreadPool.h"
+
+static std::atomic<int> counter(0);
+
+/* spawn tasks from the main thread, they all go through the shared queue */
+static void spawnFlat(ThreadPool &pool, const char *title)
+{
+	const int tasks = 200000;
+
+	double start = benchmarkTime();
+	{
+		TaskGroup group(pool);
+		for (int i = 0 ; i < tasks ; i++)
+			group.run([] { counter++; });
+		group.wait();
+	}
+	double time = benchmarkTime() - start;
+
+	benchmarkReport(title, time * 1000000.0 / tasks, "ns/task");
+}
+
+/* binary tree of tasks, spawned from the workers, so the work moves by stealing */
+static void spawnTree(ThreadPool &pool, int depth)
+{
+	if (!depth) {
+		counter++;
+		return;
+	}
+
+	TaskGroup group(pool);
+	group.run([&pool, depth] { spawnTree(pool, depth - 1); });
+	spawnTree(pool, depth - 1);
+	group.wait();
+}
+
+static void spawnNested(ThreadPool &pool, const char *title)
+{
+	const int depth = 17;
+
+	double start = benchmarkTime();
+	spawnTree(pool, depth);
+	double time = benchmarkTime() - start;
+
+	benchmarkReport(title, time * 1000000.0 / (1 << depth), "ns/task");
+}
+
+/* fixed cost of a parallel loop, as paid by every parallel stage of a frame */
+static void loopOverhead(ThreadPool &pool, const char *title)
+{
+	const int loops = 5000;
+
+	double start = benchmarkTime();
+	for (int i = 0 ; i < loops ; i++)
+		parallelFor(0, 1024, 16, [] (int from, int to) { counter += to - from; }, pool);
+	double time = benchmarkTime() - start;
+
+	benchmarkReport(title, time * 1000.0 / loops, "usec/loop");
+}
+
+BENCHMARK(threadpool)
+{
+	ThreadPool &pool = ThreadPool::global();
+	printf("  %d threads (set CG_THREADS to change)\n", pool.getConcurrency());
+
+	ThreadPool single(0);
+
+	spawnFlat(pool, "flat spawn + join");
+	spawnFlat(single, "flat spawn + join, single thread");
+	spawnNested(pool, "nested fork/join (stealing)");
+	spawnNested(single, "nested fork/join, single thread");
+	loopOverhead(pool, "parallelFor, 1024 items in 16 item chunks");
+	loopOverhead(single, "parallelFor, single thread");
+}
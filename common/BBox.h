@@ -82,6 +82,14 @@ public:
 		return (point2 + point1) / 2;
 	}
 
+	bool contains(const BOUNDING_BOX &other) const
+	{
+		for (int i = 0 ; i < 3 ; i++)
+			if (other.point1[i] < point1[i] || other.point2[i] > point2[i])
+				return false;
+		return true;
+	}
+
 public:
 	Vector3 point1;
 	Vector3 point2;
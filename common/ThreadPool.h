@@ -0,0 +1,402 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <assert.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+class TaskGroup;
+
+/*
+ * Persistent pool of worker threads, shared by engine, renderer and loaders.
+ *
+ * Each worker has its own deque of tasks: it takes the newest task from its own deque
+ * and when it runs out, steals the oldest one from other workers.
+ * Each thread outside of the pool (render thread, texture streamer...) has a queue too, which
+ * it uses as a stack and workers steal from. While they wait, outside threads only run tasks
+ * from their own queue, so a frame never waits for a long task another thread spawned.
+ *
+ * With zero workers everything runs on the calling thread, which is what
+ * CG_THREADS=1 does (useful for debugging).
+ * Environment:
+ *	CG_THREADS=n		number of threads to use including the calling one
+ *	CG_THREAD_PIN=1		pin workers to CPUs (linux only)
+ */
+class ThreadPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	/* workers < 0 means one less than number of CPUs, since caller thread works too */
+	explicit ThreadPool(int workers = -1, bool pinThreads = false) :
+		_serial(++serials()), _outsideCount(0), _queued(0), _sleeping(0), _stop(false)
+	{
+		if (workers < 0)
+			workers = std::max(0, (int)std::thread::hardware_concurrency() - 1);
+
+		_workers.resize(workers);
+		for (int i = 0 ; i < workers ; i++)
+			_workers[i] = new Worker;
+
+		for (int i = 0 ; i < workers ; i++)
+		{
+			_workers[i]->thread = std::thread(&ThreadPool::workerMain, this, i);
+			if (pinThreads)
+				pinThread(_workers[i]->thread, i + 1);
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_sleepLock);
+			_stop = true;
+		}
+		_wake.notify_all();
+
+		// other workers might still look into the queue of a finished one
+		for (unsigned int i = 0 ; i < _workers.size() ; i++)
+			_workers[i]->thread.join();
+		for (unsigned int i = 0 ; i < _workers.size() ; i++)
+			delete _workers[i];
+	}
+
+	/* the pool everything uses by default, configured from environment */
+	static ThreadPool& global()
+	{
+		static ThreadPool pool(workersFromEnvironment(), getenv("CG_THREAD_PIN") != NULL);
+		return pool;
+	}
+
+	int getWorkerCount() const { return _workers.size(); }
+
+	/* threads that execute tasks, including the one that waits for them */
+	int getConcurrency() const { return _workers.size() + 1; }
+
+	bool isSingleThreaded() const { return _workers.empty(); }
+
+private:
+	friend class TaskGroup;
+
+	struct Job
+	{
+		Task task;
+		TaskGroup *group;
+	};
+
+	struct JobQueue
+	{
+		std::mutex lock;
+		std::deque<Job> jobs;
+	};
+
+	struct Worker : public JobQueue
+	{
+		std::thread thread;
+	};
+
+	/*
+	 * the worker the current thread is, if it belongs to this pool. Otherwise the queue it has
+	 * in the last pool it used (pools are told apart by serial numbers, as their addresses are reused)
+	 */
+	struct ThreadInfo
+	{
+		ThreadPool *pool;
+		int index;
+		unsigned int outsidePool;
+		int outsideQueue;
+	};
+
+	static ThreadInfo& currentThread()
+	{
+		static __thread ThreadInfo info = { NULL, -1, 0, -1 };
+		return info;
+	}
+
+	static std::atomic<unsigned int>& serials()
+	{
+		static std::atomic<unsigned int> serial(0);
+		return serial;
+	}
+
+	static int workersFromEnvironment()
+	{
+		const char *threads = getenv("CG_THREADS");
+		if (!threads || atoi(threads) <= 0)
+			return -1;
+		return atoi(threads) - 1;
+	}
+
+	static void pinThread(std::thread &thread, int cpu)
+	{
+#ifdef __linux__
+		int cpus = std::thread::hardware_concurrency();
+		if (cpus <= 0)
+			return;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu % cpus, &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+		(void)thread;
+		(void)cpu;
+#endif
+	}
+
+	/*
+	 * Queue of the current thread, outside threads get one the first time they use the pool
+	 * (a new thread with the id of one that ended gets its queue, which is empty by then).
+	 * If there are too many of them, the rest share one
+	 */
+	JobQueue& ownQueue()
+	{
+		ThreadInfo &self = currentThread();
+
+		if (self.pool == this)
+			return *_workers[self.index];
+
+		if (self.outsidePool != _serial)
+		{
+			std::lock_guard<std::mutex> lock(_outsideLock);
+			const std::thread::id id = std::this_thread::get_id();
+			int count = _outsideCount;
+
+			self.outsidePool = _serial;
+			self.outsideQueue = -1;
+
+			for (int i = 0 ; i < count && self.outsideQueue < 0 ; i++)
+				if (_outsideOwners[i] == id)
+					self.outsideQueue = i;
+
+			if (self.outsideQueue < 0 && count < MAX_OUTSIDE_THREADS) {
+				_outsideOwners[count] = id;
+				self.outsideQueue = count;
+				_outsideCount = count + 1;
+			}
+		}
+
+		return self.outsideQueue >= 0 ? _outside[self.outsideQueue] : _shared;
+	}
+
+	void push(const Job &job)
+	{
+		JobQueue &queue = ownQueue();
+
+		{
+			std::lock_guard<std::mutex> lock(queue.lock);
+			queue.jobs.push_back(job);
+		}
+
+		_queued++;
+
+		/* both counters are sequentially consistent, so either we see the sleeper or it sees the job */
+		if (_sleeping > 0) {
+			std::lock_guard<std::mutex> lock(_sleepLock);
+			_wake.notify_one();
+		}
+	}
+
+	/* own queue is used as a stack, others are stolen from in FIFO order */
+	static bool popBack(JobQueue &queue, Job &job)
+	{
+		std::lock_guard<std::mutex> lock(queue.lock);
+		if (queue.jobs.empty())
+			return false;
+		job = queue.jobs.back();
+		queue.jobs.pop_back();
+		return true;
+	}
+
+	static bool popFront(JobQueue &queue, Job &job)
+	{
+		std::lock_guard<std::mutex> lock(queue.lock);
+		if (queue.jobs.empty())
+			return false;
+		job = queue.jobs.front();
+		queue.jobs.pop_front();
+		return true;
+	}
+
+	bool findJob(Job &job)
+	{
+		if (_queued == 0)
+			return false;
+
+		bool found = popBack(ownQueue(), job);
+
+		/* threads outside of the pool don't steal */
+		ThreadInfo &self = currentThread();
+		if (self.pool == this)
+		{
+			int own = self.index, count = _workers.size(), outside = _outsideCount;
+
+			for (int i = 1 ; !found && i < count ; i++)
+				found = popFront(*_workers[(own + i) % count], job);
+
+			for (int i = 0 ; !found && i < outside ; i++)
+				found = popFront(_outside[i], job);
+
+			if (!found)
+				found = popFront(_shared, job);
+		}
+
+		if (found)
+			_queued--;
+		return found;
+	}
+
+	inline void execute(Job &job);
+
+	void workerMain(int index)
+	{
+		currentThread().pool = this;
+		currentThread().index = index;
+
+		for (;;)
+		{
+			Job job;
+			if (findJob(job)) {
+				execute(job);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(_sleepLock);
+			_sleeping++;
+			while (!_stop && _queued == 0)
+				_wake.wait(lock);
+			_sleeping--;
+
+			if (_stop)
+				return;
+		}
+	}
+
+	std::vector<Worker*> _workers;
+
+	/* queues of threads outside of the pool, and the one that the threads beyond them share */
+	enum { MAX_OUTSIDE_THREADS = 16 };
+	const unsigned int _serial;
+	std::mutex _outsideLock;
+	std::thread::id _outsideOwners[MAX_OUTSIDE_THREADS];
+	JobQueue _outside[MAX_OUTSIDE_THREADS];
+	std::atomic<int> _outsideCount;
+	JobQueue _shared;
+
+	std::atomic<int> _queued;
+	std::atomic<int> _sleeping;
+	std::mutex _sleepLock;
+	std::condition_variable _wake;
+	bool _stop;
+};
+
+/*
+ * Fork/join: tasks are spawned with run() and wait() returns when all of them are done.
+ * The waiting thread executes pending tasks meanwhile, so groups can be nested freely.
+ */
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool &pool = ThreadPool::global()) : _pool(pool), _pending(0) {}
+	~TaskGroup() { wait(); }
+
+	void run(const ThreadPool::Task &task)
+	{
+		if (_pool.isSingleThreaded()) {
+			task();
+			return;
+		}
+
+		_pending++;
+		ThreadPool::Job job = { task, this };
+		_pool.push(job);
+	}
+
+	void wait()
+	{
+		while (_pending > 0)
+		{
+			ThreadPool::Job job;
+			if (_pool.findJob(job))
+				_pool.execute(job);
+			else
+				std::this_thread::yield();
+		}
+	}
+
+private:
+	friend class ThreadPool;
+
+	ThreadPool &_pool;
+	std::atomic<int> _pending;
+};
+
+inline void ThreadPool::execute(Job &job)
+{
+	job.task();
+	job.group->_pending--;
+}
+
+/*
+ * Calls body(from, to) on subranges of [begin, end) in parallel, and returns when all are done.
+ * Ranges are at least 'grain' long, and there are a few per thread for load balancing
+ */
+template <class Body>
+void parallelFor(int begin, int end, int grain, const Body &body, ThreadPool &pool = ThreadPool::global())
+{
+	if (end <= begin)
+		return;
+
+	grain = std::max(grain, 1);
+
+	if (pool.isSingleThreaded() || end - begin <= grain) {
+		body(begin, end);
+		return;
+	}
+
+	int chunks = std::min((end - begin + grain - 1) / grain, pool.getConcurrency() * 4);
+	int step = (end - begin + chunks - 1) / chunks;
+
+	TaskGroup group(pool);
+
+	for (int from = begin + step ; from < end ; from += step) {
+		int to = std::min(from + step, end);
+		group.run([&body, from, to] { body(from, to); });
+	}
+
+	// first range is done by this thread
+	body(begin, std::min(begin + step, end));
+	group.wait();
+}
+
+#endif
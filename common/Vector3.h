@@ -152,6 +152,12 @@ public:
 		return *this;
 	}
 
+	bool operator == (const Vector3 &v2) const
+	{ return data[0] == v2.data[0] && data[1] == v2.data[1] && data[2] == v2.data[2]; }
+
+	bool operator != (const Vector3 &v2) const
+	{ return !(*this == v2); }
+
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	Vector3 operator -() const
 	{
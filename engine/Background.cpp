@@ -34,6 +34,7 @@ void Engine::resetBackground()
 	_backgroundSettings.mode = BackgroundParams::COLOR;
 	_backgroundSettings.textureScalingMode = BackgroundParams::STRETCH;
 	_backgroundSettings.textureFile = "";
+	bump(_backgroundVersion);
 }
 
 
@@ -58,6 +59,7 @@ void Engine::setBackGroundSettings(const BackgroundParams newSettings)
 	}
 
 	_backgroundSettings = newSettings;
+	bump(_backgroundVersion);
 }
 
 void Engine::renderBackground()
@@ -96,18 +98,20 @@ FogParams Engine::getFogParams()
 void Engine::setFogParams(const FogParams &params) 
 {
 	_fogParams = params;
+	bump(_fogVersion);
 }
 
 void Engine::resetFog() {
 	_fogParams.reset();
 	_fogParams.color = _backgroundSettings.color;
+	bump(_fogVersion);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void Engine::setupFogShaderData() 
+void Engine::setupFogShaderData(UniformBuffer &u) 
 {
-	ShaderFogData &fp = _shaderData.fogParams;
+	ShaderFogData &fp = u.fogParams;
 
 	fp.enabled = _fogParams.enabled;
 
@@ -35,6 +35,9 @@ Engine::Engine( void ) :
 	_invertNormals(false),
 	_invertFaces(false),
 	_texSampleMode(TMS_BILINEAR_MIPMAPS),
+	_textureCompression(false),
+	_textureStreaming(true),
+	_textureMapping(TEXTURE_MAPPING_MODEL),
 	_normalsScale (0.06),
 	_rotMode((ROTATION_MODE)(ROTATION_X | ROTATION_Y | ROTATION_Z)),
 
@@ -52,9 +55,26 @@ Engine::Engine( void ) :
 	_outputTexture(NULL),
 	_outputZBuffer(NULL),
 	_outputSelBuffer(NULL),
+	_abort(NULL),
+	_scaledOutput(NULL),
+	_frameSizeX(0),
+	_frameSizeY(0),
+	_jitterX(0),
+	_jitterY(0),
 
 	// cache
-	_shadowMapsValid(false),
+	_stateVersion(1),
+	_sceneVersion(1),
+	_cameraVersion(1),
+	_worldVersion(1),
+	_geometryVersion(1),
+	_lightsVersion(1),
+	_fogVersion(1),
+	_backgroundVersion(1),
+	_flagsVersion(1),
+	_normalsVersion(1),
+	_shadowParamsVersion(1),
+	_shadowMapsVersion(1),
 	_backgroundTexture(NULL)
 {
 
@@ -79,8 +99,16 @@ Engine::Engine( void ) :
 	createLighSourcesModels();
 	_projTR.setPerspectiveEnabled(false);
 
-	for (int i = 0 ; i < MAX_LIGHT*6 ; i++)
-		_shadowMaps[i] = NULL;
+	for (int i = 0 ; i < MAX_LIGHT*6 ; i++) {
+		_shadowMapSizes[i] = 0;
+		_shadowRenderers[i] = NULL;
+	}
+
+	for (int i = 0 ; i < MAX_LIGHT ; i++) {
+		_lightVersions[i] = 1;
+		_shadowCascades[i] = 0;
+		_shadowFootprints[i] = 1;
+	}
 
 	resetScene();
 }
@@ -90,10 +118,14 @@ Engine::Engine( void ) :
 void Engine::setRenderer(Renderer *renderer)
 {
 	_renderer = renderer;
+	bump(_cameraVersion);
 }
 
 void Engine::setOutput(Texture* output, int width, int height)
 {
+	// new output doesn't contain the last frame
+	if (output != _outputTexture)
+		_frameStage.invalidate();
 
 	_outputTexture = output;
 
@@ -120,8 +152,11 @@ void Engine::setOutput(Texture* output, int width, int height)
 		}
 	}
 
-	_outputSizeX = width;
-	_outputSizeY = height;
+	if (width != _outputSizeX || height != _outputSizeY) {
+		_outputSizeX = width;
+		_outputSizeY = height;
+		bump(_cameraVersion);
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -131,6 +166,7 @@ Engine::~Engine( void )
 	resetScene();
 	delete _outputSelBuffer;
 	delete _outputZBuffer;
+	delete _scaledOutput;
 
 	delete _light_dir_model;
 	delete _light_point_model;
@@ -231,6 +267,7 @@ void Engine::processScene()
 		// move model and the bounding box to the origin
 		item._mainModel->moveTo(item._modelBox.getCenter());
 		item._modelBox.moveTo(item._modelBox.getCenter());
+		item._mainModel->setTextureMapping(_textureMapping);
 
 		// and now create box model for the box.
 		item._boxModel = WireFrameModel::createBoxModel(item._modelBox, Color(0,0,1));
@@ -239,12 +276,17 @@ void Engine::processScene()
 	// load textures
 	reloadTextures();
 
+	for (unsigned int i = 0 ; i < _itemCount ; i++)
+		_sceneItems[i]._materialSnapshot = MaterialSnapshot(_sceneItems[i]._material);
+
 
 	Vector3 center = _initialsceneBox.getCenter();
 	_initialsceneBox.moveTo(center);
 	_sceneBox = _initialsceneBox;
 	_sceneBoxModel = WireFrameModel::createBoxModel(_sceneBox, Color(0,0,1));
 	_axesModel = WireFrameModel::createAxisModel(0.5 / calculateInitialScaleFactor());
+
+	bump(_sceneVersion);
 }
 
 
@@ -252,6 +294,9 @@ void Engine::processScene()
 
 void Engine::resetScene()
 {
+	// textures of the scene that didn't start loading yet, the others are released when they are loaded
+	_textureStreamer.cancelRequests();
+
 	_itemCount = 0;
 	delete [] _sceneItems;
 	_sceneItems = NULL;
@@ -265,6 +310,7 @@ void Engine::resetScene()
 	_invertFaces = false;
 	_invertNormals = false;
 
+	bump(_sceneVersion);
 	invalidateShadowMaps();
 	freeShadowMaps();
 
@@ -282,6 +328,8 @@ void Engine::setDrawSeperateObjects( bool enable )
 	if (_drawSeparateObjects)
 		_selObj = -1;
 
+	bump(_flagsVersion);
+
 	// update output buffers
 	setOutput(_outputTexture, _outputSizeX, _outputSizeY);
 }
@@ -300,6 +348,12 @@ bool Engine::selectObject( int mouseCX, int mouseCY )
 	/* the current candidate fro selection */
 	assert(_outputSelBuffer);
 
+	// last frame might have been rendered at reduced resolution
+	if (_frameSizeX && _frameSizeY) {
+		mouseCX = min(mouseCX * _frameSizeX / _outputSizeX, _frameSizeX - 1);
+		mouseCY = min(mouseCY * _frameSizeY / _outputSizeY, _frameSizeY - 1);
+	}
+
 	int candidateObject = _outputSelBuffer->getPixelValue(mouseCX,mouseCY) - 1;
 
 	// didn't select anything or selected the same object
@@ -307,6 +361,7 @@ bool Engine::selectObject( int mouseCX, int mouseCY )
 		return false;
 
 	_selObj = candidateObject;
+	bump(_flagsVersion);
 	return true;
 }
 
@@ -321,7 +376,7 @@ void Engine::setInvertNormals( bool enable )
 		_sceneItems[i]._mainModel->invertVertexNormals();
 
 	_invertNormals = enable;
-	invalidateNormalModels();
+	bump(_normalsVersion);
 }
 
 void Engine::setInvertFaces( bool enable )
@@ -333,7 +388,7 @@ void Engine::setInvertFaces( bool enable )
 		_sceneItems[i]._mainModel->invertPolygonNormals();
 
 	_invertFaces = enable;
-	invalidateNormalModels();
+	bump(_normalsVersion);
 }
 
 void Engine::invalidateNormalModels()
@@ -354,12 +409,24 @@ void Engine::invalidateNormalModels()
 
 void Engine::createNormalModels()
 {
+	if (!_flags.drawVertexNormals && !_flags.drawFaces)
+		return;
+
 	double scalefactor = _normalsScale / calculateInitialScaleFactor();
 
 	for (unsigned int i = 0 ; i < _itemCount ; i++) 
 	{
 		SceneItem &item = _sceneItems[i];
 
+		// drop the models if they were created with different scale or normals
+		if (_stageStats.needsUpdate(item._normalsStage, _normalsVersion + _sceneVersion, STAGE_NORMAL_MODELS))
+		{
+			delete item._polygonNormalModel;
+			delete item._vertexNormalModel;
+			item._polygonNormalModel = NULL;
+			item._vertexNormalModel = NULL;
+		}
+
 		Mat4 normalScale = _mainTR.getInvScaleMatrix() * item._itemTR.getInvScaleMatrix();
 
 		try {
@@ -383,13 +450,57 @@ void Engine::createNormalModels()
 
 void Engine::setNormalScale(double newscale)
 {
-	invalidateNormalModels();
 	_normalsScale = newscale;
+	bump(_normalsVersion);
 }
 
 
 void Engine::setEngineOperationFlags(const EngineOperationFlags newFlags)
 {
 	_flags = newFlags;
-	_cameraTR.setInvert(_flags.leftcoordinateSystem);
+	bump(_flagsVersion);
+
+	if (_cameraTR.getInvert() != _flags.leftcoordinateSystem) {
+		_cameraTR.setInvert(_flags.leftcoordinateSystem);
+		bump(_cameraVersion);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Engine::detectStateChanges()
+{
+	for (int i = 0 ; i < MAX_LIGHT ; i++)
+	{
+		if (_lightParams[i] != _lightSnapshots[i]) {
+			_lightSnapshots[i] = _lightParams[i];
+			bump(_lightVersions[i]);
+			bump(_lightsVersion);
+		}
+	}
+
+	if (_ambientLight != _ambientSnapshot) {
+		_ambientSnapshot = _ambientLight;
+		bump(_lightsVersion);
+	}
+
+	bool materialsChanged = false;
+
+	for (unsigned int i = 0 ; i < _itemCount ; i++)
+	{
+		SceneItem &item = _sceneItems[i];
+		MaterialSnapshot current(item._material);
+
+		if (!(current == item._materialSnapshot)) {
+			item._materialSnapshot = current;
+			bump(item._materialVersion);
+			materialsChanged = true;
+		}
+	}
+
+	// texture might have been changed too
+	if (materialsChanged)
+		reloadTextures();
+
+	updateStreamedTextures();
 }
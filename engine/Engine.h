@@ -23,13 +23,50 @@
 #include "common/Vector4.h"
 #include "common/BBox.h"
 #include "renderer/Texture.h"
+#include "renderer/ShadowAtlas.h"
+#include "renderer/BVH.h"
 #include "model/Model.h"
 #include "Shaders.h"
 #include "Transformations.h"
+#include "Invalidation.h"
 #include "EngineAPI.h"
+#include "TextureStreamer.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
 
 class Renderer;
 
+/* effective values of a material, used to detect changes done through references we give out */
+struct MaterialSnapshot
+{
+	MaterialSnapshot() : ambient(0), diffuse(0), specular(0), shineness(0), scaleX(0), scaleY(0) {}
+
+	explicit MaterialSnapshot(MaterialParams &m) :
+		ambient(m.getAmbient()), diffuse(m.getDiffuse()), specular(m.getSpecular()),
+		shineness(m.getShineness()), objectColor(m.getObjectColor()),
+		texture(m.getObjectTexture()), scaleX(m.getscaleX()), scaleY(m.getscaleY())
+	{}
+
+	bool operator==(const MaterialSnapshot &other) const
+	{
+		return
+			ambient == other.ambient && diffuse == other.diffuse && specular == other.specular &&
+			shineness == other.shineness && objectColor == other.objectColor &&
+			texture == other.texture && scaleX == other.scaleX && scaleY == other.scaleY;
+	}
+
+	double ambient;
+	double diffuse;
+	double specular;
+	int shineness;
+	Color objectColor;
+	std::string texture;
+	int scaleX;
+	int scaleY;
+};
 
 struct SceneItem 
 {
@@ -38,7 +75,11 @@ struct SceneItem
 		_boxModel(NULL),
 		_vertexNormalModel(NULL),
 		_polygonNormalModel(NULL),
-		texture(NULL)
+		texture(NULL),
+		textureLayout(TEXTURE_LAYOUT_TILED),
+		textureRequested(false),
+		_transformVersion(1),
+		_materialVersion(1)
 	{}
 
 	~SceneItem() 
@@ -69,6 +110,20 @@ struct SceneItem
 	const Texture *texture;
 	int texScaleX;
 	int texScaleY;
+
+	// texture the material asks for, and if it was already requested from the streamer (see Engine::reloadTextures)
+	std::string textureFile;
+	TEXTURE_LAYOUT textureLayout;
+	bool textureRequested;
+
+	// versions of item state and caches that depend on it
+	StateVersion _transformVersion;
+	StateVersion _materialVersion;
+	MaterialSnapshot _materialSnapshot;
+
+	UniformBuffer _uniforms;
+	CachedStage _uniformsStage;
+	CachedStage _normalsStage;
 };
 
 class Engine
@@ -101,15 +156,15 @@ public:
 	// camera settings
 	void rotateCamera(int axis, double angleDelta);
 	void moveCamera(int axis, double delta);
-	void setOrtographicRendering() {_projTR.setPerspectiveEnabled(false);}
-	void setPerspectiveRendering() {_projTR.setPerspectiveEnabled(true);}
+	void setOrtographicRendering() {_projTR.setPerspectiveEnabled(false); bump(_cameraVersion); }
+	void setPerspectiveRendering() {_projTR.setPerspectiveEnabled(true); bump(_cameraVersion); }
 	bool isPerspectiveRendering() const { return _projTR.getPerspectiveEnabled(); }
 	void setPerspectiveD(double d);
 	double getPerspectiveD() const  { return _projTR.getDistance(); }
 
 	// shading mode
 	enum SHADING_MODE getShadingMode()  { return _shadingMode; };
-	void setShadingMode(enum SHADING_MODE mode) { _shadingMode = mode; };
+	void setShadingMode(enum SHADING_MODE mode) { _shadingMode = mode; bump(_flagsVersion); };
 
 
 	// lighting settings
@@ -143,8 +198,23 @@ public:
 	double getNormalScale() { return _normalsScale; }
 	void setNormalScale(double newscale);
 	TextureSampleMode getTextureSampleMode() { return _texSampleMode; }
-	void setTextureSampleMode(TextureSampleMode mode) { _texSampleMode = mode; }
-	void resetTextureSampleMode() { _texSampleMode = TMS_BILINEAR_MIPMAPS; }
+	void setTextureSampleMode(TextureSampleMode mode) { _texSampleMode = mode; bump(_flagsVersion); }
+	void resetTextureSampleMode() { setTextureSampleMode(TMS_BILINEAR_MIPMAPS); }
+	bool getTextureCompression() const { return _textureCompression; }
+	void setTextureCompression(bool enable);
+
+	/*
+	 * With streaming, the texture of an item is loaded in the background once the item is first drawn,
+	 * and the item is drawn in the color of its material until then. The callback is called (on the
+	 * loading thread) after each texture is loaded, and the next frame shows it
+	 */
+	bool getTextureStreaming() const { return _textureStreaming; }
+	void setTextureStreaming(bool enable);
+	void setTextureLoadedCallback(const std::function<void()> &callback) { _textureStreamer.setCallback(callback); }
+
+	// texture coordinates of all models, generated when the scene is loaded and when this is changed
+	TEXTURE_MAPPING getTextureMapping() const { return _textureMapping; }
+	void setTextureMapping(TEXTURE_MAPPING mapping);
 	void setInvertNormals(bool enable);
 	bool getInvertNormals() { return _invertNormals; }
 	void setInvertFaces(bool enable);
@@ -158,11 +228,25 @@ public:
 	bool getDrawSeparateObjects() { return _drawSeparateObjects; }
 
 
-	// rendering
-	void render();
+	// rendering, returns false if the frame was aborted
+	bool render();
+
+	// when the flag is set, rendering stops as soon as possible
+	void setAbortFlag(const std::atomic<bool> *abort);
+
+	// sub-pixel offset of the frame, in pixels of the output
+	void setJitter(double x, double y);
 
-	// debug access for shadow maps
-	const DepthTexture* getShadowMap(int i)  { return _shadowMaps[i]; }
+	// quality the frame may be degraded to, for interactive rendering
+	RenderQuality getRenderQuality() const { return _quality; }
+	void setRenderQuality(const RenderQuality &quality);
+
+	// memory taken by shadow maps and their caches, in bytes
+	size_t getShadowMemoryUsage() const;
+
+	// statistics of the caching between frames
+	EngineStageStats getStageStats(ENGINE_STAGE stage) const { return _stageStats.get(stage); }
+	void resetStageStats() { _stageStats.reset(); }
 
 private:
 	// all the objects to render and their properties
@@ -185,6 +269,8 @@ private:
 	EngineOperationFlags _flags;
 	FogParams _fogParams;
 	ShadowParams _shadowParams;
+	ShadowParams _activeShadowParams;	/* _shadowParams limited by _quality */
+	RenderQuality _quality;
 	BackgroundParams _backgroundSettings;
 
 	bool _drawSeparateObjects;
@@ -192,6 +278,9 @@ private:
 	bool _invertFaces;
 	double _normalsScale;
 	TextureSampleMode _texSampleMode;
+	bool _textureCompression;
+	bool _textureStreaming;
+	TEXTURE_MAPPING _textureMapping;
 	SHADING_MODE _shadingMode;
 	ROTATION_MODE _rotMode;
 
@@ -202,11 +291,45 @@ private:
 
 	// shader data and its setup
 	UniformBuffer _shaderData;
-	void setupTransformationShaderData(int objectID);
-	void setupLightingShaderData(int objectID);
-	void setupFogShaderData();
-	void setupMaterialsShaderData(int objectID);
-	void setupShadowMapShaderData(int objectID);
+	void setupTransformationShaderData(UniformBuffer &u, int objectID);
+	void setupLightingShaderData(UniformBuffer &u, int objectID);
+	void setupFogShaderData(UniformBuffer &u);
+	void setupMaterialsShaderData(UniformBuffer &u, int objectID);
+	void setupShadowMapShaderData(UniformBuffer &u, int objectID);
+	void setupShadowCoordinates(ShaderLightData &light);
+	void setupShadowCubeFaces(ShaderLightData &light, int lightIndex);
+	UniformBuffer* getItemShaderData(int objectID);
+
+	/*
+	 * Versions of the engine state (see Invalidation.h)
+	 * Lights and materials are also changed in place via pointers we give out,
+	 * so these are compared against snapshots at start of each frame
+	 */
+	StateVersion _stateVersion;		/* bumped together with any other version */
+	StateVersion _sceneVersion;
+	StateVersion _cameraVersion;
+	StateVersion _worldVersion;
+	StateVersion _geometryVersion;	/* bumped together with any item transform version */
+	StateVersion _lightVersions[MAX_LIGHT];
+	StateVersion _lightsVersion;	/* bumped together with any light version */
+	StateVersion _fogVersion;
+	StateVersion _backgroundVersion;
+	StateVersion _flagsVersion;
+	StateVersion _normalsVersion;
+	StateVersion _shadowParamsVersion;
+	StateVersion _shadowMapsVersion;
+
+	LightSource _lightSnapshots[MAX_LIGHT];
+	LightSource _ambientSnapshot;
+
+	void bump(StateVersion &version) { version++; _stateVersion++; }
+	void bumpItemTransform(SceneItem &item) { bump(item._transformVersion); bump(_geometryVersion); }
+	void detectStateChanges();
+
+	// cached stages
+	CachedStage _shadowMapStages[MAX_LIGHT];
+	CachedStage _frameStage;
+	StageStatistics _stageStats;
 
 
 	/* output buffers */
@@ -217,10 +340,57 @@ private:
 	IntegerTexture* _outputSelBuffer;
 	Renderer *_renderer;
 
+	const std::atomic<bool> *_abort;
+	bool isAborted() const { return _abort && _abort->load(std::memory_order_relaxed); }
+
+	/* reduced resolution frame, upscaled into output texture */
+	Texture* _scaledOutput;
+	int _frameSizeX;
+	int _frameSizeY;
+	double _jitterX;
+	double _jitterY;
+
 	// shadow maps
-	DepthTexture* _shadowMaps[MAX_LIGHT*6];
+	ShadowAtlas _shadowAtlas;
+	ShadowAtlasRegion _shadowRegions[MAX_LIGHT*6];
 	Mat4 _shadowMapsMatrices[MAX_LIGHT*6];
-	bool _shadowMapsValid;
+	int _shadowCascades[MAX_LIGHT];
+
+	/* resolution the maps are set up with, before they are fitted into the atlas */
+	int _shadowMapSizes[MAX_LIGHT*6];
+	double _shadowFootprints[MAX_LIGHT];	/* part of the screen the maps of the light cover */
+
+	/* maps are rendered into these, and stored into the atlas after that */
+	std::vector<DepthTexture*> _shadowScratch;
+	std::mutex _shadowScratchLock;
+
+	/* each map has a renderer of its own, so that all maps can be rendered in parallel */
+	Renderer* _shadowRenderers[MAX_LIGHT*6];
+
+	/*
+	 * polygons of each item that fall into each face of a point light (offsets into geometry of the item),
+	 * found in one pass over the vertices before the faces are rendered. Empty for other maps
+	 */
+	std::vector<std::vector<unsigned int> > _shadowFacePolygons[MAX_LIGHT*6];
+
+	/*
+	 * static layer of the maps (in the atlas) - depth of the items that didn't move since it was rendered.
+	 * Maps are composed from a copy of it and the items that moved since then
+	 */
+	CachedStage _staticShadowStages[MAX_LIGHT];
+	BOUNDING_BOX _staticShadowBoxes[MAX_LIGHT];				/* scene box the maps were fitted to */
+	std::vector<StateVersion> _staticShadowItems[MAX_LIGHT];	/* item transform versions in the layer, 0 for dynamic items */
+
+	/* transform versions of the dynamic items at the last update of the maps, and for how many updates they kept them */
+	struct DynamicShadowItem { StateVersion version; int stillUpdates; };
+	std::vector<DynamicShadowItem> _dynamicShadowItems[MAX_LIGHT];
+
+	/* all polygons of the scene in world space, when shadows are ray traced instead of the maps */
+	BVH _shadowBVH;
+	CachedStage _shadowBVHStage;
+
+	/* shadows of the frame at half resolution, made before the frame is shaded */
+	ShadowMask _shadowMask;
 
 	// background texture
 	const Texture* _backgroundTexture;
@@ -242,9 +412,28 @@ private:
 	void recomputeBoundingBox();
 	void reloadTextures();
 
-	void createShadowMap(int i, const Vector3 &direction, const Vector3 &position, bool projective, double maxFov);
+	// texture streaming
+	TextureStreamer _textureStreamer;
+	void requestTexture(SceneItem &item, const Mat4 &objectToClip);
+	void updateStreamedTextures();
+
+	void createShadowMap(int i, const Vector3 &direction, const Vector3 &position, bool projective, double maxFov,
+			int resolution, double sliceNear = 0, double sliceFar = 0);
+	int createCascadedShadowMaps(int light, const Vector3 &direction);
+	void layoutShadowAtlas(bool render[], bool renderStatic[]);
+	double getShadowMapFootprint(int i);
+	void renderShadowMap(int i, bool renderStatic);
+	DepthTexture* acquireShadowScratch(int size);
+	void releaseShadowScratch(DepthTexture *texture);
+	void renderShadowCaster(Renderer *renderer, unsigned int item, int i);
 	void updateShadowMaps();
+	void updateShadowBVH();
+	bool useShadowMask() const;
+	void renderShadowMask(int width, int height);
 	void freeShadowMaps();
+	void updateActiveShadowParams();
+
+	void renderFrame(Texture *target, int width, int height);
 
 	void renderBackground();
 	void renderMiscModelWireframe(const WireFrameModel *m, Color c = Color(0,0,0), bool colorValid = false);
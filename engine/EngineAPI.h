@@ -20,6 +20,7 @@
 #define ENGINE_API_H
 
 #include <string>
+#include "common/Vector3.h"
 
 //////////////////////////////////////////////////////////////////////////////////////////////
 enum SHADING_MODE
@@ -37,7 +38,9 @@ enum TextureSampleMode
 {
 	TMS_NEARST,
 	TMS_BILINEAR,
-	TMS_BILINEAR_MIPMAPS
+	TMS_BILINEAR_MIPMAPS,
+	TMS_TRILINEAR,
+	TMS_ANISOTROPIC
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////////
@@ -96,9 +99,20 @@ struct LightSource
 	{
 		reset();
 	}
+
+	bool operator==(const LightSource &other) const
+	{
+		return
+			enabled == other.enabled && type == other.type && space == other.space &&
+			color == other.color && position == other.position && direction == other.direction &&
+			cutoffAngle == other.cutoffAngle && shadow == other.shadow && debugDraw == other.debugDraw;
+	}
+
+	bool operator!=(const LightSource &other) const { return !(*this == other); }
 };
 
 #define MAX_LIGHT 8
+#define MAX_SHADOW_CASCADES 4
 
 //////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -151,16 +165,68 @@ struct ShadowParams
 	bool poison;
 	int pcf_taps;
 
+	/*
+	 * variance shadow maps - instead of PCF, maps are blurred once after they are rendered
+	 * with a box filter of vsm_kernel texels, and each shaded pixel reads them just once
+	 */
+	bool vsm;
+	int vsm_kernel;
+
 	/* shadow map resolution */
 	int shadowMapRes;
 
+	/*
+	 * all maps are kept in one atlas of shadow_memory MB, with depth stored as 16 or 24 bit
+	 * normalized values (depth_bits), and the moments of variance shadow maps as two 16 bit values.
+	 * Lights that cover less of the screen get smaller maps, and the less important ones are made
+	 * smaller when the maps don't fit in the atlas
+	 */
+	int shadow_memory;
+	int depth_bits;
+
+	/* depth bias added when the map is rendered, times the depth slope of the polygon in map texels */
+	double z_bias_slope;
+
+	/*
+	 * number of depth slices of the view the shadow of directional lights is split to,
+	 * each slice has its own map of half the resolution. 1 is a single map for whole scene
+	 */
+	int cascades;
+
+	/*
+	 * phong shading interpolates the position in the maps from the vertices,
+	 * instead of transforming the position of each pixel to light space
+	 */
+	bool vertex_coords;
+
+	/*
+	 * instead of the maps, trace a ray from each shaded point toward each light through
+	 * a BVH of the whole scene. Exact hard shadows, at a cost that grows with the number of pixels
+	 */
+	bool ray_traced;
+
+	/*
+	 * phong shading reads the shadows from a mask made at half resolution from a depth only pass
+	 * over the frame, instead of sampling the maps (or tracing rays) for each shaded pixel
+	 */
+	bool half_res_mask;
+
 	void reset() {
 		pcf = true;
 		poison = true;
 		pcf_taps = 4;
+		vsm = false;
+		vsm_kernel = 7;
 		z_bias_max = 0.01;
 		z_bias_mul = 0.05;
 		shadowMapRes = 1024;
+		shadow_memory = 64;
+		depth_bits = 16;
+		z_bias_slope = 0;
+		cascades = 3;
+		vertex_coords = true;
+		ray_traced = false;
+		half_res_mask = false;
 	}
 
 	ShadowParams() { reset(); }
@@ -168,6 +234,33 @@ struct ShadowParams
 
 //////////////////////////////////////////////////////////////////////////////////////////////
 
+/* How much the engine may degrade the frame to render it faster */
+struct RenderQuality
+{
+	/* fraction of the output resolution to render at, the result is upscaled to the output */
+	double resolutionScale;
+
+	/* limits on shadow settings, 0 means to use the ShadowParams as is */
+	int maxShadowMapRes;
+	int maxPcfTaps;
+
+	/* skip shadows and texture filtering altogether */
+	bool shadows;
+	bool nearestSampling;
+
+	void reset() {
+		resolutionScale = 1.0;
+		maxShadowMapRes = 0;
+		maxPcfTaps = 0;
+		shadows = true;
+		nearestSampling = false;
+	}
+
+	RenderQuality() { reset(); }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+
 struct EngineOperationFlags
 {
 	/* here we put all engine tweak flags that don't deserve its own getter/setter*/
@@ -214,4 +307,26 @@ enum ROTATION_MODE
 	ROTATION_Z = 4
 };
 
+//////////////////////////////////////////////////////////////////////////////////////////////
+
+/* Stages of the frame that engine caches between frames */
+enum ENGINE_STAGE
+{
+	STAGE_SHADOW_MAPS,		/* per light shadow maps */
+	STAGE_STATIC_SHADOW_MAPS,	/* static layer of the shadow maps */
+	STAGE_SHADOW_BVH,		/* BVH of the scene for ray traced shadows */
+	STAGE_UNIFORMS,			/* per item shader uniforms */
+	STAGE_NORMAL_MODELS,	/* per item normal visualization models */
+	STAGE_FRAME,			/* whole output frame */
+	STAGE_COUNT
+};
+
+struct EngineStageStats
+{
+	unsigned long hits;
+	unsigned long misses;
+
+	EngineStageStats() : hits(0), misses(0) {}
+};
+
 #endif
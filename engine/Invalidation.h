@@ -0,0 +1,75 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef INVALIDATION_H
+#define INVALIDATION_H
+
+#include "EngineAPI.h"
+
+/*
+ * Version of a piece of engine state.
+ * It is bumped on every change and never goes back, therefore sum of versions of several
+ * pieces of state changes whenever any one of them changes, and can be used as a cache key
+ */
+typedef unsigned long StateVersion;
+
+/* Remembers the version of the inputs a cached result was computed from */
+class CachedStage
+{
+public:
+	CachedStage() : _key(0), _valid(false) {}
+
+	bool isValid(StateVersion key) const { return _valid && _key == key; }
+	void validate(StateVersion key) { _key = key; _valid = true; }
+	void invalidate() { _valid = false; }
+
+private:
+	StateVersion _key;
+	bool _valid;
+};
+
+/* Hit/miss accounting of all the cached stages */
+class StageStatistics
+{
+public:
+	/* check a stage, account the result and return true if it needs to be recomputed */
+	bool needsUpdate(CachedStage &stage, StateVersion key, ENGINE_STAGE id)
+	{
+		if (stage.isValid(key)) {
+			_stats[id].hits++;
+			return false;
+		}
+
+		_stats[id].misses++;
+		stage.validate(key);
+		return true;
+	}
+
+	EngineStageStats get(ENGINE_STAGE id) const { return _stats[id]; }
+
+	void reset()
+	{
+		for (int i = 0 ; i < STAGE_COUNT ; i++)
+			_stats[i] = EngineStageStats();
+	}
+
+private:
+	EngineStageStats _stats[STAGE_COUNT];
+};
+
+#endif
@@ -23,13 +23,13 @@
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void Engine::setupLightingShaderData(int objectID) 
+void Engine::setupLightingShaderData(UniformBuffer &u, int objectID) 
 {
 	SceneItem &currentItem = _sceneItems[objectID];
 	MaterialParams *material = &currentItem._material;
 
 	/* setup other lights*/
-	_shaderData.lightsCount = 0;
+	u.lightsCount = 0;
 	for (int i = 0 ; i < MAX_LIGHT ; i++) 
 	{
 		LightSource &lp = _lightParams[i];
@@ -37,7 +37,7 @@ void Engine::setupLightingShaderData(int objectID)
 		if (!lp.enabled)
 			continue;
 
-		ShaderLightData &light = _shaderData.lights[_shaderData.lightsCount++];
+		ShaderLightData &light = u.lights[u.lightsCount++];
 		light.is_point = lp.type == LightSource::LIGHT_TYPE_POINT || lp.type == LightSource::LIGHT_TYPE_SPOT;
 		light.is_spot = lp.type == LightSource::LIGHT_TYPE_SPOT;
 
@@ -81,7 +81,6 @@ void Engine::resetLighting()
 	_lightParams[0].space = LightSource::LIGHT_SPACE_VIEW;
 	_lightParams[0].direction = Vector3(0,0,-1);
 	_lightParams[0].color = Color(255,255,255);
-	invalidateShadowMaps();
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -30,19 +30,148 @@ void Engine::resetMaterials()
 
 void Engine::reloadTextures()
 {
+	TEXTURE_LAYOUT layout = _textureCompression ? TEXTURE_LAYOUT_COMPRESSED : TEXTURE_LAYOUT_TILED;
+
+	std::vector<unsigned int> items;
+	std::vector<std::string> files;
+
 	for (unsigned int i = 0 ; i < _itemCount ; i++) 
 	{
 		SceneItem &item = _sceneItems[i];
 		std::string file = item._material.getObjectTexture();
 
-		if (!item.texture || file != item.texture->getFilename()) 
+		bool loaded = item.texture && file == item.texture->getFilename() && layout == item.texture->getLayout();
+		bool requested = item.textureRequested && file == item.textureFile && layout == item.textureLayout;
+
+		item.textureFile = file;
+		item.textureLayout = layout;
+
+		if (loaded || requested) {
+			item.textureRequested = true;
+			continue;
+		}
+
+		// a texture only in another layout is still drawn until the new one replaces it
+		if (item.texture && file != item.texture->getFilename()) {
+			Texture::unloadCached(item.texture);
+			item.texture = NULL;
+		}
+
+		// streamed textures are requested when the item is first drawn (see requestTexture)
+		if (_textureStreaming && !file.empty()) {
+			item.textureRequested = false;
+			continue;
+		}
+
+		if (item.texture) Texture::unloadCached(item.texture);
+		item.texture = NULL;
+		item.textureRequested = true;
+		items.push_back(i);
+		files.push_back(file);
+	}
+
+	// all the textures of the scene are decoded at the same time
+	std::vector<const Texture*> textures;
+	Texture::loadCached(files, true, layout, textures);
+
+	for (unsigned int i = 0 ; i < items.size() ; i++) 
+	{
+		SceneItem &item = _sceneItems[items[i]];
+		item.texture = textures[i];
+		item.texScaleX = item._material.getscaleX();
+		item.texScaleY = item._material.getscaleY();
+	}
+}
+
+void Engine::setTextureCompression(bool enable)
+{
+	if (enable == _textureCompression)
+		return;
+
+	_textureCompression = enable;
+	reloadTextures();
+	bump(_flagsVersion);
+}
+
+void Engine::setTextureStreaming(bool enable)
+{
+	if (enable == _textureStreaming)
+		return;
+
+	_textureStreaming = enable;
+	reloadTextures();
+	bump(_flagsVersion);
+}
+
+void Engine::setTextureMapping(TEXTURE_MAPPING mapping)
+{
+	if (mapping == _textureMapping)
+		return;
+
+	_textureMapping = mapping;
+
+	for (unsigned int i = 0 ; i < _itemCount ; i++) {
+		_sceneItems[i]._mainModel->setTextureMapping(mapping);
+		bump(_sceneItems[i]._materialVersion);
+	}
+}
+
+void Engine::requestTexture(SceneItem &item, const Mat4 &objectToClip)
+{
+	if (item.textureRequested)
+		return;
+
+	// items that are entirely outside of the view don't need their texture yet
+	const Vector3 &a = item._modelBox.point1;
+	const Vector3 &b = item._modelBox.point2;
+	int outside = ~0;
+
+	for (int corner = 0 ; corner < 8 && outside ; corner++)
+	{
+		Vector4 p = vmul4point(Vector3(corner & 1 ? b.x() : a.x(), corner & 2 ? b.y() : a.y(), corner & 4 ? b.z() : a.z()), objectToClip);
+		int code = 0;
+
+		if (p.x() < -p.w()) code |= 1;
+		if (p.x() > p.w()) code |= 2;
+		if (p.y() < -p.w()) code |= 4;
+		if (p.y() > p.w()) code |= 8;
+		if (p.w() <= 0) code |= 16;
+		outside &= code;
+	}
+
+	if (outside)
+		return;
+
+	item.textureRequested = true;
+	_textureStreamer.request(item.textureFile, item.textureLayout);
+}
+
+void Engine::updateStreamedTextures()
+{
+	std::vector<TextureStreamer::Request> loaded;
+	_textureStreamer.takeLoaded(loaded);
+
+	for (unsigned int i = 0 ; i < loaded.size() ; i++)
+	{
+		const TextureStreamer::Request &r = loaded[i];
+
+		// several items can share a texture, each one keeps a reference of its own
+		for (unsigned int j = 0 ; j < _itemCount && r.texture ; j++)
 		{
+			SceneItem &item = _sceneItems[j];
+
+			if (item.texture == r.texture || item.textureFile != r.file || item.textureLayout != r.layout)
+				continue;
+
 			if (item.texture) Texture::unloadCached(item.texture);
-			item.texture = NULL;
-			item.texture = Texture::loadCached(file.c_str(), true);
+			item.texture = Texture::loadCached(r.file.c_str(), true, r.layout);
 			item.texScaleX = item._material.getscaleX();
 			item.texScaleY = item._material.getscaleY();
+			bump(item._materialVersion);
 		}
+
+		// textures of items that changed (or of a scene that was closed) since they were requested are released here
+		if (r.texture) Texture::unloadCached(r.texture);
 	}
 }
 
@@ -55,7 +184,7 @@ MaterialParams& Engine::getMatrialParams()
 
 
 
-void Engine::setupMaterialsShaderData( int objectID )
+void Engine::setupMaterialsShaderData( UniformBuffer &u, int objectID )
 {
 	SceneItem &currentItem = _sceneItems[objectID];
 
@@ -63,21 +192,21 @@ void Engine::setupMaterialsShaderData( int objectID )
 	MaterialParams *material = &currentItem._material;
 
 	/* setup misc settings*/
-	_shaderData.textureSampler.bindTexture(currentItem.texture);
-	_shaderData.shineness = material->getShineness();
-	_shaderData.lightBackfaces = _flags.twofaceLighting;
-	_shaderData.kA =  (_ambientLight.color / 255) * material->getAmbient();
-	_shaderData.objectColor =  material->getObjectColor() / 255;
+	u.textureSampler.bindTexture(currentItem.texture);
+	u.shineness = material->getShineness();
+	u.lightBackfaces = _flags.twofaceLighting;
+	u.kA =  (_ambientLight.color / 255) * material->getAmbient();
+	u.objectColor =  material->getObjectColor() / 255;
 
-	if (_shaderData.textureSampler.isBound()) 
+	if (u.textureSampler.isBound()) 
 	{
-		_shaderData.textureSampler.setScale(
+		u.textureSampler.setScale(
 			currentItem.texture->getWidth() * currentItem.texScaleX, 
 			currentItem.texture->getHeight() * currentItem.texScaleY
 		);
 	}
 
-	_shaderData.sampleMode = _texSampleMode;
-	_shaderData.facesReversed = translateFaceType(FACE_FRONT) == FACE_BACK && translateFaceType(FACE_BACK) == FACE_FRONT;
-	_shaderData.forceFrontFaces = translateFaceType(FACE_BACK) == FACE_FRONT && translateFaceType(FACE_FRONT) == FACE_FRONT;
+	u.sampleMode = _quality.nearestSampling ? TMS_NEARST : _texSampleMode;
+	u.facesReversed = translateFaceType(FACE_FRONT) == FACE_BACK && translateFaceType(FACE_BACK) == FACE_FRONT;
+	u.forceFrontFaces = translateFaceType(FACE_BACK) == FACE_FRONT && translateFaceType(FACE_FRONT) == FACE_FRONT;
 }
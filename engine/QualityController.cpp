@@ -0,0 +1,129 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "QualityController.h"
+#include <stdio.h>
+
+struct QualityLevel
+{
+	double resolutionScale;
+	int maxShadowMapRes;
+	int maxPcfTaps;
+};
+
+/* from full quality to the fastest one, each level is about 1.5-2 times faster than previous */
+static const QualityLevel qualityLevels[] =
+{
+	{ 1.0,  0,   0 },
+	{ 1.0,  512, 2 },
+	{ 0.75, 512, 1 },
+	{ 0.5,  256, 1 },
+	{ 0.35, 256, 1 },
+	{ 0.25, 128, 1 },
+};
+
+static const int levelCount = sizeof(qualityLevels) / sizeof(qualityLevels[0]);
+
+/* number of frames that have to be fast before going up in quality */
+static const int fastFramesToUpgrade = 3;
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+QualityController::QualityController() :
+	_enabled(true), _logging(false), _interacting(false),
+	_targetFrameTime(33), _level(0), _averageFrameTime(0), _fastFrames(0)
+{
+}
+
+void QualityController::setEnabled(bool enable)
+{
+	_enabled = enable;
+	if (!_enabled)
+		endInteraction();
+}
+
+void QualityController::beginInteraction()
+{
+	if (!_enabled || _interacting)
+		return;
+
+	_interacting = true;
+	_averageFrameTime = 0;
+	_fastFrames = 0;
+}
+
+void QualityController::endInteraction()
+{
+	_interacting = false;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void QualityController::frameRendered(double msec)
+{
+	if (_logging)
+		printf("quality: level %d (scale %.2f, shadow map %d, pcf taps %d) frame %.1f msec\n",
+				getLevel(), getQuality().resolutionScale,
+				getQuality().maxShadowMapRes, getQuality().maxPcfTaps, msec);
+
+	if (!_interacting)
+		return;
+
+	_averageFrameTime = _averageFrameTime ? (_averageFrameTime * 0.5 + msec * 0.5) : msec;
+
+	if (_averageFrameTime > _targetFrameTime && _level < levelCount - 1)
+	{
+		/* too slow - degrade right away */
+		_level++;
+		_averageFrameTime = 0;
+		_fastFrames = 0;
+
+	} else if (_averageFrameTime < _targetFrameTime / 2 && _level > 0)
+	{
+		/* well within budget - improve, but only if that stays so for a while */
+		if (++_fastFrames >= fastFramesToUpgrade) {
+			_level--;
+			_averageFrameTime = 0;
+			_fastFrames = 0;
+		}
+	} else
+		_fastFrames = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+RenderQuality QualityController::getQuality() const
+{
+	const QualityLevel &l = qualityLevels[getLevel()];
+
+	RenderQuality quality;
+	quality.resolutionScale = l.resolutionScale;
+	quality.maxShadowMapRes = l.maxShadowMapRes;
+	quality.maxPcfTaps = l.maxPcfTaps;
+	return quality;
+}
+
+RenderQuality QualityController::getPreviewQuality()
+{
+	RenderQuality quality;
+	quality.resolutionScale = 0.5;
+	quality.shadows = false;
+	quality.nearestSampling = true;
+	return quality;
+}
@@ -0,0 +1,71 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef QUALITYCONTROLLER_H
+#define QUALITYCONTROLLER_H
+
+#include "EngineAPI.h"
+
+/*
+ * Picks the RenderQuality for next frame, so that frames rendered while the user
+ * interacts with the scene fit in the target frame time.
+ * Quality is stepped along a fixed ladder of levels, level 0 is the full quality,
+ * which is always used when there is no interaction.
+ */
+class QualityController
+{
+public:
+	QualityController();
+
+	void setEnabled(bool enable);
+	bool isEnabled() const { return _enabled; }
+
+	void setTargetFrameTime(double msec) { _targetFrameTime = msec; }
+	double getTargetFrameTime() const { return _targetFrameTime; }
+
+	/* print chosen level for each frame */
+	void setLogging(bool enable) { _logging = enable; }
+
+	void beginInteraction();
+	void endInteraction();
+	bool isInteracting() const { return _interacting; }
+
+	/* account time of a rendered frame and adjust the level */
+	void frameRendered(double msec);
+
+	int getLevel() const { return _interacting ? _level : 0; }
+	RenderQuality getQuality() const;
+
+	/* quick first look at a new frame, before it is rendered in full quality */
+	static RenderQuality getPreviewQuality();
+
+private:
+	bool _enabled;
+	bool _logging;
+	bool _interacting;
+	double _targetFrameTime;
+
+	/* current level, kept between interactions as a starting point */
+	int _level;
+
+	/* smoothed frame time of the current level */
+	double _averageFrameTime;
+	int _fastFrames;
+};
+
+#endif
@@ -123,13 +123,18 @@ void usePhongShader(Renderer *render, UniformBuffer *u, bool perspectiveCorrect)
 	if (u->textureSampler.isBound())
 		attribCount++;
 
+	attribCount += u->shadowAttributes;
+
 	if (perspectiveCorrect)
 		render->setVertexAttributes(0, attribCount, 0);
 	else
 		render->setVertexAttributes(0, 0, attribCount);
 
 	render->setVertexShader(phongVertexShader, u);
-	render->setPixelShader(phongPixelShader, u);
+
+	// bilinear texture samples are taken a span at a time
+	bool spans = u->textureSampler.isBound() && u->sampleMode == TMS_BILINEAR;
+	render->setPixelShader(phongPixelShader, u, spans ? phongSpanShader : NULL);
 }
 
 
@@ -199,15 +204,114 @@ Color visualizeDepth(double d)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void Engine::render()
+UniformBuffer* Engine::getItemShaderData( int objectID )
+{
+	SceneItem &item = _sceneItems[objectID];
+
+	/* uniforms of an item depend on everything but background and normals */
+	StateVersion key = item._transformVersion + item._materialVersion + _worldVersion + _cameraVersion +
+			_lightsVersion + _fogVersion + _flagsVersion + _shadowMapsVersion + _shadowParamsVersion + _sceneVersion;
+
+	if (_stageStats.needsUpdate(item._uniformsStage, key, STAGE_UNIFORMS))
+	{
+		setupTransformationShaderData(item._uniforms, objectID);
+		setupMaterialsShaderData(item._uniforms, objectID);
+		setupLightingShaderData(item._uniforms, objectID);
+		setupShadowMapShaderData(item._uniforms, objectID);
+		setupFogShaderData(item._uniforms);
+	}
+
+	return &item._uniforms;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Engine::setRenderQuality(const RenderQuality &quality)
+{
+	_quality = quality;
+	_quality.resolutionScale = clamp(_quality.resolutionScale, 0.05, 1.0);
+	updateActiveShadowParams();
+	bump(_cameraVersion);
+}
+
+void Engine::setAbortFlag(const std::atomic<bool> *abort)
+{
+	_abort = abort;
+	_renderer->setAbortFlag(abort);
+}
+
+void Engine::setJitter(double x, double y)
+{
+	if (x == _jitterX && y == _jitterY)
+		return;
+
+	_jitterX = x;
+	_jitterY = y;
+	_frameStage.invalidate();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Engine::render()
 {
+	detectStateChanges();
 
-	if (_shadingMode != SHADING_NONE)
+	/* if nothing changed since last frame, the output already contains it */
+	if (!_stageStats.needsUpdate(_frameStage, _stateVersion, STAGE_FRAME))
+		return true;
+
+	/* render at reduced resolution if asked to */
+	_frameSizeX = max(1, (int)(_outputSizeX * _quality.resolutionScale + 0.5));
+	_frameSizeY = max(1, (int)(_outputSizeY * _quality.resolutionScale + 0.5));
+
+	Texture *target = _outputTexture;
+
+	if (_frameSizeX != _outputSizeX || _frameSizeY != _outputSizeY)
+	{
+		if (!_scaledOutput || _scaledOutput->getWidth() != _frameSizeX || _scaledOutput->getHeight() != _frameSizeY) {
+			delete _scaledOutput;
+			_scaledOutput = new Texture(_frameSizeX, _frameSizeY);
+		}
+
+		target = _scaledOutput;
+	}
+
+	renderFrame(target, _frameSizeX, _frameSizeY);
+	_renderer->setSubpixelOffset(0, 0);
+
+	/* output contains a partial frame, redo it next time */
+	if (isAborted()) {
+		_frameStage.invalidate();
+		return false;
+	}
+
+	/* upscale into the output, this also restores the viewport for getSteps */
+	if (target != _outputTexture) {
+		_renderer->setViewport(_outputSizeX, _outputSizeY);
+		_renderer->setOutputTexture(_outputTexture);
+		_renderer->renderUpscaled(*target, _frameSizeX, _frameSizeY);
+	}
+
+	/* shadow map updates bumped the versions, but they are part of this frame */
+	_frameStage.validate(_stateVersion);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Engine::renderFrame(Texture *target, int width, int height)
+{
+	if (_shadingMode != SHADING_NONE && _quality.shadows)
 		updateShadowMaps();
 
-	_renderer->setViewport(_outputSizeX, _outputSizeY);
+	if (isAborted())
+		return;
+
+	/* jitter is given in output pixels */
+	_renderer->setViewport(width, height);
+	_renderer->setSubpixelOffset(_jitterX * width / _outputSizeX, _jitterY * height / _outputSizeY);
 	_renderer->setZBuffer(_outputZBuffer);
-	_renderer->setOutputTexture(_outputTexture);
+	_renderer->setOutputTexture(target);
 
 	// clear buffers
 	_outputZBuffer->clear();
@@ -217,47 +321,53 @@ void Engine::render()
 
 	renderBackground();
 
-	if(!_itemCount) return;
+	if(!_itemCount)
+		return;
 
 	// global settings
 	_renderer->setAspectRatio(_initialsceneBox.getSizes().x() / _initialsceneBox.getSizes().y() );
 
+	/* shadows are found from depth of the frame before it is shaded */
+	if (useShadowMask()) {
+		renderShadowMask(width, height);
+		_outputZBuffer->clear();
+	}
+
 	createNormalModels();
-	setupFogShaderData();
 
-	for (unsigned int i = 0 ; i < _itemCount; i++)
+	for (unsigned int i = 0 ; i < _itemCount && !isAborted(); i++)
 	{
 		SceneItem &item = _sceneItems[i];
 		const Model &m = *item._mainModel;
 
 		/* setup shader uniforms*/
-		setupTransformationShaderData(i);
-		setupMaterialsShaderData(i);
-		setupLightingShaderData(i);
-		setupShadowMapShaderData(i);
+		UniformBuffer *u = getItemShaderData(i);
+		u->_selBuffer = _outputSelBuffer;
+		requestTexture(item, u->mat_objectToClipSpaceTransform);
+		u->_selObject = i+1;
 
-		_shaderData._selBuffer = _outputSelBuffer;
-		_shaderData._selObject = i+1;
+		// misc models of the item use the same transformation
+		_shaderData.mat_objectToClipSpaceTransform = u->mat_objectToClipSpaceTransform;
 
 		/* setup shaders */
 		switch(_shadingMode) 
 		{
 		case SHADING_GOURAD:
-			useGouraldShader(_renderer, &_shaderData, _flags.perspectiveCorrect);
+			useGouraldShader(_renderer, u, _flags.perspectiveCorrect);
 			break;
 		case SHADING_PHONG:
-			usePhongShader(_renderer, &_shaderData, _flags.perspectiveCorrect);
+			usePhongShader(_renderer, u, _flags.perspectiveCorrect);
 			break;
 		case SHADING_FLAT:
-			useFlatShader(_renderer, &_shaderData);
+			useFlatShader(_renderer, u);
 			break;
 		case SHADING_NONE:
-			useSimpleShader(_renderer, &_shaderData);
+			useSimpleShader(_renderer, u);
 			break;
 		}
 
 		if (_flags.depthBufferVisualization)
-			_renderer->setPixelShader(depthDebugPixelShader, &_shaderData);
+			_renderer->setPixelShader(depthDebugPixelShader, u);
 
 		// setup culling
 		if (_flags.backFaceCulling)
@@ -282,7 +392,7 @@ void Engine::render()
 		if (_flags.drawWireFrame || _shadingMode == SHADING_NONE)
 			mode |= Renderer::WIREFRAME | Renderer::WIREFRAME_COLOR;
 
-		_renderer->setOutputTexture(_outputTexture );
+		_renderer->setOutputTexture(target);
 		_renderer->renderPolygons(m.polygons, m.getNumberOfPolygons(), (Renderer::RENDER_MODE)mode);
 
 		// Now render the misc stuff
@@ -317,7 +427,7 @@ void Engine::render()
 	}
 
 	// bounding box and axes of whole model
-	setupTransformationShaderData(-1);
+	setupTransformationShaderData(_shaderData, -1);
 
 	if (_flags.drawBoundingBox)
 		renderMiscModelWireframe(_sceneBoxModel, Color(0,0,1), true);
@@ -326,7 +436,6 @@ void Engine::render()
 		renderMiscModelWireframe(_axesModel);
 
 	renderLightSources();
-
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
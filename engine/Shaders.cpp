@@ -18,6 +18,7 @@
 */
 #include "Shaders.h"
 #include "model/Model.h"
+#include "renderer/BVH.h"
 #include "common/Math.h"
 
 #include <cmath>
@@ -35,19 +36,42 @@ void phongVertexShader( void* priv, void* in, Vector4 &pos_out, Vector3 attribs_
 	if (u->textureSampler.isBound())
 		attribs_out[2] = v.texCoord;
 
+	// positions in the shadow maps are linear in the position, so they can be interpolated like it
+	for (int i = 0 ; i < u->lightsCount ; i++)
+	{
+		const ShaderLightData &light = u->lights[i];
+		if (light.shadowAttribute < 0)
+			continue;
+
+		Vector4 trans_pos = vmul4point(attribs_out[0], light.shadowMapTransfrom[0]);
+		attribs_out[light.shadowAttribute] = Vector3(trans_pos.x(), trans_pos.y(),
+			light.shadowProjective ? trans_pos.w() : trans_pos.z());
+	}
+
+	if (u->shadowWorldAttribute >= 0)
+		attribs_out[u->shadowWorldAttribute] = vmul3point(attribs_out[0], u->mat_cameraToWorldSpace);
+
 	pos_out = vmul4point(v.position,u->mat_objectToClipSpaceTransform);
 }
 
 /********************************************************************************************************/
-Color phongPixelShader( void* priv, const PS_INPUTS &in)
+/* lighting and fog of a pixel with the given color of the material */
+static inline Color phongShade( const UniformBuffer *u, const PS_INPUTS &in, Color c )
 {
-	const UniformBuffer *u = (const UniformBuffer*)priv;
-
 	/* update the selection buffer */
 	if (u->_selBuffer) u->_selBuffer->setPixelValue(in.x,in.y, u->_selObject);
 
 	const Vector3 &position = in.attributes[0];
 	Vector3 normal = in.attributes[1].returnNormal();
+
+	bool frontFace = u->forceFrontFaces ? true : (in.frontface ^ u->facesReversed);
+	c = doLighting(u, c, position, normal, !frontFace, in.attributes, in.x, in.y);
+	return !u->fogParams.enabled ? c : applyFog(u, in.d, c);
+}
+
+Color phongPixelShader( void* priv, const PS_INPUTS &in)
+{
+	const UniformBuffer *u = (const UniformBuffer*)priv;
 	Color c;
 
 	if (!u->textureSampler.isBound())
@@ -57,18 +81,87 @@ Color phongPixelShader( void* priv, const PS_INPUTS &in)
 	else if (u->sampleMode == TMS_BILINEAR)
 		c = u->textureSampler.sampleBiLinear(in.attributes[2][0], in.attributes[2][1]);
 	else {
-		double lodX, lodY;
-		in._renderer->queryLOD(2, lodX, lodY);
-		c = u->textureSampler.sampleBiLinearMipmapped(in.attributes[2][0], in.attributes[2][1], lodX, lodY);
+		Vector3 stepX, stepY;
+		in._renderer->queryLOD(2, stepX, stepY);
+
+		const Vector3 &t = in.attributes[2];
+		if (u->sampleMode == TMS_BILINEAR_MIPMAPS)
+			c = u->textureSampler.sampleBiLinearMipmapped(t[0], t[1], stepX, stepY);
+		else if (u->sampleMode == TMS_TRILINEAR)
+			c = u->textureSampler.sampleTriLinear(t[0], t[1], stepX, stepY);
+		else
+			c = u->textureSampler.sampleAnisotropic(t[0], t[1], stepX, stepY);
 	}
 
-	bool frontFace = u->forceFrontFaces ? true : (in.frontface ^ u->facesReversed);
-	c = doLighting(u, c, position, normal, !frontFace );
-	return !u->fogParams.enabled ? c : applyFog(u, in.d, c);
+	return phongShade(u, in, c);
+}
+
+/* same for a span of pixels with a bilinear sampled texture, all samples are taken at once */
+void phongSpanShader( void* priv, const PS_INPUTS in[], int count, Color out[] )
+{
+	const UniformBuffer *u = (const UniformBuffer*)priv;
+	double x[Renderer::SPAN_PIXELS] = {}, y[Renderer::SPAN_PIXELS] = {};
+
+	for (int i = 0 ; i < count ; i++) {
+		x[i] = in[i].attributes[2][0];
+		y[i] = in[i].attributes[2][1];
+	}
+
+	u->textureSampler.sampleBiLinear(x, y, count, out);
+
+	for (int i = 0 ; i < count ; i++)
+		out[i] = phongShade(u, in[i], out[i]);
 }
 
 /********************************************************************************************************/
-Color doLighting( const UniformBuffer* u, Color &objcolor, const Vector3& pos, Vector3 &normal, bool backface )
+/*
+ * Ray traced shadows - rays from the point toward all lights that light it are traced together,
+ * since they start at the same place and go through the same nodes near it
+ */
+static_assert(BVH::MAX_PACKET >= MAX_LIGHT, "rays toward all the lights have to fit in one packet");
+
+static void traceShadowRays( const UniformBuffer* u, const Vector3& pos, const Vector3 &normal, bool shadowed[] )
+{
+	Vector3 directions[BVH::MAX_PACKET];
+	int lights[BVH::MAX_PACKET];
+	int count = 0;
+
+	// rays start a bit above the surface, so that they don't hit the polygon they start from
+	Vector3 worldNormal = vmul3dir(normal, u->mat_cameraToWorldSpace).returnNormal();
+	Vector3 origin = vmul3point(pos, u->mat_cameraToWorldSpace) + worldNormal * u->shadowRayOffset;
+
+	for (int i = 0 ; i < u->lightsCount ; i++)
+	{
+		const ShaderLightData &light = u->lights[i];
+		shadowed[i] = false;
+
+		if (!light.shadowRayTraced)
+			continue;
+
+		// points the light doesn't reach don't need a ray
+		const Vector3 &lightDirection = light.is_point ? (light.location - pos).returnNormal() : light.direction;
+
+		if (lightDirection.dot(normal) <= 0)
+			continue;
+		if (light.is_spot && lightDirection.dot(light.direction) <= light.cutoffCOsine)
+			continue;
+
+		directions[count] = light.is_point ? light.shadowRay - origin : light.shadowRay;
+		lights[count++] = i;
+	}
+
+	if (count == 0)
+		return;
+
+	bool occluded[BVH::MAX_PACKET];
+	u->shadowBVH->occluded(origin, directions, count, occluded);
+
+	for (int r = 0 ; r < count ; r++)
+		shadowed[lights[r]] = occluded[r];
+}
+
+Color doLighting( const UniformBuffer* u, Color &objcolor, const Vector3& pos, Vector3 &normal, bool backface,
+	const Vector3 *attributes, int x, int y )
 {
 	Color c = u->kA * objcolor;
 
@@ -79,6 +172,18 @@ Color doLighting( const UniformBuffer* u, Color &objcolor, const Vector3& pos, V
 	if (backface)
 		normal = -normal;
 
+	// with the mask, shadows of all lights come from the same few samples
+	const bool masked = u->shadowMask && x >= 0;
+	int maskSamples[4];
+	double maskWeights[4];
+
+	if (masked)
+		u->shadowMask->getSamples(x, y, pos.z(), maskSamples, maskWeights);
+
+	bool shadowed[MAX_LIGHT];
+	if (u->shadowBVH && !masked)
+		traceShadowRays(u, pos, normal, shadowed);
+
 	for (int i = 0 ; i < u->lightsCount ; i++)
 	{
 		const ShaderLightData &light = u->lights[i];
@@ -106,10 +211,21 @@ Color doLighting( const UniformBuffer* u, Color &objcolor, const Vector3& pos, V
 			}
 		}
 
-		if (light._shadowCubemapSampler.isBound() || light._shadowMapSampler.isBound())
+		if (masked)
+		{
+			factor *= u->shadowMask->getVisibility(i, maskSamples, maskWeights);
+			if (factor == 0)
+				continue;
+		}
+		else if (u->shadowBVH)
+		{
+			if (shadowed[i])
+				continue;
+		}
+		else if (light._shadowCubemapSampler.isBound() || light.shadowCascades)
 		{
 			// check shadow
-			factor *= sampleShadowMap(light, u, pos, lightDirection, surfaceLightAngleCosine);
+			factor *= sampleShadowMap(light, u, pos, lightDirection, surfaceLightAngleCosine, attributes);
 			if (factor == 0)
 				continue;
 		}
@@ -135,22 +251,130 @@ Color doLighting( const UniformBuffer* u, Color &objcolor, const Vector3& pos, V
 	return c.clamp();
 }
 
+/********************************************************************************************************/
+void shadowVisibility( const UniformBuffer *u, const Vector3 &pos, const Vector3 &normal, float visibility[] )
+{
+	bool shadowed[MAX_LIGHT];
+	if (u->shadowBVH)
+		traceShadowRays(u, pos, normal, shadowed);
+
+	for (int i = 0 ; i < u->lightsCount ; i++)
+	{
+		const ShaderLightData &light = u->lights[i];
+		const Vector3 &lightDirection = light.is_point ? (light.location - pos).returnNormal() : light.direction;
+		double surfaceLightAngleCosine = lightDirection.dot(normal);
+
+		visibility[i] = 1;
+
+		if (surfaceLightAngleCosine <= 0)
+			visibility[i] = 0;
+		else if (u->shadowBVH)
+			visibility[i] = shadowed[i] ? 0 : 1;
+		else if (light._shadowCubemapSampler.isBound() || light.shadowCascades)
+			visibility[i] = sampleShadowMap(light, u, pos, lightDirection, surfaceLightAngleCosine, NULL);
+	}
+}
+
+/********************************************************************************************************/
+void ShadowMask::setup( int frameWidth, int frameHeight, int lightCount )
+{
+	width = (frameWidth + 1) / 2;
+	height = (frameHeight + 1) / 2;
+	lights = lightCount;
+
+	depth.resize(width * height);
+	visibility.resize(width * height * max(lights, 1));
+}
+
+void ShadowMask::getSamples( int x, int y, double z, int samples[4], double weights[4] ) const
+{
+	// samples are at even pixels, so a pixel is either on one or half way between two of them
+	int x0 = min(x >> 1, width - 1), y0 = min(y >> 1, height - 1);
+	int x1 = min(x0 + (x & 1), width - 1), y1 = min(y0 + (y & 1), height - 1);
+	double fx = (x & 1) * 0.5, fy = (y & 1) * 0.5;
+
+	samples[0] = y0 * width + x0;
+	samples[1] = y0 * width + x1;
+	samples[2] = y1 * width + x0;
+	samples[3] = y1 * width + x1;
+
+	weights[0] = (1 - fx) * (1 - fy);
+	weights[1] = fx * (1 - fy);
+	weights[2] = (1 - fx) * fy;
+	weights[3] = fx * fy;
+
+	// samples from other surfaces get much less weight
+	double tolerance = std::abs(z) * 1e-3 + 1e-9, sum = 0;
+
+	for (int i = 0 ; i < 4 ; i++) {
+		weights[i] /= tolerance + std::abs(z - depth[samples[i]]);
+		sum += weights[i];
+	}
+
+	for (int i = 0 ; i < 4 ; i++)
+		weights[i] /= sum;
+}
+
+/********************************************************************************************************/
+/* position of the point in the map of a directional or spot light, and the cascade it is in */
+static Vector3 shadowMapPosition( const ShaderLightData &light, const Vector3 &pos, const Vector3 *attributes, int &cascade )
+{
+	// use the most detailed cascade that covers the point, with a margin for the filter
+	static const double margin = 0.02;
+	Vector3 first;
+
+	if (attributes) {
+		const Vector3 &a = attributes[light.shadowAttribute];
+		first = light.shadowProjective ?
+			Vector3(a.x() / a.z(), a.y() / a.z(), light.shadowDepthA + light.shadowDepthB / a.z()) : a;
+	}
+
+	for (cascade = 0 ;; cascade++)
+	{
+		Vector3 trans_pos;
+
+		if (attributes)
+			trans_pos = cascade ? first * light.shadowCascadeScale[cascade] + light.shadowCascadeOffset[cascade] : first;
+		else {
+			Vector4 p = vmul4point(pos,(light.shadowMapTransfrom[cascade]));
+			p.canonicalize();
+			trans_pos = p.xyz();
+		}
+
+		if (cascade == light.shadowCascades - 1)
+			return trans_pos;
+
+		if (trans_pos.x() > margin && trans_pos.x() < 1 - margin &&
+				trans_pos.y() > margin && trans_pos.y() < 1 - margin)
+			return trans_pos;
+	}
+}
+
 /********************************************************************************************************/
 double sampleShadowMap( const ShaderLightData &light, const UniformBuffer *u, const Vector3 &pos,
-	const Vector3 &dir, double surfaceAngeleCosine )
+	const Vector3 &dir, double surfaceAngeleCosine, const Vector3 *attributes )
 {
 
-	surfaceAngeleCosine = clamp(surfaceAngeleCosine, 0.0, 1.0);
-	double bias = clamp(u->shadowParams.z_bias_mul * tan (acos(surfaceAngeleCosine)), 0.0, u->shadowParams.z_bias_max);
+	const bool vsm = u->shadowParams.vsm;
+	double bias = 0;
+
+	// variance shadow maps don't need the bias, since the depth is filtered
+	if (!vsm) {
+		surfaceAngeleCosine = clamp(surfaceAngeleCosine, 0.0, 1.0);
+		bias = clamp(u->shadowParams.z_bias_mul * tan (acos(surfaceAngeleCosine)), 0.0, u->shadowParams.z_bias_max);
+	}
 
-	if (light._shadowMapSampler.isBound())
+	if (light.shadowCascades)
 	{
-		Vector4 trans_pos = vmul4point(pos,(light.shadowMapTransfrom[0]));
-		trans_pos.canonicalize();
+		int cascade;
+		Vector3 trans_pos = shadowMapPosition(light, pos,
+			(attributes && light.shadowAttribute >= 0) ? attributes : NULL, cascade);
 
-		const ShadowSampler &sampler = light._shadowMapSampler;
+		const ShadowSampler &sampler = light._shadowMapSamplers[cascade];
 
-		if (u->shadowParams.poison && u->shadowParams.pcf)
+		if (vsm)
+			return sampler.sampleVariance(trans_pos.x(), trans_pos.y(), trans_pos.z());
+		else if (u->shadowParams.poison && u->shadowParams.pcf)
 			return sampler.samplePoisonPCF(trans_pos.x(), trans_pos.y(), trans_pos.z()-bias, u->shadowParams.pcf_taps);
 		else if (u->shadowParams.pcf)
 			return sampler.samplePCF(trans_pos.x(), trans_pos.y(), trans_pos.z()-bias, u->shadowParams.pcf_taps);
@@ -161,13 +385,37 @@ double sampleShadowMap( const ShaderLightData &light, const UniformBuffer *u, co
 
 	} else if (light._shadowCubemapSampler.isBound())
 	{
-		int face = light._shadowCubemapSampler.selectFace(vmul3dir(dir,u->mat_cameraToWorldSpace));
-		Vector4 trans_pos = vmul4point(pos,(light.shadowMapTransfrom[face]));
-		trans_pos.canonicalize();
+		int face;
+		Vector3 trans_pos;
+
+		if (attributes && u->shadowWorldAttribute >= 0 && light.shadowFaces)
+		{
+			// with the interpolated world space position, the face is the major axis of the vector from the light
+			// and the position in it is the other two components divided by the major one
+			const Vector3 v = attributes[u->shadowWorldAttribute] - light.shadowLocation;
+			face = light._shadowCubemapSampler.selectFace(-v);
+
+			const ShaderLightData::ShadowFaceAxis *a = light.shadowFaceAxes[face];
+			double inv_w = 1.0 / (a[2].scale * v[a[2].axis] + a[2].offset);
+
+			trans_pos = Vector3(
+				0.5 + (a[0].scale * v[a[0].axis] + a[0].offset) * inv_w,
+				0.5 + (a[1].scale * v[a[1].axis] + a[1].offset) * inv_w,
+				light.shadowFaceDepthA[face] + light.shadowFaceDepthB[face] * inv_w);
+		} else
+		{
+			face = light._shadowCubemapSampler.selectFace(vmul3dir(dir,u->mat_cameraToWorldSpace));
+
+			Vector4 p = vmul4point(pos,(light.shadowMapTransfrom[face]));
+			p.canonicalize();
+			trans_pos = p.xyz();
+		}
 
 		const ShadowCubemapSampler &sampler = light._shadowCubemapSampler;
 
-		if (u->shadowParams.poison && u->shadowParams.pcf)
+		if (vsm)
+			return sampler.sampleVariance(face, trans_pos.x(), trans_pos.y(), trans_pos.z());
+		else if (u->shadowParams.poison && u->shadowParams.pcf)
 			return sampler.samplePoisonPCF(face, trans_pos.x(), trans_pos.y(), trans_pos.z()-bias, u->shadowParams.pcf_taps);
 		else if (u->shadowParams.pcf)
 			return sampler.samplePCF(face, trans_pos.x(), trans_pos.y(), trans_pos.z()-bias, u->shadowParams.pcf_taps);
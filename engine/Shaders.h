@@ -25,6 +25,9 @@
 #include "renderer/Samplers.h"
 #include "model/Material.h"
 #include "EngineAPI.h"
+#include <vector>
+
+class BVH;
 
 struct ShaderFogData
 {
@@ -58,9 +61,80 @@ struct ShaderLightData
 	double cutoffCOsine;
 	double startCutofAttenuationCosine;
 
-	ShadowSampler _shadowMapSampler;
+	/* directional and spot lights, from the nearest cascade to the farthest one */
+	ShadowSampler _shadowMapSamplers[MAX_SHADOW_CASCADES];
+	int shadowCascades;
+
 	ShadowCubemapSampler _shadowCubemapSampler;
 	Mat4 shadowMapTransfrom[6];
+
+	/*
+	 * Phong shading gets the position in the map from the vertex shader, as an interpolated attribute
+	 * (-1 if there is none). For a spot light it is (x, y, w) and the depth is shadowDepthA + shadowDepthB / w,
+	 * for a directional light it is the position in the first cascade, and each other cascade is
+	 * the first one scaled and moved. Point lights use the shared world space position (see shadowFaceAxes).
+	 */
+	int shadowAttribute;
+	bool shadowProjective;
+	double shadowDepthA;
+	double shadowDepthB;
+	Vector3 shadowCascadeScale[MAX_SHADOW_CASCADES];
+	Vector3 shadowCascadeOffset[MAX_SHADOW_CASCADES];
+	Vector3 shadowLocation;
+
+	/*
+	 * Faces of a point light look along the world axes, so with v = world space position - shadowLocation,
+	 * each of x, y and w of a face is one scaled and moved component of v (in that order). The position in
+	 * the face is then (0.5 + x / w, 0.5 + y / w) and its depth is shadowFaceDepthA + shadowFaceDepthB / w.
+	 * Only if shadowFaces is set, otherwise the matrices of the faces are used
+	 */
+	struct ShadowFaceAxis
+	{
+		int axis;
+		double scale;
+		double offset;
+	};
+
+	bool shadowFaces;
+	ShadowFaceAxis shadowFaceAxes[6][3];
+	double shadowFaceDepthA[6];
+	double shadowFaceDepthB[6];
+
+	/*
+	 * ray traced shadows: a ray goes from the point to shadowRay in world space for point and spot lights,
+	 * and along shadowRay (long enough to leave the scene) for directional lights
+	 */
+	bool shadowRayTraced;
+	Vector3 shadowRay;
+};
+
+
+/*
+ * Shadows of the frame at half resolution: visibility of each light at every other pixel of every
+ * other row, computed from depth of the frame before it is shaded. Pixel shader blends the samples
+ * around it, weighted by how close their depth is to its own, so that shadows don't leak across edges
+ */
+struct ShadowMask
+{
+	int width;
+	int height;
+	int lights;
+
+	std::vector<float> depth;		/* camera space z of each sample, huge where the frame is empty */
+	std::vector<float> visibility;	/* 'lights' values for each sample */
+
+	void setup(int frameWidth, int frameHeight, int lightCount);
+
+	/* the samples around a pixel of the frame and their weights, for a point at camera space depth z */
+	void getSamples(int x, int y, double z, int samples[4], double weights[4]) const;
+
+	double getVisibility(int light, const int samples[4], const double weights[4]) const
+	{
+		double result = 0;
+		for (int i = 0 ; i < 4 ; i++)
+			result += visibility[samples[i] * lights + light] * weights[i];
+		return result;
+	}
 };
 
 
@@ -92,16 +166,33 @@ public:
 	ShaderFogData fogParams;
 	struct ShadowParams shadowParams;
 
+	/* attributes the vertex shader adds for the shadows, and the one with world space position (or -1) */
+	int shadowAttributes;
+	int shadowWorldAttribute;
+
+	/* scene for ray traced shadows (or NULL), and how far above the surface the rays start */
+	const BVH *shadowBVH;
+	double shadowRayOffset;
+
+	/* shadows of the whole frame (or NULL), phong shading uses them instead of the above */
+	const ShadowMask *shadowMask;
+
 	IntegerTexture* _selBuffer;
 	int _selObject;
 };
 
 
 
-Color doLighting(const UniformBuffer* u, Color &c, const Vector3 & pos, Vector3 &normal, bool backface);
+/* phong shading also gives the interpolated attributes and the position of the pixel */
+Color doLighting(const UniformBuffer* u, Color &c, const Vector3 & pos, Vector3 &normal, bool backface,
+	const Vector3 *attributes = NULL, int x = -1, int y = -1);
 Color applyFog(const UniformBuffer* u, double depth, const Color &color);
 
-double sampleShadowMap(const ShaderLightData &light, const UniformBuffer *u, const Vector3 &pos, const Vector3 &dir, double surfaceAngeleCosine) ;
+double sampleShadowMap(const ShaderLightData &light, const UniformBuffer *u, const Vector3 &pos, const Vector3 &dir,
+	double surfaceAngeleCosine, const Vector3 *attributes);
+
+/* visibility of each light from the point (0 in the shadow or if the surface faces away, 1 if lit) */
+void shadowVisibility(const UniformBuffer *u, const Vector3 &pos, const Vector3 &normal, float visibility[]);
 
 void useGouraldShader(Renderer *render, UniformBuffer *u, bool perspectiveCorrect);
 void usePhongShader(Renderer *render, UniformBuffer *u, bool perspectiveCorrect);
@@ -111,6 +202,7 @@ void useSimpleShader(Renderer *render, UniformBuffer *u);
 
 void phongVertexShader( void* priv, void* in, Vector4 &pos_out, Vector3 attribs_out[] );
 Color phongPixelShader( void* priv, const PS_INPUTS &in);
+void phongSpanShader( void* priv, const PS_INPUTS in[], int count, Color out[] );
 
 Color visualizeDepth(double d);
 
@@ -0,0 +1,121 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Engine.h"
+#include "renderer/Renderer.h"
+#include "common/ThreadPool.h"
+#include <cfloat>
+#include <cmath>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Engine::useShadowMask() const
+{
+	return _activeShadowParams.half_res_mask && _quality.shadows &&
+		_shadingMode == SHADING_PHONG && !_flags.depthBufferVisualization;
+}
+
+/*
+ * Depth of the frame is rendered first, with the depth only pipeline and the same culling as the frame.
+ * Every other pixel of every other row is moved back to camera space, and the shadows are found there
+ * once for all lights. The normal (for the bias and for the surfaces that face away from a light)
+ * comes from the neighbour pixels.
+ */
+void Engine::renderShadowMask( int width, int height )
+{
+	_outputZBuffer->clear();
+
+	FACE_TYPE culledFace = translateFaceType(FACE_BACK);
+	_renderer->setBackFaceCulling(_flags.backFaceCulling && culledFace == FACE_BACK);
+	_renderer->setFrontFaceCulling(_flags.backFaceCulling && culledFace == FACE_FRONT);
+
+	for (unsigned int i = 0 ; i < _itemCount && !isAborted() ; i++)
+	{
+		const Model &m = *_sceneItems[i]._mainModel;
+		UniformBuffer *u = getItemShaderData(i);
+
+		_renderer->uploadVertices(m.vertices, sizeof(Model::Vertex), m.getNumberOfVertices());
+		_renderer->renderDepthPolygons(m.polygons, m.getNumberOfPolygons(), u->mat_objectToClipSpaceTransform);
+	}
+
+	// lights are the same for all items
+	const UniformBuffer *u = getItemShaderData(0);
+	_shadowMask.setup(width, height, u->lightsCount);
+
+	// pixels are sampled at whole device coordinates, moved by the jitter
+	Mat4 deviceToCamera =
+		Mat4::getMoveMat(Vector3(-_jitterX * width / _outputSizeX, -_jitterY * height / _outputSizeY, 0)) *
+		_renderer->getDeviceToScreenMatrix() * _projTR.getMatrix().inv();
+
+	const DepthTexture &zBuffer = *_outputZBuffer;
+
+	// false where nothing was rendered
+	auto unproject = [&] (int x, int y, Vector3 &pos) {
+		if (x < 0 || y < 0 || x >= width || y >= height)
+			return false;
+
+		double depth = zBuffer.getPixelValue(x, y);
+		if (!(depth <= 1))
+			return false;
+
+		Vector4 p = vmul4point(Vector3(x, y, depth), deviceToCamera);
+		p.canonicalize();
+		pos = p.xyz();
+		return true;
+	};
+
+	// of the two neighbours along an axis, the one closer in depth is more likely on the same surface
+	auto tangent = [&] (int x, int y, int dx, int dy, const Vector3 &pos, Vector3 &result) {
+		Vector3 next, prev;
+		bool hasNext = unproject(x + dx, y + dy, next), hasPrev = unproject(x - dx, y - dy, prev);
+
+		if (hasNext && (!hasPrev || std::abs(next.z() - pos.z()) <= std::abs(pos.z() - prev.z())))
+			result = next - pos;
+		else if (hasPrev)
+			result = pos - prev;
+		return hasNext || hasPrev;
+	};
+
+	parallelFor(0, _shadowMask.height, 4, [&] (int from, int to) {
+		for (int y = from ; y < to ; y++)
+			for (int x = 0 ; x < _shadowMask.width ; x++)
+			{
+				int sample = y * _shadowMask.width + x;
+				float *visibility = &_shadowMask.visibility[sample * _shadowMask.lights];
+				Vector3 pos, alongX, alongY;
+
+				if (!unproject(x * 2, y * 2, pos)) {
+					_shadowMask.depth[sample] = FLT_MAX;
+					for (int i = 0 ; i < _shadowMask.lights ; i++)
+						visibility[i] = 1;
+					continue;
+				}
+
+				Vector3 normal = -pos;
+				if (tangent(x * 2, y * 2, 1, 0, pos, alongX) && tangent(x * 2, y * 2, 0, 1, pos, alongY)) {
+					Vector3 n = alongX.cross(alongY);
+					if (n.len() > 0)
+						normal = n.dot(pos) > 0 ? -n : n;
+				}
+
+				_shadowMask.depth[sample] = pos.z();
+				shadowVisibility(u, pos, normal.returnNormal(), visibility);
+			}
+	});
+}
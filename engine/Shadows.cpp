@@ -18,14 +18,120 @@
 */
 
 #include "Engine.h"
+#include "renderer/Renderer.h"
+#include "common/ThreadPool.h"
 #include <cmath>
 
+/* dynamic items that didn't move for this many updates of the maps are put back into the static layer */
+#define STATIC_SHADOW_SETTLE_UPDATES 4
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Faces of a point light look along the axes, so x, y and w of a face in clip space are each
+ * just a scaled and moved coordinate of the world space position. Returns false if that isn't so.
+ */
+struct CubeFaceAxes
+{
+	int axis[3];
+	double scale[3];
+	double offset[3];
+};
+
+static bool getCubeFaceAxes( const Mat4 &m, CubeFaceAxes &face )
+{
+	static const int columns[3] = { 0, 1, 3 };
+
+	for (int c = 0 ; c < 3 ; c++)
+	{
+		int col = columns[c], best = 0;
+		for (int r = 1 ; r < 3 ; r++)
+			if (std::abs(m(r, col)) > std::abs(m(best, col)))
+				best = r;
+
+		for (int r = 0 ; r < 3 ; r++)
+			if (r != best && std::abs(m(r, col)) > std::abs(m(best, col)) * 1e-9)
+				return false;
+
+		face.axis[c] = best;
+		face.scale[c] = m(best, col);
+		face.offset[c] = m(3, col);
+	}
+	return true;
+}
+
+/*
+ * A polygon usually falls into one or two faces of a point light, so instead of giving all polygons
+ * to the renderer of each face, each vertex is transformed to world space once and tested against
+ * the side planes of all faces. A polygon goes to the faces where its vertices are not all outside
+ * of the same plane.
+ */
+static void classifyCubeFaces( const CubeFaceAxes faces[6], const Model &model, const Mat4 &objectToWorld,
+		std::vector<unsigned int> *facePolygons[6] )
+{
+	// 4 bits for each face - which of the planes x = w, x = -w, y = w, y = -w the vertex is outside of
+	std::vector<uint32_t> outcodes(model.getNumberOfVertices());
+
+	for (unsigned int v = 0 ; v < outcodes.size() ; v++)
+	{
+		Vector3 p = vmul3point(model.vertices[v].position, objectToWorld);
+		uint32_t outcode = 0;
+
+		for (int f = 0 ; f < 6 ; f++)
+		{
+			const CubeFaceAxes &face = faces[f];
+			double x = p[face.axis[0]] * face.scale[0] + face.offset[0];
+			double y = p[face.axis[1]] * face.scale[1] + face.offset[1];
+			double w = p[face.axis[2]] * face.scale[2] + face.offset[2];
+
+			// a bit of margin, so that rounding doesn't drop polygons right at the edge
+			double limit = w + std::abs(w) * 1e-3;
+
+			outcode |= ((x > limit) | (-x > limit) << 1 | (y > limit) << 2 | (-y > limit) << 3) << (f * 4);
+		}
+
+		outcodes[v] = outcode;
+	}
+
+	for (int f = 0 ; f < 6 ; f++)
+		facePolygons[f]->clear();
+
+	unsigned int *polygon = model.polygons;
+
+	for (int p = 0 ; p < model.getNumberOfPolygons() ; p++, polygon += *polygon + 1)
+	{
+		uint32_t outside = ~0u;
+		for (unsigned int i = 1 ; i <= polygon[0] ; i++)
+			outside &= outcodes[polygon[i]];
+
+		for (int f = 0 ; f < 6 ; f++)
+			if (!((outside >> (f * 4)) & 0xF))
+				facePolygons[f]->push_back(polygon - model.polygons);
+	}
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 void Engine::updateShadowMaps() 
 {
-	if (!_itemCount || _shadowMapsValid)
+	if (!_itemCount)
+		return;
+
+	if (_activeShadowParams.ray_traced) {
+		updateShadowBVH();
 		return;
+	}
+
+	/* all regions are dropped when the atlas is set up again */
+	if (_shadowAtlas.setup((size_t)_activeShadowParams.shadow_memory << 20, _activeShadowParams.depth_bits, _activeShadowParams.vsm))
+		for (int i = 0 ; i < MAX_LIGHT * 6 ; i++)
+			_shadowRegions[i] = ShadowAtlasRegion();
+
+	/* maps are only set up here, and rendered all together after that */
+	int maps[MAX_LIGHT*6];
+	int mapCount = 0;
+	bool updated[MAX_LIGHT] = { false };
+	bool renderStatic[MAX_LIGHT] = { false };
 
 	for (int i = 0 ; i < MAX_LIGHT ; i++) 
 	{
@@ -33,6 +139,83 @@ void Engine::updateShadowMaps()
 		if (!lp.shadow || !lp.enabled)
 			continue;
 
+		/* shadow map depends only on the light itself and on the scene geometry */
+		StateVersion key = _lightVersions[i] + _worldVersion + _geometryVersion +
+				_shadowParamsVersion + _sceneVersion;
+
+		/* cascades follow the view */
+		if (lp.type == LightSource::LIGHT_TYPE_DIRECTIONAL && _activeShadowParams.cascades > 1)
+			key += _cameraVersion;
+
+		if (!_stageStats.needsUpdate(_shadowMapStages[i], key, STAGE_SHADOW_MAPS))
+			continue;
+
+		bump(_shadowMapsVersion);
+		updated[i] = true;
+
+		/*
+		 * Static layer depends on the same, but not on the item transforms. While it is valid,
+		 * the maps keep their matrices, and only the dynamic items are rendered over it
+		 */
+		StateVersion staticKey = key - _geometryVersion;
+		std::vector<StateVersion> &staticItems = _staticShadowItems[i];
+		std::vector<DynamicShadowItem> &dynamicItems = _dynamicShadowItems[i];
+
+		if (!_staticShadowStages[i].isValid(staticKey) || staticItems.size() != _itemCount)
+		{
+			/* everything is rendered again anyway, so all items go to the static layer */
+			staticItems.resize(_itemCount);
+			dynamicItems.resize(_itemCount);
+			for (unsigned int item = 0 ; item < _itemCount ; item++)
+				staticItems[item] = _sceneItems[item]._transformVersion;
+
+			_staticShadowStages[i].invalidate();
+		} else
+		{
+			for (unsigned int item = 0 ; item < _itemCount ; item++)
+			{
+				StateVersion version = _sceneItems[item]._transformVersion;
+				DynamicShadowItem &dynamic = dynamicItems[item];
+
+				if (staticItems[item])
+				{
+					/* items that moved are taken out of the static layer */
+					if (staticItems[item] != version) {
+						staticItems[item] = 0;
+						dynamic.version = version;
+						dynamic.stillUpdates = 0;
+						_staticShadowStages[i].invalidate();
+					}
+				}
+				else if (dynamic.version != version) {
+					dynamic.version = version;
+					dynamic.stillUpdates = 0;
+				}
+				/* and put back once they settle, which renders the static layer once more */
+				else if (++dynamic.stillUpdates == STATIC_SHADOW_SETTLE_UPDATES)
+					_staticShadowStages[i].invalidate();
+			}
+
+			/* maps don't cover the scene anymore */
+			if (!_staticShadowBoxes[i].contains(_sceneBox))
+				_staticShadowStages[i].invalidate();
+		}
+
+		if (!_stageStats.needsUpdate(_staticShadowStages[i], staticKey, STAGE_STATIC_SHADOW_MAPS))
+			continue;
+
+		/* the static layer is rendered again, so dynamic items that didn't move this time go back to it */
+		for (unsigned int item = 0 ; item < _itemCount ; item++)
+			if (!staticItems[item] && dynamicItems[item].stillUpdates > 0)
+				staticItems[item] = dynamicItems[item].version;
+
+		_staticShadowBoxes[i] = _sceneBox;
+		renderStatic[i] = true;
+		_shadowCascades[i] = 0;
+
+		for (int c = 0 ; c < 6 ; c++)
+			_shadowMapSizes[i*6 + c] = 0;
+
 		/* check the direction for invalid data */
 		if (lp.type != LightSource::LIGHT_TYPE_POINT && lp.direction.len() == 0)
 			continue;
@@ -50,64 +233,247 @@ void Engine::updateShadowMaps()
 
 		direction.makeNormal();
 
+		const int res = _activeShadowParams.shadowMapRes;
+
 		switch (lp.type) {
 		case LightSource::LIGHT_TYPE_DIRECTIONAL:
-			createShadowMap(i*6, -direction, Vector3(0,0,0), false,  0);
+			_shadowCascades[i] = createCascadedShadowMaps(i, -direction);
 			break;
 		case LightSource::LIGHT_TYPE_SPOT:
-			createShadowMap(i*6, -direction, position, true, lp.cutoffAngle);
+			createShadowMap(i*6, -direction, position, true, lp.cutoffAngle, res);
+			_shadowCascades[i] = 1;
 			break;
 		case LightSource::LIGHT_TYPE_POINT:
-			createShadowMap(i*6+0,Vector3(-1,0,0), position, true, 100);
-			createShadowMap(i*6+1,Vector3(+1,0,0), position, true, 100);
-			createShadowMap(i*6+2,Vector3(0,-1,0), position, true, 100);
-			createShadowMap(i*6+3,Vector3(0,+1,0), position, true, 100);
-			createShadowMap(i*6+4,Vector3(0,0,-1), position, true, 100);
-			createShadowMap(i*6+5,Vector3(0,0,+1), position, true, 100);
+			createShadowMap(i*6+0,Vector3(-1,0,0), position, true, 100, res);
+			createShadowMap(i*6+1,Vector3(+1,0,0), position, true, 100, res);
+			createShadowMap(i*6+2,Vector3(0,-1,0), position, true, 100, res);
+			createShadowMap(i*6+3,Vector3(0,+1,0), position, true, 100, res);
+			createShadowMap(i*6+4,Vector3(0,0,-1), position, true, 100, res);
+			createShadowMap(i*6+5,Vector3(0,0,+1), position, true, 100, res);
 			break;
 		default:
 			assert(0);
 		}
+
+		_shadowFootprints[i] = 0;
+		for (int c = 0 ; c < 6 ; c++)
+			if (_shadowMapSizes[i*6 + c])
+				_shadowFootprints[i] = max(_shadowFootprints[i], getShadowMapFootprint(i*6 + c));
 	}
 
-	_shadowMapsValid = true;
+	layoutShadowAtlas(updated, renderStatic);
+
+	for (int i = 0 ; i < MAX_LIGHT * 6 ; i++)
+		if (updated[i / 6] && _shadowRegions[i].isValid())
+			maps[mapCount++] = i;
+
+	/* polygons of point lights are sorted into the faces they fall into, in one pass for all faces */
+	std::vector<std::pair<int, unsigned int> > casters;
+	CubeFaceAxes faces[MAX_LIGHT][6];
+
+	for (int i = 0 ; i < MAX_LIGHT ; i++)
+	{
+		bool cube = updated[i] && _lightParams[i].type == LightSource::LIGHT_TYPE_POINT && _shadowRegions[i*6].isValid();
+
+		for (int face = 0 ; face < 6 && cube ; face++)
+			cube = getCubeFaceAxes(_shadowMapsMatrices[i*6 + face], faces[i][face]);
+
+		for (int face = 0 ; face < 6 ; face++) {
+			_shadowFacePolygons[i*6 + face].clear();
+			if (cube)
+				_shadowFacePolygons[i*6 + face].resize(_itemCount);
+		}
+
+		/* without the static layer, only the dynamic items are rendered */
+		for (unsigned int item = 0 ; cube && item < _itemCount ; item++)
+			if (renderStatic[i] || !_staticShadowItems[i][item])
+				casters.push_back(std::make_pair(i, item));
+	}
+
+	parallelFor(0, casters.size(), 1, [&] (int from, int to) {
+		for (int c = from ; c < to ; c++)
+		{
+			int light = casters[c].first;
+			SceneItem &item = _sceneItems[casters[c].second];
+
+			std::vector<unsigned int> *facePolygons[6];
+			for (int face = 0 ; face < 6 ; face++)
+				facePolygons[face] = &_shadowFacePolygons[light*6 + face][casters[c].second];
+
+			classifyCubeFaces(faces[light], *item._mainModel, item._itemTR.getMat() * _mainTR.getMat(), facePolygons);
+		}
+	});
+
+	/* every map has its own renderer and region of the atlas, so they don't depend on each other */
+	parallelFor(0, mapCount, 1, [&] (int from, int to) {
+		for (int m = from ; m < to ; m++)
+			renderShadowMap(maps[m], renderStatic[maps[m] / 6]);
+	});
+
+	/* the maps might be incomplete, so render them again next time */
+	if (isAborted()) {
+		for (int i = 0 ; i < MAX_LIGHT ; i++) {
+			if (updated[i])
+				_shadowMapStages[i].invalidate();
+			if (renderStatic[i])
+				_staticShadowStages[i].invalidate();
+		}
+	}
+}
+
+/*
+ * Ray traced shadows need only the geometry: polygons of all items are split to triangles
+ * and moved to world space (where the maps are as well), and the BVH is built over them
+ */
+void Engine::updateShadowBVH()
+{
+	StateVersion key = _worldVersion + _geometryVersion + _sceneVersion;
+	if (!_stageStats.needsUpdate(_shadowBVHStage, key, STAGE_SHADOW_BVH))
+		return;
+
+	bump(_shadowMapsVersion);
+
+	// where triangles of each item start
+	std::vector<int> firstTriangle(_itemCount + 1, 0);
+
+	for (unsigned int item = 0 ; item < _itemCount ; item++)
+	{
+		const Model &model = *_sceneItems[item]._mainModel;
+		int count = 0;
+
+		unsigned int *polygon = model.polygons;
+		for (int p = 0 ; p < model.getNumberOfPolygons() ; p++, polygon += *polygon + 1)
+			count += max((int)polygon[0] - 2, 0);
+
+		firstTriangle[item + 1] = firstTriangle[item] + count;
+	}
+
+	std::vector<BVH::Triangle> triangles(firstTriangle[_itemCount]);
+
+	parallelFor(0, _itemCount, 1, [&] (int from, int to) {
+		std::vector<Vector3> positions;
+
+		for (int item = from ; item < to ; item++)
+		{
+			SceneItem &sceneItem = _sceneItems[item];
+			const Model &model = *sceneItem._mainModel;
+			Mat4 objectToWorld = sceneItem._itemTR.getMat() * _mainTR.getMat();
+
+			positions.resize(model.getNumberOfVertices());
+			for (unsigned int v = 0 ; v < positions.size() ; v++)
+				positions[v] = vmul3point(model.vertices[v].position, objectToWorld);
+
+			// polygons are convex, so a fan of triangles covers them
+			BVH::Triangle *triangle = triangles.data() + firstTriangle[item];
+			unsigned int *polygon = model.polygons;
+
+			for (int p = 0 ; p < model.getNumberOfPolygons() ; p++, polygon += *polygon + 1)
+				for (unsigned int i = 3 ; i <= polygon[0] ; i++, triangle++) {
+					triangle->v0 = positions[polygon[1]];
+					triangle->v1 = positions[polygon[i - 1]];
+					triangle->v2 = positions[polygon[i]];
+				}
+		}
+	});
+
+	_shadowBVH.build(triangles);
 }
 
 void Engine::invalidateShadowMaps()
 {
-	_shadowMapsValid = false;
+	for (int i = 0 ; i < MAX_LIGHT ; i++) {
+		_shadowMapStages[i].invalidate();
+		_staticShadowStages[i].invalidate();
+	}
+	_shadowBVHStage.invalidate();
+	_frameStage.invalidate();
 }
 
 void Engine::freeShadowMaps()
 {
 	for (int i = 0 ; i < MAX_LIGHT * 6 ; i++) {
-		delete _shadowMaps[i];
-		_shadowMaps[i] = NULL;
+		_shadowRegions[i] = ShadowAtlasRegion();
+		_shadowMapSizes[i] = 0;
+		delete _shadowRenderers[i];
+		_shadowRenderers[i] = NULL;
 	}
+
+	_shadowAtlas.releaseAll();
+	_shadowBVH.clear();
+
+	for (unsigned int i = 0 ; i < _shadowScratch.size() ; i++)
+		delete _shadowScratch[i];
+	_shadowScratch.clear();
+}
+
+size_t Engine::getShadowMemoryUsage() const
+{
+	size_t result = _shadowAtlas.getMemoryUsage() + _shadowBVH.getMemoryUsage();
+
+	for (unsigned int i = 0 ; i < _shadowScratch.size() ; i++)
+		result += (size_t)_shadowScratch[i]->getWidth() * _shadowScratch[i]->getHeight() * sizeof(double);
+
+	return result;
 }
 
 void Engine::setShadowParams( ShadowParams * params )
 {
 	_shadowParams = *params; 
-	invalidateShadowMaps();
+	updateActiveShadowParams();
+}
+
+void Engine::updateActiveShadowParams()
+{
+	_activeShadowParams = _shadowParams;
+
+	if (_quality.maxShadowMapRes)
+		_activeShadowParams.shadowMapRes = min(_shadowParams.shadowMapRes, _quality.maxShadowMapRes);
+	if (_quality.maxPcfTaps)
+		_activeShadowParams.pcf_taps = min(_shadowParams.pcf_taps, _quality.maxPcfTaps);
+
+	bump(_shadowParamsVersion);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-struct ShadowMapUniformBuffer 
+int Engine::createCascadedShadowMaps( int light, const Vector3 &direction )
 {
-	Mat4 mat_objectToLightSpace;
-};
+	int count = clamp(_activeShadowParams.cascades, 1, MAX_SHADOW_CASCADES);
+	int resolution = _activeShadowParams.shadowMapRes;
 
+	// range of depths that the scene occupies in the view frustum
+	BOUNDING_BOX sceneFromCamera = _sceneBox * (_mainTR.getMat() * _cameraTR.getMat());
 
-static void shadowMapVertexShader( void* priv, void* in, Vector4 &pos_out, Vector3 attribs_out[] )
-{
-	const ShadowMapUniformBuffer *u = (const ShadowMapUniformBuffer*)priv;
-	const Model::Vertex& v = *(const Model::Vertex*)in;
-	pos_out = vmul4point(v.position, u->mat_objectToLightSpace);
+	double viewNear = max(_projTR.getDistance(), -sceneFromCamera.point2.z());
+	double viewFar = min(_projTR.getDistance() + _projTR.getDepth(), -sceneFromCamera.point1.z());
+
+	if (count == 1 || viewNear <= 0 || viewFar <= viewNear) {
+		createShadowMap(light*6, direction, Vector3(0,0,0), false, 0, resolution);
+		return 1;
+	}
+
+	// slices cover less area each, so their maps can be smaller
+	resolution = max(resolution / 2, 64);
+
+	double sliceNear = viewNear;
+
+	for (int c = 0 ; c < count ; c++)
+	{
+		// near slices are thinner, blend of logarithmic and uniform split
+		double t = (double)(c + 1) / count;
+		double logSplit = viewNear * pow(viewFar / viewNear, t);
+		double uniformSplit = viewNear + (viewFar - viewNear) * t;
+		double sliceFar = logSplit * 0.75 + uniformSplit * 0.25;
+
+		createShadowMap(light*6 + c, direction, Vector3(0,0,0), false, 0, resolution, sliceNear, sliceFar);
+		sliceNear = sliceFar;
+	}
+
+	return count;
 }
 
-void Engine::createShadowMap( int i, const Vector3 &direction, const Vector3 &position, bool projective, double maxFov )
+void Engine::createShadowMap( int i, const Vector3 &direction, const Vector3 &position, bool projective, double maxFov,
+		int resolution, double sliceNear, double sliceFar )
 {
 	// ----------------------------- Setup camera matrix----------------------------------------------------
 
@@ -173,51 +539,332 @@ void Engine::createShadowMap( int i, const Vector3 &direction, const Vector3 &po
 
 		proj = Mat4::getPersMat(maxFov, 1, rangeMin, rangeMax);
 	} else {
-		proj = Mat4::getOrthoProjMatrix(sceneBoxFromLightPOV.point1.x(), sceneBoxFromLightPOV.point2.x(), sceneBoxFromLightPOV.point2.y(), sceneBoxFromLightPOV.point1.y(), sceneBoxFromLightPOV.point1.z(), sceneBoxFromLightPOV.point2.z());
+		BOUNDING_BOX box = sceneBoxFromLightPOV;
+
+		// for a cascade, cover only the part of scene inside the slice of view frustum
+		if (sliceFar > sliceNear)
+		{
+			double frontW, frontH;
+			_projTR.getFrontPlane(&frontW, &frontH);
+
+			// renderer keeps the aspect ratio of the scene, so the output might show more than the front plane
+			Vector3 sceneSizes = _initialsceneBox.getSizes();
+			double sceneAspect = sceneSizes.x() / sceneSizes.y();
+			double outputAspect = (double)_outputSizeX / _outputSizeY;
+
+			if (sceneAspect > outputAspect)
+				frontH *= sceneAspect / outputAspect;
+			else
+				frontW *= outputAspect / sceneAspect;
+
+			Mat4 cameraToLight = _cameraTR.getMat().inv() * cameraMatrix;
+			BOUNDING_BOX slice;
+
+			for (int corner = 0 ; corner < 8 ; corner++)
+			{
+				double depth = (corner & 4) ? sliceFar : sliceNear;
+				double scale = _projTR.getPerspectiveEnabled() ? depth / _projTR.getDistance() : 1.0;
+
+				Vector3 p = vmul3point(Vector3(
+						(corner & 1 ? 0.5 : -0.5) * frontW * scale,
+						(corner & 2 ? 0.5 : -0.5) * frontH * scale,
+						-depth), cameraToLight);
+
+				slice.point1 = corner ? slice.point1.minimum(p) : p;
+				slice.point2 = corner ? slice.point2.maximum(p) : p;
+			}
+
+			// depth range stays the same, since objects outside of the slice cast shadows into it
+			box.point1.x() = max(box.point1.x(), slice.point1.x());
+			box.point1.y() = max(box.point1.y(), slice.point1.y());
+			box.point2.x() = min(box.point2.x(), slice.point2.x());
+			box.point2.y() = min(box.point2.y(), slice.point2.y());
+
+			if (box.point2.x() <= box.point1.x() || box.point2.y() <= box.point1.y())
+				box = sceneBoxFromLightPOV;
+		}
+
+		proj = Mat4::getOrthoProjMatrix(box.point1.x(), box.point2.x(), box.point2.y(), box.point1.y(), box.point1.z(), box.point2.z());
 	}
 
 	_shadowMapsMatrices[i] = cameraMatrix * proj;
 
-	// 4. setup output map
-	if (_shadowMaps[i] == NULL || _shadowMaps[i]->getWidth() != _shadowParams.shadowMapRes ||
-			_shadowMaps[i]->getHeight() != _shadowParams.shadowMapRes)
+	// 4. map gets its region of the atlas later, once all maps are known
+	_shadowMapSizes[i] = resolution;
+
+	if (_shadowRenderers[i] == NULL)
+		_shadowRenderers[i] = new Renderer;
+}
+
+double Engine::getShadowMapFootprint( int i )
+{
+	// bounds of the map frustum on the screen
+	Mat4 mapToClip = _shadowMapsMatrices[i].inv() * _cameraTR.getMat() * _projTR.getMatrix();
+	double x1 = 1, y1 = 1, x2 = -1, y2 = -1;
+
+	for (int corner = 0 ; corner < 8 ; corner++)
+	{
+		Vector4 p = vmul4point(Vector3(
+				(corner & 1) ? 1 : -1,
+				(corner & 2) ? 1 : -1,
+				(corner & 4) ? 1 : -1), mapToClip);
+
+		// frustum reaches behind the camera
+		if (p.w() <= 0)
+			return 1;
+
+		x1 = min(x1, p.x() / p.w());
+		y1 = min(y1, p.y() / p.w());
+		x2 = max(x2, p.x() / p.w());
+		y2 = max(y2, p.y() / p.w());
+	}
+
+	double width = clamp(x2, -1.0, 1.0) - clamp(x1, -1.0, 1.0);
+	double height = clamp(y2, -1.0, 1.0) - clamp(y1, -1.0, 1.0);
+	return max(width, 0.0) * max(height, 0.0) / 4;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* size of a map that was set up with given resolution, halved 'level' times */
+static int shadowMapSize( int resolution, int level )
+{
+	static const int minSize = 64;
+
+	int size = 1;
+	while (size * 3 < resolution * 2)
+		size *= 2;
+
+	return max(size >> level, min(size, minSize));
+}
+
+void Engine::layoutShadowAtlas( bool render[], bool renderStatic[] )
+{
+	// lights that have maps, and how many times their maps are halved
+	int levels[MAX_LIGHT];
+	double importance[MAX_LIGHT];
+
+	for (int i = 0 ; i < MAX_LIGHT ; i++)
 	{
-		delete _shadowMaps[i];
-		_shadowMaps[i] = new DepthTexture(_shadowParams.shadowMapRes, _shadowParams.shadowMapRes);
+		LightSource &lp = _lightParams[i];
+		levels[i] = -1;
+
+		if (!lp.shadow || !lp.enabled || !_shadowMapSizes[i*6])
+			continue;
+
+		// about the same number of map texels per screen pixel, whatever part of the screen the light covers
+		double footprint = max(_shadowFootprints[i], 0.0001);
+		levels[i] = max(0, (int)floor(-log2(footprint) / 2 + 0.5));
+
+		double brightness = max(lp.color.x(), max(lp.color.y(), lp.color.z())) / 255;
+		importance[i] = footprint * clamp(brightness, 0.05, 1.0);
 	}
 
-	_shadowMaps[i]->clear();
+	// halve the maps of the light that has the most texels for its importance, until all fit
+	const double atlasTexels = (double)_shadowAtlas.getSize() * _shadowAtlas.getSize();
+
+	for (;;)
+	{
+		double total = 0;
+		double texels[MAX_LIGHT] = { 0 };
+		int victim = -1;
+
+		for (int i = 0 ; i < MAX_LIGHT ; i++)
+		{
+			if (levels[i] < 0)
+				continue;
+
+			bool canShrink = false;
+
+			for (int c = 0 ; c < 6 ; c++) {
+				if (!_shadowMapSizes[i*6 + c])
+					continue;
+				int size = shadowMapSize(_shadowMapSizes[i*6 + c], levels[i]);
+				texels[i] += (double)size * size;
+				canShrink |= shadowMapSize(_shadowMapSizes[i*6 + c], levels[i] + 1) < size;
+			}
+
+			total += texels[i];
+			if (canShrink && (victim < 0 || texels[i] / importance[i] > texels[victim] / importance[victim]))
+				victim = i;
+		}
+
+		if (total <= atlasTexels)
+			break;
+
+		if (victim >= 0) {
+			levels[victim]++;
+			continue;
+		}
+
+		// all maps are as small as they can be, so the least important light goes without shadows
+		for (int i = 0 ; i < MAX_LIGHT ; i++)
+			if (levels[i] >= 0 && (victim < 0 || importance[i] < importance[victim]))
+				victim = i;
+
+		levels[victim] = -1;
+	}
+
+	// lights that keep the size of their maps keep their regions, others are placed again
+	int sizes[MAX_LIGHT*6];
+	bool moved[MAX_LIGHT] = { false };
+
+	for (int m = 0 ; m < MAX_LIGHT * 6 ; m++)
+	{
+		int light = m / 6;
+		sizes[m] = (levels[light] >= 0 && _shadowMapSizes[m]) ? shadowMapSize(_shadowMapSizes[m], levels[light]) : 0;
+
+		if (sizes[m] != _shadowRegions[m].size)
+			moved[light] = true;
+	}
+
+	for (int m = 0 ; m < MAX_LIGHT * 6 ; m++)
+		if (moved[m / 6])
+			_shadowAtlas.release(_shadowRegions[m]);
+
+	// biggest maps first, and if the atlas is too fragmented for them, all maps are placed again
+	for (int attempt = 0 ; attempt < 2 ; attempt++)
+	{
+		bool placed = true;
+
+		for (int size = _shadowAtlas.getSize() ; size > 0 && placed ; size /= 2)
+			for (int m = 0 ; m < MAX_LIGHT * 6 && placed ; m++)
+				if (moved[m / 6] && sizes[m] == size && !_shadowRegions[m].isValid())
+					placed = _shadowAtlas.allocate(size, _shadowRegions[m]);
+
+		if (placed)
+			break;
+
+		_shadowAtlas.releaseAll();
+		for (int m = 0 ; m < MAX_LIGHT * 6 ; m++) {
+			_shadowRegions[m] = ShadowAtlasRegion();
+			moved[m / 6] |= sizes[m] > 0;
+		}
+	}
+
+	// maps that moved have to be rendered again, static layer included
+	for (int i = 0 ; i < MAX_LIGHT ; i++)
+		if (moved[i] && levels[i] >= 0) {
+			render[i] = true;
+			renderStatic[i] = true;
+		}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+DepthTexture* Engine::acquireShadowScratch( int size )
+{
+	std::lock_guard<std::mutex> lock(_shadowScratchLock);
+
+	if (_shadowScratch.empty())
+		return new DepthTexture(size, size);
+
+	// one of the right size if there is, otherwise any one is allocated again
+	unsigned int i = 0;
+	while (i < _shadowScratch.size() - 1 && _shadowScratch[i]->getWidth() != size)
+		i++;
+
+	DepthTexture *texture = _shadowScratch[i];
+	_shadowScratch.erase(_shadowScratch.begin() + i);
+
+	texture->allocate(size, size);
+	return texture;
+}
+
+void Engine::releaseShadowScratch( DepthTexture *texture )
+{
+	std::lock_guard<std::mutex> lock(_shadowScratchLock);
+	_shadowScratch.push_back(texture);
+}
 
+void Engine::renderShadowMap( int i, bool renderStatic )
+{
+	Renderer *renderer = _shadowRenderers[i];
+	const ShadowAtlasRegion &region = _shadowRegions[i];
+	const std::vector<StateVersion> &staticItems = _staticShadowItems[i / 6];
+
+	// map is rendered in full precision, and stored into the atlas when done
+	DepthTexture *map = acquireShadowScratch(region.size);
 
 	// 5. setup common render settings
-	_renderer->setViewport(_shadowParams.shadowMapRes, _shadowParams.shadowMapRes);
-	_renderer->setAspectRatio(1);
-	_renderer->setBackFaceCulling(false);
-	_renderer->setFrontFaceCulling(false);
-	_renderer->setOutputTexture(NULL);
-	_renderer->setZBuffer(_shadowMaps[i]);
-
-	// 6. setup shaders 
-	ShadowMapUniformBuffer uniforms;
-	_renderer->setVertexShader(shadowMapVertexShader, &uniforms);
-	_renderer->setPixelShader(NULL, NULL);
-	_renderer->setVertexAttributes(0,0,0);
-
-	// 7. rendering loop
-	for (unsigned int i = 0 ; i < _itemCount; i++) 
+	renderer->setViewport(region.size, region.size);
+	renderer->setAspectRatio(1);
+	renderer->setBackFaceCulling(false);
+	renderer->setFrontFaceCulling(false);
+	renderer->setOutputTexture(NULL);
+	renderer->setZBuffer(map);
+	renderer->setAbortFlag(_abort);
+	renderer->setDepthBias(_activeShadowParams.z_bias_slope, 0);
+
+	// 6. rendering loop of the static layer, only depth is needed so no shaders are used
+	if (renderStatic)
 	{
-		SceneItem &item = _sceneItems[i];
-		uniforms.mat_objectToLightSpace = item._itemTR.getMat() * _mainTR.getMat() * cameraMatrix * proj;
-		_renderer->uploadVertices(item._mainModel->vertices, sizeof(Model::Vertex), item._mainModel->getNumberOfVertices());
-		_renderer->renderPolygons(item._mainModel->polygons, item._mainModel->getNumberOfPolygons(), Renderer::SOLID);
+		map->clear();
+
+		for (unsigned int item = 0 ; item < _itemCount && !isAborted() ; item++)
+			if (staticItems[item])
+				renderShadowCaster(renderer, item, i);
+
+		_shadowAtlas.store(ShadowAtlas::LAYER_STATIC, region, *map);
+	} else
+		_shadowAtlas.load(ShadowAtlas::LAYER_STATIC, region, *map);
+
+	// 7. dynamic items are depth tested against the static layer
+	for (unsigned int item = 0 ; item < _itemCount && !isAborted() ; item++)
+		if (!staticItems[item])
+			renderShadowCaster(renderer, item, i);
+
+	_shadowAtlas.store(ShadowAtlas::LAYER_MAPS, region, *map);
+
+	// 8. prefilter the moments for variance shadow mapping, they are kept in the atlas too
+	if (_shadowAtlas.hasMoments() && !isAborted())
+	{
+		MomentsTexture moments(map->getWidth(), map->getHeight());
+		moments.computeFrom(*map, _activeShadowParams.vsm_kernel);
+		_shadowAtlas.storeMoments(region, moments);
 	}
+
+	releaseShadowScratch(map);
+}
+
+void Engine::renderShadowCaster( Renderer *renderer, unsigned int item, int i )
+{
+	SceneItem &sceneItem = _sceneItems[item];
+	Model *model = sceneItem._mainModel;
+
+	Mat4 objectToLightSpace = sceneItem._itemTR.getMat() * _mainTR.getMat() * _shadowMapsMatrices[i];
+	renderer->uploadVertices(model->vertices, sizeof(Model::Vertex), model->getNumberOfVertices());
+
+	const std::vector<std::vector<unsigned int> > &facePolygons = _shadowFacePolygons[i];
+
+	if (facePolygons.empty())
+		renderer->renderDepthPolygons(model->polygons, model->getNumberOfPolygons(), objectToLightSpace);
+	else
+		renderer->renderDepthPolygons(model->polygons, facePolygons[item].data(), facePolygons[item].size(), objectToLightSpace);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void Engine::setupShadowMapShaderData( int objectID )
+void Engine::setupShadowMapShaderData( UniformBuffer &u, int objectID )
 {
-	_shaderData.shadowParams = _shadowParams;
+	u.shadowParams = _activeShadowParams;
+	u.shadowAttributes = 0;
+	u.shadowWorldAttribute = -1;
+	u.shadowBVH = NULL;
+	u.shadowMask = useShadowMask() ? &_shadowMask : NULL;
+
+	// rays that go along a directional light have to leave the scene
+	const bool rayTraced = _activeShadowParams.ray_traced && _quality.shadows && !_shadowBVH.isEmpty();
+	const double sceneSize = (_shadowBVH.getMax() - _shadowBVH.getMin()).len();
+
+	if (rayTraced) {
+		u.shadowBVH = &_shadowBVH;
+		u.shadowRayOffset = sceneSize * 1e-4;
+	}
+
+	// interpolated positions in the maps follow position, normal and texture coordinates of phong shader
+	const bool vertexCoords = _activeShadowParams.vertex_coords && _shadingMode == SHADING_PHONG && !u.shadowMask;
+	int attribute = u.textureSampler.isBound() ? 3 : 2;
 
 	int lightID = 0;
 	for (int i = 0 ; i < MAX_LIGHT ; i++) 
@@ -225,33 +872,148 @@ void Engine::setupShadowMapShaderData( int objectID )
 		LightSource &lp = _lightParams[i];
 		if (!lp.enabled) continue;
 
-		ShaderLightData &light = _shaderData.lights[lightID++];
-		light._shadowMapSampler.bindTexture(NULL);
-		light._shadowCubemapSampler.bindTextures(NULL);
+		ShaderLightData &light = u.lights[lightID++];
+		light.shadowCascades = 0;
+		light.shadowAttribute = -1;
+		light._shadowCubemapSampler.unbind();
+		light.shadowRayTraced = false;
 
-		if (!lp.shadow)
+		if (!lp.shadow || !_quality.shadows)
 			continue;
 
+		if (rayTraced) {
+			light.shadowRayTraced = true;
+			light.shadowRay = light.is_point ? vmul3point(light.location, u.mat_cameraToWorldSpace) :
+				vmul3dir(light.direction, u.mat_cameraToWorldSpace).returnNormal() * (sceneSize * 2);
+			continue;
+		}
+
+		// light might not have got a place in the atlas
+		if (!_shadowRegions[i*6].isValid())
+			continue;
+
+		// renderer flips y when it rasterizes the map, so the lookup has to flip it as well
 		static const Mat4 clipToTextureSpace = 
 			Mat4 (
 			0.5, 0.0, 0.0, 0.0,
-			0.0, 0.5, 0.0, 0.0,
+			0.0, -0.5, 0.0, 0.0,
 			0.0, 0.0, 0.5, 0.0,
 			0.5, 0.5, 0.5, 1.0
 			);
 
 		if (lp.type != LightSource::LIGHT_TYPE_POINT) {
 
-			light._shadowMapSampler.bindTexture(_shadowMaps[i*6]);
-			light.shadowMapTransfrom[0] = 
-				_shaderData.mat_cameraToWorldSpace * _shadowMapsMatrices[i*6] * clipToTextureSpace;
-					
+			light.shadowCascades = _shadowCascades[i];
+			for (int c = 0 ; c < light.shadowCascades ; c++) {
+				light._shadowMapSamplers[c].bind(&_shadowAtlas, _shadowRegions[i*6+c]);
+				light.shadowMapTransfrom[c] =
+					u.mat_cameraToWorldSpace * _shadowMapsMatrices[i*6+c] * clipToTextureSpace;
+			}
+
+			if (vertexCoords) {
+				light.shadowAttribute = attribute++;
+				setupShadowCoordinates(light);
+			}
 		} else 
 		{
-			light._shadowCubemapSampler.bindTextures((const DepthTexture **)(_shadowMaps+i*6));
+			light._shadowCubemapSampler.bind(&_shadowAtlas, _shadowRegions+i*6);
 			for (int face = 0 ; face < 6 ; face++)
 				light.shadowMapTransfrom[face] = 
-					_shaderData.mat_cameraToWorldSpace *_shadowMapsMatrices[i*6+face] * clipToTextureSpace;
+					u.mat_cameraToWorldSpace *_shadowMapsMatrices[i*6+face] * clipToTextureSpace;
+
+			// all point lights share the world space position
+			light.shadowLocation = vmul3point(light.location, u.mat_cameraToWorldSpace);
+			if (vertexCoords && u.shadowWorldAttribute < 0)
+				u.shadowWorldAttribute = attribute++;
+
+			light.shadowFaces = false;
+			if (vertexCoords)
+				setupShadowCubeFaces(light, i);
 		}		
 	}
+
+	u.shadowAttributes = attribute - (u.textureSampler.isBound() ? 3 : 2);
+}
+
+/*
+ * The matrices of the maps are known to be products of the light camera matrix with an orthographic
+ * or perspective projection, so the interpolated position in the map of the first cascade is enough
+ */
+void Engine::setupShadowCoordinates( ShaderLightData &light )
+{
+	const Mat4 &first = light.shadowMapTransfrom[0];
+
+	// cascades have the same camera, and their projections only scale and move each axis
+	for (int c = 0 ; c < light.shadowCascades ; c++)
+	{
+		const Mat4 &m = light.shadowMapTransfrom[c];
+
+		for (int axis = 0 ; axis < 3 ; axis++)
+		{
+			int row = 0;
+			for (int r = 1 ; r < 3 ; r++)
+				if (std::abs(first(r, axis)) > std::abs(first(row, axis)))
+					row = r;
+
+			double scale = m(row, axis) / first(row, axis);
+			light.shadowCascadeScale[c][axis] = scale;
+			light.shadowCascadeOffset[c][axis] = m(3, axis) - first(3, axis) * scale;
+		}
+	}
+
+	// with perspective projection depth is a linear function of w, so (x, y, w) is enough to interpolate
+	light.shadowProjective = first(0, 3) != 0 || first(1, 3) != 0 || first(2, 3) != 0;
+	light.shadowDepthA = light.shadowDepthB = 0;
+
+	if (light.shadowProjective)
+	{
+		int row = 0;
+		for (int r = 1 ; r < 3 ; r++)
+			if (std::abs(first(r, 3)) > std::abs(first(row, 3)))
+				row = r;
+
+		light.shadowDepthA = first(row, 2) / first(row, 3);
+		light.shadowDepthB = first(3, 2) - first(3, 3) * light.shadowDepthA;
+	}
+}
+
+/*
+ * x, y and w of each face are a scaled component of the world space position, and so of its offset
+ * from the light, plus a constant. The texture space scaling is folded in, and since z is moved along
+ * with w, the depth is a + b / w.
+ */
+void Engine::setupShadowCubeFaces( ShaderLightData &light, int lightIndex )
+{
+	static const double textureScale[2] = { 0.5, -0.5 };
+
+	for (int face = 0 ; face < 6 ; face++)
+	{
+		const Mat4 &m = _shadowMapsMatrices[lightIndex*6 + face];
+		CubeFaceAxes axes;
+
+		if (!getCubeFaceAxes(m, axes))
+			return;
+
+		// z has to use the same axis as w
+		const int w = axes.axis[2];
+		for (int r = 0 ; r < 3 ; r++)
+			if (r != w && std::abs(m(r, 2)) > std::abs(m(w, 2)) * 1e-9)
+				return;
+
+		for (int c = 0 ; c < 3 ; c++)
+		{
+			const double scale = c < 2 ? textureScale[c] : 1.0;
+			ShaderLightData::ShadowFaceAxis &a = light.shadowFaceAxes[face][c];
+
+			a.axis = axes.axis[c];
+			a.scale = axes.scale[c] * scale;
+			a.offset = (axes.offset[c] + axes.scale[c] * light.shadowLocation[a.axis]) * scale;
+		}
+
+		const double zw = m(w, 2) / axes.scale[2];
+		light.shadowFaceDepthA[face] = 0.5 + 0.5 * zw;
+		light.shadowFaceDepthB[face] = 0.5 * (m(3, 2) - zw * axes.offset[2]);
+	}
+
+	light.shadowFaces = true;
 }
@@ -0,0 +1,104 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "TextureStreamer.h"
+
+TextureStreamer::TextureStreamer() : _stop(false)
+{
+}
+
+TextureStreamer::~TextureStreamer()
+{
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_stop = true;
+		_requests.clear();
+	}
+
+	// the texture that is being loaded is finished first
+	_wake.notify_all();
+	if (_thread.joinable())
+		_thread.join();
+
+	for (unsigned int i = 0 ; i < _loaded.size() ; i++)
+		if (_loaded[i].texture)
+			Texture::unloadCached(_loaded[i].texture);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void TextureStreamer::request(const std::string &file, TEXTURE_LAYOUT layout)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+
+	// started on the first request, most scenes have no textures at all
+	if (!_thread.joinable())
+		_thread = std::thread(&TextureStreamer::run, this);
+
+	Request r = { file, layout, NULL };
+	_requests.push_back(r);
+	_wake.notify_one();
+}
+
+void TextureStreamer::cancelRequests()
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	_requests.clear();
+}
+
+void TextureStreamer::takeLoaded(std::vector<Request> &loaded)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	loaded.clear();
+	loaded.swap(_loaded);
+}
+
+void TextureStreamer::setCallback(const std::function<void()> &callback)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	_callback = callback;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void TextureStreamer::run()
+{
+	std::unique_lock<std::mutex> lock(_lock);
+
+	while (true)
+	{
+		while (!_stop && _requests.empty())
+			_wake.wait(lock);
+
+		if (_stop)
+			break;
+
+		Request r = _requests.front();
+		_requests.pop_front();
+
+		lock.unlock();
+		r.texture = Texture::loadCached(r.file.c_str(), true, r.layout);
+		lock.lock();
+
+		_loaded.push_back(r);
+
+		// with the lock held, so that the callback isn't called after it is replaced
+		if (_callback)
+			_callback();
+	}
+}
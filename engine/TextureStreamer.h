@@ -0,0 +1,76 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TEXTURESTREAMER_H
+#define TEXTURESTREAMER_H
+
+#include "renderer/Texture.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Loads textures on a thread of its own, so that the scene is rendered while they load.
+ * Textures are loaded (with Texture::loadCached) in the order they were requested, and wait
+ * until they are taken. Each one taken comes with a reference that the taker releases
+ */
+class TextureStreamer
+{
+public:
+	struct Request
+	{
+		std::string file;
+		TEXTURE_LAYOUT layout;
+
+		/* the loaded texture, NULL if it failed to load */
+		const Texture *texture;
+	};
+
+	TextureStreamer();
+	~TextureStreamer();
+
+	void request(const std::string &file, TEXTURE_LAYOUT layout);
+
+	/* forget the requests that didn't start loading yet */
+	void cancelRequests();
+
+	/* textures loaded since the last call */
+	void takeLoaded(std::vector<Request> &loaded);
+
+	/* called on the loading thread after each texture is loaded, never after it is changed */
+	void setCallback(const std::function<void()> &callback);
+
+private:
+	void run();
+
+	std::thread _thread;
+	std::mutex _lock;
+	std::condition_variable _wake;
+
+	std::deque<Request> _requests;
+	std::vector<Request> _loaded;
+	std::function<void()> _callback;
+	bool _stop;
+};
+
+#endif
@@ -20,7 +20,7 @@
 #include "Engine.h"
 #include "common/Mat4.h"
 
-void Engine::setupTransformationShaderData( int objectID )
+void Engine::setupTransformationShaderData( UniformBuffer &u, int objectID )
 {
 	// setup transform matrices for vertex shader
 	// if objectID <0 then only take in account globlal transformations
@@ -30,16 +30,16 @@ void Engine::setupTransformationShaderData( int objectID )
 	Mat4 objectNormalTransform = objectID >= 0 ? item._itemTR.getNormalTransformMatrix() : Mat4::createUnit();
 
 	// setup transformations
-	_shaderData.mat_objectToCameraSpace =
+	u.mat_objectToCameraSpace =
 		objectTransform *  _mainTR.getMat() * _cameraTR.getMat();
 
-	_shaderData.mat_objectToClipSpaceTransform =  
-		_shaderData.mat_objectToCameraSpace * _projTR.getMatrix();
+	u.mat_objectToClipSpaceTransform =  
+		u.mat_objectToCameraSpace * _projTR.getMatrix();
 
-	_shaderData.mat_objectToCameraSpaceNormalTransform =  objectNormalTransform * 
+	u.mat_objectToCameraSpaceNormalTransform =  objectNormalTransform * 
 		_mainTR.getNormalTransformMatrix() * _cameraTR.getNormalTransformMatrix();
 
-	_shaderData.mat_cameraToWorldSpace = _cameraTR.getMat().inv();
+	u.mat_cameraToWorldSpace = _cameraTR.getMat().inv();
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -74,8 +74,12 @@ void Engine::resetTransformations()
 
 	recomputeBoundingBox();
 
-	invalidateNormalModels();
-	invalidateShadowMaps();
+	for (unsigned int i = 0 ; i < _itemCount ; i++)
+		bumpItemTransform(_sceneItems[i]);
+
+	bump(_worldVersion);
+	bump(_cameraVersion);
+	bump(_normalsVersion);
 }
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -103,13 +107,13 @@ void Engine::scaleObject( int axis, double delta )
 		scale[axis] = 0.001;
 
 	t->setScaleFactors(scale);
-	invalidateNormalModels();
+	bump(_normalsVersion);
 
-	if (_drawSeparateObjects && _selObj != -1)
+	if (_drawSeparateObjects && _selObj != -1) {
 		recomputeBoundingBox();
-
-	invalidateShadowMaps();
-
+		bumpItemTransform(_sceneItems[_selObj]);
+	} else
+		bump(_worldVersion);
 }
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -129,14 +133,14 @@ void Engine::rotateObject( int axis, double angleDelta )
 		);
 
 		recomputeBoundingBox();
+		bumpItemTransform(_sceneItems[_selObj]);
 	} else {
 		/* apply to whole world*/
 		_mainTR.setRotationMatrix2 (_cameraTR.getRotMatI() *
 				Mat4::getRotMat(rotCoofs) * _cameraTR.getRotMatI().inv()
 		);
+		bump(_worldVersion);
 	}
-
-	invalidateShadowMaps();
 }
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -147,7 +151,7 @@ void Engine::rotateCamera( int axis, double angleDelta )
 	Vector3 rotCoofs1 = _cameraTR.getRotateFactors();
 	rotCoofs1[axis] -= ((M_PI) * angleDelta / 180);
 	_cameraTR.setRotationFactors(rotCoofs1);
-
+	bump(_cameraVersion);
 }
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -175,6 +179,7 @@ void Engine::moveObject( int axis, double delta )
 		sceneCenter = vmul3point(sceneCenter, _cameraTR.getMat().inv() * _mainTR.getMat().inv());
 		_sceneItems[_selObj]._itemTR.setMoveFactors(sceneCenter);
 		recomputeBoundingBox();
+		bumpItemTransform(_sceneItems[_selObj]);
 	} else {
 		// global object move
 		Vector3 sceneCenter = _mainTR.getMoveFactors();
@@ -182,9 +187,8 @@ void Engine::moveObject( int axis, double delta )
 		sceneCenter[axis] += delta;
 		sceneCenter = vmul3point(sceneCenter, _cameraTR.getMat().inv());
 		_mainTR.setMoveFactors(sceneCenter);
+		bump(_worldVersion);
 	}
-
-	invalidateShadowMaps();
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -196,6 +200,7 @@ void Engine::moveCamera( int axis, double delta )
 	cameraLoc[axis] -= delta;
 	cameraLoc = vmul3point(cameraLoc, _cameraTR.getRotationMatrix().inv());
 	_cameraTR.setMoveFactors(cameraLoc);
+	bump(_cameraVersion);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -203,6 +208,7 @@ void Engine::moveCamera( int axis, double delta )
 void Engine::setPerspectiveD( double d )
 {
 	_projTR.setDistance(d);
+	bump(_cameraVersion);
 }
 
 double Engine::calculateInitialScaleFactor() const 
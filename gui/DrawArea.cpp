@@ -26,6 +26,7 @@
 #include <sys/time.h>
 #include <stdint.h>
 #include "MainWindow.h"
+#include "RenderThread.h"
 #include <stdio.h>
 
 #include <cmath>
@@ -45,21 +46,42 @@ static double translateSensivety(double value)
 
 /***************************************************************************************/
 
-DrawArea::DrawArea(QWidget *parent) : QWidget(parent), _image(NULL), _outputTexture(NULL)
+DrawArea::DrawArea(QWidget *parent) : QWidget(parent)
 {
 	mainWindow = dynamic_cast<MainWindow*>(parent->parent());
-	engine = mainWindow->getEngine();
-	sceneValid = false;
 	renderingSuspended = false;
 
+	_renderThread = new RenderThread(mainWindow->getEngine(), mainWindow->getEngineLock(), this);
+	_renderThread->start();
+
+	setAttribute(Qt::WA_OpaquePaintEvent);
 	setFocusPolicy(Qt::ClickFocus);
 }
 /***************************************************************************************/
 
 DrawArea::~DrawArea()
 {
-	delete _outputTexture;
-	delete _image;
+	delete _renderThread;
+}
+
+void DrawArea::stopRendering()
+{
+	_renderThread->stop();
+}
+
+void DrawArea::setAdaptiveQuality(bool enable, double targetFrameTime)
+{
+	_renderThread->setAdaptiveQuality(enable, targetFrameTime);
+}
+
+void DrawArea::lockEngine()
+{
+	_renderThread->lockEngine();
+}
+
+void DrawArea::unlockEngine()
+{
+	_renderThread->unlockEngine();
 }
 
 /***************************************************************************************/
@@ -69,8 +91,7 @@ void DrawArea::invalidateScene(bool force)
 	if (renderingSuspended && !force)
 		return;
 
-	sceneValid = false;
-	repaint();
+	_renderThread->requestFrame();
 }
 
 /***************************************************************************************/
@@ -79,34 +100,23 @@ void DrawArea::paintEvent(QPaintEvent *)
 {
 	QPainter painter(this);
 
-	if (_outputTexture == NULL)
-	 return;
-
-	// make engine render
-	if (!sceneValid) {
-
-		// start measuring time
-		struct timeval t,t2,t3;
-		gettimeofday(&t, NULL);
-
-		engine->render();
-		sceneValid = true;
+	// show the most recent frame the render thread completed
+	int renderTime;
+	const QImage *image = _renderThread->acquireFrame(renderTime);
 
-		// measure time again
-		gettimeofday(&t2, NULL);
-		timersub(&t2,&t,&t3);
-		int msec = t3.tv_sec * 1000 + t3.tv_usec / 1000;
-
-		// draw time report
-		QPainter imgpainter(_image);
-		imgpainter.setPen(QColor(255,255,255));
-		imgpainter.drawText(0,10,geometry().width() - 10 ,geometry().height(),
-				Qt::AlignTop | Qt::AlignRight,
-				QString("Rendering took %1 msec (%2 FPS)").arg(QString::number(msec), QString::number(1000.0/msec)));
+	if (image == NULL) {
+		painter.fillRect(rect(), QColor(qRgb(20,20,20)));
+		return;
 	}
 
 	// blit the _image
-	painter.drawImage(QPoint(0,0), *_image);
+	painter.drawImage(QPoint(0,0), *image);
+
+	// draw time report on top of it
+	painter.setPen(QColor(255,255,255));
+	painter.drawText(0,10,geometry().width() - 10 ,geometry().height(),
+			Qt::AlignTop | Qt::AlignRight,
+			QString("Rendering took %1 msec (%2 FPS)").arg(QString::number(renderTime), QString::number(1000.0/renderTime)));
 }
 
 /***************************************************************************************/
@@ -114,84 +124,42 @@ void DrawArea::paintEvent(QPaintEvent *)
 void DrawArea::resizeEvent (QResizeEvent * event)
 {
 	QSize newSize = event->size();
+	_renderThread->setOutputSize(newSize.width(), newSize.height());
+}
 
-	// nothing to do if pixmap is of enough size
-	if (!_outputTexture || _outputTexture->getHeight() < newSize.height()
-			||_outputTexture->getWidth() < newSize.width()) {
-
-		delete _image;
-		delete _outputTexture;
-
-		// create new output texture
-		_outputTexture = new Texture(newSize.width(), newSize.height());
-
-		// create image based on this texture and use it to init it (why not...)
-		_image = new QImage(
-				(uchar*)_outputTexture->getPointer(),
-				_outputTexture->getWidth(),
-				_outputTexture->getHeight(),
-				_outputTexture->getWidth() * sizeof(DEVICE_PIXEL),
-				QImage::Format_RGB32
-		);
-
-		_image->fill(QColor(qRgb(20,20,20)));
-	}
-
+/***************************************************************************************/
 
-	mainWindow->getEngine()->setOutput(_outputTexture, newSize.width(), newSize.height());
-	invalidateScene(true);
+static RenderInput createInput(MainWindow *mainWindow, RenderInput::Kind kind, Qt::KeyboardModifiers modifiers)
+{
+	RenderInput input;
+	input.kind = kind;
+	input.mode = mainWindow->_transformMode;
+	input.modifiers = modifiers;
+	input.x = input.y = 0;
+	input.dx = input.dy = 0;
+	input.rotationFactor = translateSensivety(mainWindow->rotationSensivety);
+	input.movementFactor = translateSensivety(mainWindow->movementSensivety);
+	input.scaleFactor = translateSensivety(mainWindow->scaleSensivety);
+	return input;
 }
 
-
 /***************************************************************************************/
 void DrawArea::mouseMoveEvent(QMouseEvent* event)
 {
 	if (renderingSuspended)
 		return;
 
+	/* the render thread applies the movement, so we don't wait for the frame here */
 	QPoint screenDist = event->pos() - startMousePos;
-	Vector3 steps = engine->getSteps(event->pos().x(), event->pos().y());
 
-	double stepXabs = screenDist.rx();
-	double stepYabs = screenDist.ry();
-	double stepX = steps.x() * stepXabs;
-	double stepY = steps.y() * stepYabs;
-
-	switch(mainWindow->_transformMode)
-	{
-	case TRANSFORM_CAMERA:
-		switch(QApplication::keyboardModifiers()) {
-		case Qt::ShiftModifier:
-			engine->moveCamera(0, stepX * translateSensivety(mainWindow->movementSensivety));
-			engine->moveCamera(1, stepY * translateSensivety(mainWindow->movementSensivety));
-			break;
-		default:
-			engine->rotateCamera(0, stepYabs * translateSensivety(mainWindow->rotationSensivety));
-			engine->rotateCamera(1, -stepXabs * translateSensivety(mainWindow->rotationSensivety));
-			break;
-		}
-		break;
-	case TRANSFORM_OBJECT:
-		switch(QApplication::keyboardModifiers()) {
-		case Qt::ShiftModifier:
-			engine->moveObject(0, stepX * translateSensivety(mainWindow->movementSensivety));
-			engine->moveObject(1, stepY * translateSensivety(mainWindow->movementSensivety));
-			break;
-		case Qt::ControlModifier:
-			engine->scaleObject(0, stepX * translateSensivety(mainWindow->scaleSensivety));
-			engine->scaleObject(1, stepY * translateSensivety(mainWindow->scaleSensivety));
-			break;
-		default:
-			engine->rotateObject(0, stepYabs  * translateSensivety(mainWindow->rotationSensivety));
-			engine->rotateObject(1, -stepXabs * translateSensivety(mainWindow->rotationSensivety));
-			break;
-		}
-		break;
-	}
+	RenderInput input = createInput(mainWindow, RenderInput::MOUSE_MOVE, QApplication::keyboardModifiers());
+	input.x = event->pos().x();
+	input.y = event->pos().y();
+	input.dx = screenDist.rx();
+	input.dy = screenDist.ry();
+	_renderThread->queueInput(input);
 
 	startMousePos = event->pos();
-	invalidateScene();
-
 }
 
 /***************************************************************************************/
@@ -201,44 +169,9 @@ void DrawArea::wheelEvent (QWheelEvent * event )
 	if (renderingSuspended)
 		return;
 
-	double stepZabs = ((double)event->delta() / 120) /* every wheel event will be 1deg rotation*/;
-	double stepZ = engine->getSteps(0,0).z() * stepZabs * 5;
-
-	switch(mainWindow->_transformMode)
-	{
-	case TRANSFORM_CAMERA:
-		switch(QApplication::keyboardModifiers()) {
-		case Qt::ShiftModifier:
-			engine->moveCamera(2, stepZ * translateSensivety(mainWindow->movementSensivety));
-			break;
-		default:
-			engine->rotateCamera(2, stepZabs * translateSensivety(mainWindow->rotationSensivety));
-			break;
-		}
-		break;
-	case TRANSFORM_OBJECT:
-		switch(QApplication::keyboardModifiers()) {
-		case Qt::ShiftModifier:
-			engine->moveObject(2, stepZ * translateSensivety(mainWindow->movementSensivety));
-			break;
-		//case Qt::ShiftModifier | Qt::ControlModifier:
-		//	engine->scaleObject(2, stepZ * translateSensivety(mainWindow->scaleSensivety));
-		//	break;
-		case Qt::ControlModifier:
-			engine->scaleObject(0, stepZ * translateSensivety(mainWindow->scaleSensivety));
-			engine->scaleObject(1, stepZ * translateSensivety(mainWindow->scaleSensivety));
-			engine->scaleObject(2, stepZ * translateSensivety(mainWindow->scaleSensivety));
-			break;
-		default:
-			engine->rotateObject(2, stepZabs  * translateSensivety(mainWindow->rotationSensivety));
-			break;
-		}
-		break;
-	}
-
-	invalidateScene();
-	engine->commitRotation();
-
+	RenderInput input = createInput(mainWindow, RenderInput::WHEEL, QApplication::keyboardModifiers());
+	input.dx = ((double)event->delta() / 120) /* every wheel event will be 1deg rotation*/;
+	_renderThread->queueInput(input);
 }
 
 /***************************************************************************************/
@@ -251,16 +184,19 @@ void DrawArea::mousePressEvent(QMouseEvent* event)
 
 	startMousePos = event->pos();
 
-	if (engine->getDrawSeparateObjects() && (event->modifiers() == 0))
+	if (event->modifiers() == 0)
 	{
-		if (engine->selectObject(startMousePos.x(), startMousePos.y()))
-			invalidateScene();
+		RenderInput input = createInput(mainWindow, RenderInput::SELECT, event->modifiers());
+		input.x = startMousePos.x();
+		input.y = startMousePos.y();
+		_renderThread->queueInput(input);
 	}
 }
 
 void DrawArea::mouseReleaseEvent(QMouseEvent * event)
 {
-	engine->commitRotation();
+	RenderInput input = createInput(mainWindow, RenderInput::COMMIT, event->modifiers());
+	_renderThread->queueInput(input);
 }
 
 /***************************************************************************************/
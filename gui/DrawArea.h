@@ -29,6 +29,7 @@
 #include "renderer/Texture.h"
 
 class MainWindow;
+class RenderThread;
 
 class DrawArea: public QWidget
 {
@@ -38,6 +39,12 @@ public:
 
 	void invalidateScene(bool force = false);
 	void suspendRendering(bool suspend);
+	void stopRendering();
+	void setAdaptiveQuality(bool enable, double targetFrameTime = 33);
+
+	/* engine lock for the GUI thread, see RenderThread::lockEngine */
+	void lockEngine();
+	void unlockEngine();
 
 private:
 	// events for painting
@@ -55,13 +62,10 @@ private:
 
 private:
 	// data
-	QImage *_image;
-	Texture *_outputTexture;
+	RenderThread *_renderThread;
 	MainWindow *mainWindow;
-	Engine* engine;
 	QPoint startMousePos;
 
-	bool sceneValid;
 	bool renderingSuspended;
 };
 
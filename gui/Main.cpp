@@ -19,6 +19,7 @@
 
 #include "MainWindow.h"
 #include <QApplication>
+#include <QMutexLocker>
 
 int main(int argc, char** argv)
 {
@@ -38,6 +39,7 @@ int main(int argc, char** argv)
 	MainWindow *mainwindow = new MainWindow();
 
 	 if (argc > 1) {
+		 QMutexLocker lock(mainwindow->getEngineLock());
 		 mainwindow->getEngine()->loadSceneFromOBJ(argv[1]);
 		 mainwindow->updateStatus();
 	 }
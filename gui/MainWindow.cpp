@@ -29,7 +29,7 @@
 #include <QFileDialog>
 #include <QDockWidget>
 
-MainWindow::MainWindow()
+MainWindow::MainWindow() : engineLock(QMutex::Recursive)
 {
 	/* settings*/
 	rotationSensivety = 50;
@@ -118,6 +118,7 @@ MainWindow::MainWindow()
 
 void MainWindow::updateStatus()
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 
 	/* scene menu*/
@@ -147,8 +148,21 @@ void MainWindow::updateStatus()
 	setWindowTitle(str);
 }
 
+EngineLocker::EngineLocker(MainWindow *window) : _window(window)
+{
+	_window->drawArea->lockEngine();
+}
+
+EngineLocker::~EngineLocker()
+{
+	_window->drawArea->unlockEngine();
+}
+
 MainWindow::~MainWindow()
 {
+	// render thread uses the engine
+	drawArea->stopRendering();
+
 	delete engine;
 	delete renderer;
 }
@@ -173,6 +187,8 @@ void MainWindow::onModelLoad()
 		return;
 
 	QString file = dlg->selectedFiles().first();
+
+	EngineLocker lock(this);
 	engine->loadSceneFromOBJ(file.toStdString().c_str());
 
 	drawArea->invalidateScene();
@@ -181,6 +197,7 @@ void MainWindow::onModelLoad()
 
 void MainWindow::onReset()
 {
+	EngineLocker lock(this);
 	engine->resetScene();
 	drawArea->invalidateScene();
 	updateStatus();
@@ -189,6 +206,7 @@ void MainWindow::onReset()
 
 void MainWindow::onLoadDebugModel()
 {
+	EngineLocker lock(this);
 	engine->loadDebugScene();
 	drawArea->invalidateScene();
 	updateStatus();
@@ -214,6 +232,7 @@ void MainWindow::onSidePanelShowHide(bool checked)
 
 void MainWindow::onDrawBoundingBox(bool checked)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.drawBoundingBox = checked;
 	engine->setEngineOperationFlags(flags);
@@ -222,6 +241,7 @@ void MainWindow::onDrawBoundingBox(bool checked)
 
 void MainWindow::onDrawAxes(bool checked)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.drawAxes = checked;
 	engine->setEngineOperationFlags(flags);
@@ -230,6 +250,7 @@ void MainWindow::onDrawAxes(bool checked)
 
 void MainWindow::onDrawNormals(bool checked)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.drawVertexNormals = checked;
 	engine->setEngineOperationFlags(flags);
@@ -237,6 +258,7 @@ void MainWindow::onDrawNormals(bool checked)
 }
 void MainWindow::onDrawfaceNormals(bool checked)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.drawFaces = checked;
 	engine->setEngineOperationFlags(flags);
@@ -244,6 +266,7 @@ void MainWindow::onDrawfaceNormals(bool checked)
 }
 void MainWindow::onDrawWireframe(bool checked)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.drawWireFrame = checked;
 	engine->setEngineOperationFlags(flags);
@@ -252,6 +275,7 @@ void MainWindow::onDrawWireframe(bool checked)
 
 void MainWindow::onBackFaceCulling(bool checked)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.backFaceCulling = checked;
 	engine->setEngineOperationFlags(flags);
@@ -260,6 +284,7 @@ void MainWindow::onBackFaceCulling(bool checked)
 
 void MainWindow::onDrawDepthbuffer(bool checked)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.depthBufferVisualization = checked;
 	engine->setEngineOperationFlags(flags);
@@ -273,6 +298,7 @@ void MainWindow::onDrawDepthbuffer(bool checked)
 
 void MainWindow::onShadingNone(bool checked)
 {
+	EngineLocker lock(this);
 	if (!checked)
 		return;
 
@@ -282,6 +308,7 @@ void MainWindow::onShadingNone(bool checked)
 }
 void MainWindow::onShadingFlat(bool checked)
 {
+	EngineLocker lock(this);
 	if (!checked)
 		return;
 
@@ -291,6 +318,7 @@ void MainWindow::onShadingFlat(bool checked)
 
 void MainWindow::onShadingGorald(bool checked)
 {
+	EngineLocker lock(this);
 	if (!checked)
 		return;
 
@@ -300,6 +328,7 @@ void MainWindow::onShadingGorald(bool checked)
 
 void MainWindow::onShadingPhong(bool checked)
 {
+	EngineLocker lock(this);
 	if (!checked)
 		return;
 
@@ -309,18 +338,21 @@ void MainWindow::onShadingPhong(bool checked)
 
 void MainWindow::onInvertNormals(bool checked)
 {
+	EngineLocker lock(this);
 	engine->setInvertNormals(checked);
 	drawArea->invalidateScene();
 }
 
 void MainWindow::onInvertFaces(bool checked)
 {
+	EngineLocker lock(this);
 	engine->setInvertFaces(checked);
 	drawArea->invalidateScene();
 }
 
 void MainWindow::onDualfaceLighting(bool checked)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.twofaceLighting = checked;
 	engine->setEngineOperationFlags(flags);
@@ -330,6 +362,7 @@ void MainWindow::onDualfaceLighting(bool checked)
 
 void MainWindow::onAllFaceLighting(bool checked)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.forceFrontFaces = checked;
 	engine->setEngineOperationFlags(flags);
@@ -348,6 +381,7 @@ void MainWindow::onMouseSensivetyDialog()
 
 void MainWindow::onCameraTransformMode()
 {
+	EngineLocker lock(this);
 	_transformMode = TRANSFORM_CAMERA;
 	engine->setDrawSeperateObjects(false);
 	drawArea->invalidateScene();
@@ -355,6 +389,7 @@ void MainWindow::onCameraTransformMode()
 
 void MainWindow::onWorldTransformationMode()
 {
+	EngineLocker lock(this);
 	_transformMode = TRANSFORM_OBJECT;
 	engine->setDrawSeperateObjects(false);
 	drawArea->invalidateScene();
@@ -362,6 +397,7 @@ void MainWindow::onWorldTransformationMode()
 
 void MainWindow::onSeparateObjectsMode()
 {
+	EngineLocker lock(this);
 	_transformMode = TRANSFORM_OBJECT;
 	engine->setDrawSeperateObjects(true);
 	drawArea->invalidateScene();
@@ -369,12 +405,14 @@ void MainWindow::onSeparateObjectsMode()
 
 void MainWindow::onTransformationsReset()
 {
+	EngineLocker lock(this);
 	engine->resetTransformations();
 	drawArea->invalidateScene();
 }
 
 void MainWindow::onLeftCoordinateSystem(bool enable)
 {
+	EngineLocker lock(this);
 	EngineOperationFlags flags = engine->getEngineOperationFlags();
 	flags.leftcoordinateSystem = enable;
 	engine->setEngineOperationFlags(flags);
@@ -383,16 +421,19 @@ void MainWindow::onLeftCoordinateSystem(bool enable)
 
 void MainWindow::onRotationTopBottom()
 {
+	EngineLocker lock(this);
 	engine->setRotationmode((ROTATION_MODE)(ROTATION_X | ROTATION_Z));
 }
 
 void MainWindow::onRotationLeftRight()
 {
+	EngineLocker lock(this);
 	engine->setRotationmode((ROTATION_MODE)(ROTATION_Y | ROTATION_Z));
 }
 
 void MainWindow::onRotationCombined()
 {
+	EngineLocker lock(this);
 	engine->setRotationmode((ROTATION_MODE)(ROTATION_X | ROTATION_Y | ROTATION_Z));
 }
 
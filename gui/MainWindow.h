@@ -22,6 +22,7 @@
 #define MAINWINDOW_H_
 
 #include <QMainWindow>
+#include <QMutex>
 #include "ui_MainWindow.h"
 
 #include <QMouseEvent>
@@ -36,8 +37,22 @@ enum TRANSFORM_MODES {
 class MouseSensivetyDialog;
 class SidePanel;
 class Engine;
+class MainWindow;
 
 
+/*
+ * Holds the engine lock of the window for the GUI thread, until the end of the scope.
+ * A refinement pass of the render thread that has the lock is aborted, so the GUI doesn't wait for it
+ */
+class EngineLocker
+{
+public:
+	explicit EngineLocker(MainWindow *window);
+	~EngineLocker();
+private:
+	MainWindow *_window;
+};
+
 class MainWindow : public QMainWindow, public Ui::MainWindow
 {
 	Q_OBJECT
@@ -47,6 +62,9 @@ public:
 	virtual ~MainWindow();
 	Engine* getEngine() { return engine;}
 
+	/* engine is rendered on a separate thread, which takes this lock (the GUI thread uses EngineLocker) */
+	QMutex* getEngineLock() { return &engineLock; }
+
 	void updateStatus();
 
 	double movementSensivety;
@@ -59,6 +77,7 @@ public:
 private:
 	Engine* engine;
 	Renderer * renderer;
+	QMutex engineLock;
 
 public slots:
 
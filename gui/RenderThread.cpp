@@ -0,0 +1,485 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "RenderThread.h"
+#include "engine/Engine.h"
+#include "common/ThreadPool.h"
+
+#include <QMutexLocker>
+#include <QMetaObject>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <algorithm>
+
+/* interaction is considered finished when there is no input for this long */
+#define INTERACTION_TIMEOUT_MSEC 150
+
+/* refinement passes */
+enum
+{
+	PASS_INTERACTIVE = -1,	/* frame rendered during interaction, at the quality controller level */
+	PASS_PREVIEW = 0,		/* fast frame, no shadows and reduced resolution */
+	PASS_FULL = 1,			/* full quality frame, first sample of the antialiased one */
+	PASS_FIRST_SAMPLE = 2,	/* jittered samples */
+};
+
+/* quality level used for the preview pass, below all levels of the quality controller */
+#define PREVIEW_QUALITY_LEVEL -1
+
+/* sub-pixel sample positions, in 1/16 of pixel (standard 8x multisample pattern) */
+static const int samplePositions[][2] =
+{
+	{ 1, -3 }, { -1, 3 }, { 5, 1 }, { -3, -5 },
+	{ -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 },
+};
+
+#define SAMPLE_COUNT ((int)(sizeof(samplePositions) / sizeof(samplePositions[0])))
+#define PASS_DONE (PASS_FIRST_SAMPLE + SAMPLE_COUNT)
+
+/***************************************************************************************/
+
+RenderThread::RenderThread(Engine *engine, QMutex *engineLock, QWidget *target) :
+	_engine(engine), _engineLock(engineLock), _target(target),
+	_frameRequested(false), _stopRequested(false), _width(0), _height(0),
+	_adaptiveQuality(true), _targetFrameTime(33), _abort(false), _abortable(false), _engineWaiters(0),
+	_appliedQualityLevel(0), _refinePass(PASS_DONE), _sampleCount(0),
+	_renderBuffer(0), _readyBuffer(1), _displayBuffer(2), _newFrame(false)
+{
+	_qualityController.setLogging(getenv("CG_QUALITY_LOG") != NULL);
+}
+
+RenderThread::~RenderThread()
+{
+	stop();
+
+	for (int i = 0 ; i < 3 ; i++) {
+		delete _buffers[i].image;
+		delete _buffers[i].texture;
+	}
+}
+
+/***************************************************************************************/
+
+void RenderThread::setOutputSize(int width, int height)
+{
+	QMutexLocker lock(&_inputLock);
+	_width = width;
+	_height = height;
+	_frameRequested = true;
+	if (_abortable)
+		_abort = true;
+	_inputReady.wakeOne();
+}
+
+void RenderThread::queueInput(const RenderInput &input)
+{
+	QMutexLocker lock(&_inputLock);
+
+	/* latest state wins - merge with previous event if it does same thing */
+	if (!_inputs.empty())
+	{
+		RenderInput &last = _inputs.back();
+
+		if ((input.kind == RenderInput::MOUSE_MOVE || input.kind == RenderInput::WHEEL) &&
+				last.kind == input.kind && last.mode == input.mode && last.modifiers == input.modifiers)
+		{
+			last.x = input.x;
+			last.y = input.y;
+			last.dx += input.dx;
+			last.dy += input.dy;
+			return;
+		}
+	}
+
+	_inputs.push_back(input);
+	if (_abortable)
+		_abort = true;
+	_inputReady.wakeOne();
+}
+
+void RenderThread::requestFrame()
+{
+	QMutexLocker lock(&_inputLock);
+	_frameRequested = true;
+	if (_abortable)
+		_abort = true;
+	_inputReady.wakeOne();
+}
+
+void RenderThread::setAdaptiveQuality(bool enable, double targetFrameTime)
+{
+	QMutexLocker lock(&_inputLock);
+	_adaptiveQuality = enable;
+	_targetFrameTime = targetFrameTime;
+	_frameRequested = true;
+	if (_abortable)
+		_abort = true;
+	_inputReady.wakeOne();
+}
+
+void RenderThread::lockEngine()
+{
+	{
+		QMutexLocker lock(&_inputLock);
+		_engineWaiters++;
+		if (_abortable)
+			_abort = true;
+	}
+
+	_engineLock->lock();
+
+	QMutexLocker lock(&_inputLock);
+	_engineWaiters--;
+	_inputReady.wakeOne();
+}
+
+void RenderThread::unlockEngine()
+{
+	_engineLock->unlock();
+}
+
+void RenderThread::stop()
+{
+	{
+		QMutexLocker lock(&_inputLock);
+		_stopRequested = true;
+		_abort = true;
+		_inputReady.wakeOne();
+	}
+	wait();
+}
+
+/***************************************************************************************/
+
+const QImage* RenderThread::acquireFrame(int &renderTime)
+{
+	QMutexLocker lock(&_bufferLock);
+
+	if (_newFrame) {
+		std::swap(_displayBuffer, _readyBuffer);
+		_newFrame = false;
+	}
+
+	renderTime = _buffers[_displayBuffer].renderTime;
+	return _buffers[_displayBuffer].image;
+}
+
+/***************************************************************************************/
+
+void RenderThread::prepareBuffer(FrameBuffer &buffer, int width, int height)
+{
+	if (buffer.texture && buffer.texture->getWidth() == width && buffer.texture->getHeight() == height)
+		return;
+
+	delete buffer.image;
+	delete buffer.texture;
+
+	buffer.texture = new Texture(width, height);
+
+	// wrap the texture in image, so GUI can draw it directly
+	buffer.image = new QImage(
+			(uchar*)buffer.texture->getPointer(),
+			buffer.texture->getWidth(),
+			buffer.texture->getHeight(),
+			buffer.texture->getWidth() * sizeof(DEVICE_PIXEL),
+			QImage::Format_RGB32
+	);
+}
+
+/***************************************************************************************/
+
+void RenderThread::applyInput(const RenderInput &input)
+{
+	if (input.kind == RenderInput::MOUSE_MOVE || input.kind == RenderInput::WHEEL)
+		_qualityController.beginInteraction();
+
+	switch (input.kind)
+	{
+	case RenderInput::MOUSE_MOVE:
+	{
+		Vector3 steps = _engine->getSteps(input.x, input.y);
+
+		double stepXabs = input.dx;
+		double stepYabs = input.dy;
+		double stepX = steps.x() * stepXabs;
+		double stepY = steps.y() * stepYabs;
+
+		switch(input.mode)
+		{
+		case TRANSFORM_CAMERA:
+			switch(input.modifiers) {
+			case Qt::ShiftModifier:
+				_engine->moveCamera(0, stepX * input.movementFactor);
+				_engine->moveCamera(1, stepY * input.movementFactor);
+				break;
+			default:
+				_engine->rotateCamera(0, stepYabs * input.rotationFactor);
+				_engine->rotateCamera(1, -stepXabs * input.rotationFactor);
+				break;
+			}
+			break;
+		case TRANSFORM_OBJECT:
+			switch(input.modifiers) {
+			case Qt::ShiftModifier:
+				_engine->moveObject(0, stepX * input.movementFactor);
+				_engine->moveObject(1, stepY * input.movementFactor);
+				break;
+			case Qt::ControlModifier:
+				_engine->scaleObject(0, stepX * input.scaleFactor);
+				_engine->scaleObject(1, stepY * input.scaleFactor);
+				break;
+			default:
+				_engine->rotateObject(0, stepYabs  * input.rotationFactor);
+				_engine->rotateObject(1, -stepXabs * input.rotationFactor);
+				break;
+			}
+			break;
+		}
+		break;
+	}
+	case RenderInput::WHEEL:
+	{
+		double stepZabs = input.dx;
+		double stepZ = _engine->getSteps(0,0).z() * stepZabs * 5;
+
+		switch(input.mode)
+		{
+		case TRANSFORM_CAMERA:
+			switch(input.modifiers) {
+			case Qt::ShiftModifier:
+				_engine->moveCamera(2, stepZ * input.movementFactor);
+				break;
+			default:
+				_engine->rotateCamera(2, stepZabs * input.rotationFactor);
+				break;
+			}
+			break;
+		case TRANSFORM_OBJECT:
+			switch(input.modifiers) {
+			case Qt::ShiftModifier:
+				_engine->moveObject(2, stepZ * input.movementFactor);
+				break;
+			case Qt::ControlModifier:
+				_engine->scaleObject(0, stepZ * input.scaleFactor);
+				_engine->scaleObject(1, stepZ * input.scaleFactor);
+				_engine->scaleObject(2, stepZ * input.scaleFactor);
+				break;
+			default:
+				_engine->rotateObject(2, stepZabs  * input.rotationFactor);
+				break;
+			}
+			break;
+		}
+
+		_engine->commitRotation();
+		break;
+	}
+	case RenderInput::COMMIT:
+		_engine->commitRotation();
+		_qualityController.endInteraction();
+		break;
+	case RenderInput::SELECT:
+		if (_engine->getDrawSeparateObjects())
+			_engine->selectObject(input.x, input.y);
+		break;
+	}
+}
+
+/***************************************************************************************/
+
+void RenderThread::accumulateSample(FrameBuffer &buffer, bool first)
+{
+	const int count = buffer.texture->getWidth() * buffer.texture->getHeight();
+	DEVICE_PIXEL *pixels = buffer.texture->getPointer();
+
+	if (first) {
+		_accumulation.assign(count * 3, 0);
+		_sampleCount = 0;
+	}
+
+	const unsigned int samples = ++_sampleCount;
+	unsigned int *accumulation = &_accumulation[0];
+
+	// add the new sample and replace it with average of all samples so far
+	parallelFor(0, count, 4096, [=] (int from, int to)
+	{
+		for (int i = from ; i < to ; i++)
+		{
+			unsigned int *sum = &accumulation[i * 3];
+			sum[0] += pixels[i].Red;
+			sum[1] += pixels[i].Green;
+			sum[2] += pixels[i].Blue;
+
+			pixels[i] = DEVICE_PIXEL(
+				(sum[0] + samples / 2) / samples,
+				(sum[1] + samples / 2) / samples,
+				(sum[2] + samples / 2) / samples);
+		}
+	});
+}
+
+/***************************************************************************************/
+
+void RenderThread::run()
+{
+	std::vector<RenderInput> inputs;
+
+	{
+		QMutexLocker lock(_engineLock);
+		_engine->setAbortFlag(&_abort);
+
+		// a frame with each texture as soon as it is loaded
+		_engine->setTextureLoadedCallback([this] { requestFrame(); });
+	}
+
+	forever
+	{
+		int width, height;
+		bool frameNeeded;
+
+		// wait for something to do and take all of it at once
+		{
+			QMutexLocker lock(&_inputLock);
+
+			// the GUI thread aborted the last pass to get the engine, let it have it first
+			while (!_stopRequested && _engineWaiters > 0)
+				_inputReady.wait(&_inputLock);
+
+			while (!_stopRequested && !_frameRequested && _inputs.empty())
+			{
+				if (!_qualityController.isInteracting())
+				{
+					/* nothing new - keep refining the current frame */
+					if (_refinePass != PASS_DONE)
+						break;
+
+					_inputReady.wait(&_inputLock);
+					continue;
+				}
+
+				/* no input for a while - interaction ended, render in full quality */
+				if (!_inputReady.wait(&_inputLock, INTERACTION_TIMEOUT_MSEC)) {
+					_qualityController.endInteraction();
+					break;
+				}
+			}
+
+			if (_stopRequested)
+				break;
+
+			_qualityController.setEnabled(_adaptiveQuality);
+			_qualityController.setTargetFrameTime(_targetFrameTime);
+
+			// frames of the interaction and the previews that follow changes are always shown. The full quality
+			// frame and the samples that refine it can be thrown away, the last shown frame stays until they are done
+			_abortable = _inputs.empty() && !_qualityController.isInteracting() && !(_frameRequested && _adaptiveQuality);
+			_abort = false;
+
+			inputs.swap(_inputs);
+			frameNeeded = _frameRequested;
+			_frameRequested = false;
+			width = _width;
+			height = _height;
+		}
+
+		struct timeval t,t2,t3;
+		gettimeofday(&t, NULL);
+
+		FrameBuffer &buffer = _buffers[_renderBuffer];
+		int pass, level;
+
+		{
+			QMutexLocker lock(_engineLock);
+
+			for (unsigned int i = 0 ; i < inputs.size() ; i++) {
+				applyInput(inputs[i]);
+
+				// end of drag doesn't change the picture
+				if (inputs[i].kind != RenderInput::COMMIT)
+					frameNeeded = true;
+			}
+
+			inputs.clear();
+
+			// picture changed - start refining it from scratch
+			if (frameNeeded)
+				_refinePass = (_adaptiveQuality && !_qualityController.isInteracting()) ? PASS_PREVIEW : PASS_FULL;
+
+			if (width <= 0 || height <= 0)
+				_refinePass = PASS_DONE;
+
+			pass = _qualityController.isInteracting() ? PASS_INTERACTIVE : _refinePass;
+
+			if (pass == PASS_DONE || (pass == PASS_INTERACTIVE && !frameNeeded))
+				continue;
+
+			// quality level changes when interaction starts or ends, or to keep up with frame time
+			level = (pass == PASS_PREVIEW) ? PREVIEW_QUALITY_LEVEL : _qualityController.getLevel();
+
+			if (level != _appliedQualityLevel) {
+				_appliedQualityLevel = level;
+				_engine->setRenderQuality(level == PREVIEW_QUALITY_LEVEL ?
+						QualityController::getPreviewQuality() : _qualityController.getQuality());
+			}
+
+			if (pass >= PASS_FIRST_SAMPLE)
+				_engine->setJitter(samplePositions[pass - PASS_FIRST_SAMPLE][0] / 16.0,
+						samplePositions[pass - PASS_FIRST_SAMPLE][1] / 16.0);
+			else
+				_engine->setJitter(0, 0);
+
+			prepareBuffer(buffer, width, height);
+			_engine->setOutput(buffer.texture, width, height);
+
+			// partial frame, new input is waiting
+			if (!_engine->render())
+				continue;
+		}
+
+		// advance the refinement, any full quality frame is the first sample
+		if (pass >= PASS_FIRST_SAMPLE) {
+			accumulateSample(buffer, false);
+			_refinePass = pass + 1;
+		} else if (level == 0) {
+			accumulateSample(buffer, true);
+			_refinePass = PASS_FIRST_SAMPLE;
+		} else if (pass == PASS_PREVIEW)
+			_refinePass = PASS_FULL;
+
+		gettimeofday(&t2, NULL);
+		timersub(&t2,&t,&t3);
+		buffer.renderTime = t3.tv_sec * 1000 + t3.tv_usec / 1000;
+
+		if (pass == PASS_INTERACTIVE || pass == PASS_FULL)
+			_qualityController.frameRendered(t3.tv_sec * 1000.0 + t3.tv_usec / 1000.0);
+
+		// publish the frame
+		{
+			QMutexLocker lock(&_bufferLock);
+			std::swap(_renderBuffer, _readyBuffer);
+			_newFrame = true;
+		}
+
+		QMetaObject::invokeMethod(_target, "update", Qt::QueuedConnection);
+	}
+
+	QMutexLocker lock(_engineLock);
+	_engine->setAbortFlag(NULL);
+	_engine->setTextureLoadedCallback(std::function<void()>());
+}
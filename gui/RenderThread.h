@@ -0,0 +1,154 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RENDERTHREAD_H_
+#define RENDERTHREAD_H_
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QImage>
+#include <QWidget>
+#include <vector>
+#include <atomic>
+
+#include "MainWindow.h"
+#include "renderer/Texture.h"
+#include "engine/QualityController.h"
+
+class Engine;
+
+/* user input that changes the scene, applied by the render thread just before it renders */
+struct RenderInput
+{
+	enum Kind {
+		MOUSE_MOVE,		/* dx,dy - mouse movement in pixels */
+		WHEEL,			/* dx - wheel steps */
+		COMMIT,			/* end of mouse drag */
+		SELECT,			/* x,y - object selection */
+	};
+
+	Kind kind;
+	TRANSFORM_MODES mode;
+	Qt::KeyboardModifiers modifiers;
+
+	/* mouse position */
+	int x, y;
+	double dx, dy;
+
+	/* sensitivity factors at the time of the event */
+	double rotationFactor;
+	double movementFactor;
+	double scaleFactor;
+};
+
+/*
+ * Renders the engine on its own thread into a set of three output buffers,
+ * so the GUI thread always has the most recently completed frame to show
+ * and never waits for a frame to finish.
+ *
+ * When the view is idle, the frame is refined in several passes, each shown when done:
+ * a fast preview, then the full quality frame, then jittered samples averaged for antialiasing.
+ * Refinement passes are aborted as soon as new input arrives.
+ */
+class RenderThread : public QThread
+{
+public:
+	RenderThread(Engine *engine, QMutex *engineLock, QWidget *target);
+	virtual ~RenderThread();
+
+	/* GUI thread interface */
+	void setOutputSize(int width, int height);
+	void queueInput(const RenderInput &input);
+	void requestFrame();
+	void stop();
+
+	/*
+	 * engine lock for the GUI thread. A refinement pass holds the lock for the whole frame,
+	 * so it is aborted (and rendered again later) instead of making the GUI wait for it
+	 */
+	void lockEngine();
+	void unlockEngine();
+
+	/* degrade quality during interaction to keep up with target frame time */
+	void setAdaptiveQuality(bool enable, double targetFrameTime);
+
+	/* returns the most recent completed frame, valid until the next call */
+	const QImage* acquireFrame(int &renderTime);
+
+protected:
+	void run();
+
+private:
+	struct FrameBuffer
+	{
+		FrameBuffer() : texture(NULL), image(NULL), renderTime(0) {}
+		Texture *texture;
+		QImage *image;
+		int renderTime;
+	};
+
+	void prepareBuffer(FrameBuffer &buffer, int width, int height);
+	void applyInput(const RenderInput &input);
+	void accumulateSample(FrameBuffer &buffer, bool first);
+
+	Engine *_engine;
+	QMutex *_engineLock;
+	QWidget *_target;
+
+	/* pending work, protected by _inputLock */
+	QMutex _inputLock;
+	QWaitCondition _inputReady;
+	std::vector<RenderInput> _inputs;
+	bool _frameRequested;
+	bool _stopRequested;
+	int _width;
+	int _height;
+	bool _adaptiveQuality;
+	double _targetFrameTime;
+
+	/* set when input arrives while a refinement pass that can be thrown away is rendered */
+	std::atomic<bool> _abort;
+	bool _abortable;
+
+	/* GUI thread calls of lockEngine that didn't get the lock yet, the render thread lets them go first */
+	int _engineWaiters;
+
+	/* owned by render thread */
+	QualityController _qualityController;
+	int _appliedQualityLevel;
+
+	/* next refinement pass, and the sum of all samples of the frame rendered so far */
+	int _refinePass;
+	std::vector<unsigned int> _accumulation;
+	int _sampleCount;
+
+	/*
+	 * frame buffers, render one is owned by the render thread, display one by GUI thread
+	 * and the ready one holds the newest completed frame. Swaps are protected by _bufferLock
+	 */
+	QMutex _bufferLock;
+	FrameBuffer _buffers[3];
+	int _renderBuffer;
+	int _readyBuffer;
+	int _displayBuffer;
+	bool _newFrame;
+};
+
+#endif /* RENDERTHREAD_H_ */
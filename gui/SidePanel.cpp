@@ -21,6 +21,7 @@
 #include "MainWindow.h"
 #include "engine/Engine.h"
 
+
 SidePanel::SidePanel(MainWindow* parent) : QDockWidget(parent)
 {
 	mainWindow = parent;
@@ -62,6 +63,7 @@ SidePanel::SidePanel(MainWindow* parent) : QDockWidget(parent)
 	/* bottom bar*/
 	connect(pauseRenderingButton, SIGNAL(clicked(bool)), this, SLOT(onSuspendRendering(bool)));
 	connect(fastRenderingModeButton, SIGNAL(clicked(bool)), this, SLOT(onFastRendering(bool)));
+	fastRenderingModeButton->setChecked(true);
 
 	transLeftRightButton->setAction(mainWindow->actionRotationLeft_right);
 	transTopBottomButton->setAction(mainWindow->actionRotationTop_bottom);
@@ -79,6 +81,7 @@ SidePanel::SidePanel(MainWindow* parent) : QDockWidget(parent)
 
 void SidePanel::fogPanelReadControls()
 {
+	EngineLocker lock(mainWindow);
 	/* update program state when user changes something in fog control panel */
 	int mode = fogModeComboBox->currentIndex();
 
@@ -132,6 +135,7 @@ void SidePanel::fogPanelReadControls()
 
 void SidePanel::fogPanelWriteControls()
 {
+	EngineLocker lock(mainWindow);
 	FogParams params = engine->getFogParams();
 
 	fogStartDepthBox->setValue(params.startPoint);
@@ -148,6 +152,7 @@ void SidePanel::fogPanelWriteControls()
 
 void SidePanel::fogReset()
 {
+	EngineLocker lock(mainWindow);
 	FogParams params = engine->getFogParams();
 	params.reset();
 	engine->setFogParams(params);
@@ -160,6 +165,7 @@ void SidePanel::fogReset()
 /******************************************************************************************/
 void SidePanel::backgroundPanelReadControls()
 {
+	EngineLocker lock(mainWindow);
 	BackgroundParams params = engine->getBackgroundSettings();
 	params.textureFile = backgroundTextureChooser->getFileName().toStdString();
 	params.color = backgroundColorChooser->getColor();
@@ -172,6 +178,7 @@ void SidePanel::backgroundPanelReadControls()
 
 void SidePanel::backgroundPanelWriteControls()
 {
+	EngineLocker lock(mainWindow);
 	BackgroundParams params = engine->getBackgroundSettings();
 	backgroundTextureChooser->setFileName(QString::fromStdString(params.textureFile));
 	backgroundColorChooser->setColor(params.color);
@@ -180,6 +187,7 @@ void SidePanel::backgroundPanelWriteControls()
 
 void SidePanel::backgroundReset()
 {
+	EngineLocker lock(mainWindow);
 	engine->resetBackground();
 	backgroundPanelWriteControls();
 	mainWindow->drawArea->invalidateScene();
@@ -198,8 +206,8 @@ void SidePanel::onSuspendRendering(bool checked)
 
 void SidePanel::onFastRendering(bool checked)
 {
-	/* set fast rendering flag for the engine*/
-	mainWindow->drawArea->invalidateScene();
+	/* lower the quality while user moves things around */
+	mainWindow->drawArea->setAdaptiveQuality(checked);
 }
 
 
@@ -19,10 +19,12 @@
 #include "Model.h"
 #include <assert.h>
 #include "common/Iterators.h"
+#include "common/ThreadPool.h"
 
 
 Model::Model(int vertexMaxCount, int polygonMaxCount):  
-	vertexMaxCount(vertexMaxCount), _vertexCount(0)
+	vertexMaxCount(vertexMaxCount), _vertexCount(0),
+	_textureMapping(TEXTURE_MAPPING_MODEL), _modelTexCoords(NULL)
 {
 	/* Create a object with predefined amount of vertices in all its polygons*/
 	vertices = new Vertex[vertexMaxCount+1];
@@ -42,6 +44,7 @@ Model::~Model()
 	delete [] vertices;
 	delete [] polygons;
 	delete [] polygonData;
+	delete [] _modelTexCoords;
 }
 
 Model::PolygonData* Model::allocatePolygon(void)
@@ -223,35 +226,73 @@ Model* Model::createTriangleModel( Vector3 a, Vector3 b, Vector3 c )
 	return result;
 }
 
+/* texture coordinates of a vertex, from its position in the bounding box (0..1 on each axis) */
+static Vector3 mapVertex(TEXTURE_MAPPING mapping, const Model::Vertex &v, const Vector3 &position, const Vector3 &center)
+{
+	Vector3 d = v.position - center;
+	double length = d.len();
+
+	switch (mapping)
+	{
+	case TEXTURE_MAPPING_CYLINDER:
+		return Vector3(0.5 + atan2(d.z(), d.x()) / (2 * M_PI), position.y(), 0);
+	case TEXTURE_MAPPING_SPHERE:
+		return Vector3(0.5 + atan2(d.z(), d.x()) / (2 * M_PI), length > 0 ? 0.5 - asin(d.y() / length) / M_PI : 0.5, 0);
+	case TEXTURE_MAPPING_BOX:
+	{
+		double x = fabs(v.normal.x()), y = fabs(v.normal.y()), z = fabs(v.normal.z());
+		if (x >= y && x >= z)
+			return Vector3(position.z(), position.y(), 0);
+		if (y >= z)
+			return Vector3(position.x(), position.z(), 0);
+		return Vector3(position.x(), position.y(), 0);
+	}
+	default:
+		return Vector3(position.x(), position.y(), 0);
+	}
+}
 
-#if 0
-void calculateUV( const UniformBuffer *u, const Vector4 pos, double &u1, double &v1 )
+void Model::setTextureMapping(TEXTURE_MAPPING mapping)
 {
-	if (u->texMode == TM_PROJECTION) {
-		u1 = pos.x();
-		v1 = pos.y();
+	if (mapping == _textureMapping)
 		return;
+
+	if (_textureMapping == TEXTURE_MAPPING_MODEL) 
+	{
+		if (!_modelTexCoords)
+			_modelTexCoords = new Vector3[_vertexCount];
+		for (int i = 0 ; i < _vertexCount ; i++)
+			_modelTexCoords[i] = vertices[i].texCoord;
 	}
 
-	Vector4 opos = (pos * u->mat_cameraToObjectSpace).returnNormal();
+	_textureMapping = mapping;
 
-	switch(u->texMode)
+	if (mapping == TEXTURE_MAPPING_MODEL) 
 	{
-	case TM_PROJECTION:
-		// simple position
-		u1 = pos.x();
-		v1 = pos.y();
-		break;
-	case TM_CYLINDER:
-		u1 = 0.5 + atan2(opos.z(), opos.x()) / (2 * M_PI);
-		v1 = (opos.y() - u->y_min) / (u->y_max - u->y_min);
-		break;
-	case TM_SPHERE:
-		u1 = 0.5 + atan2(opos.z(), opos.x()) / (2 * M_PI);
-		v1 = 0.5 - asin(opos.y()) / (M_PI);
-		break;
-	default:
-		assert(0);
+		for (int i = 0 ; i < _vertexCount ; i++)
+			vertices[i].texCoord = _modelTexCoords[i];
+		return;
 	}
+
+	BOUNDING_BOX box = getBoundingBox();
+	Vector3 center = box.getCenter();
+	Vector3 sizes = box.getSizes();
+
+	// flat models have no extent along some axis
+	for (int axis = 0 ; axis < 3 ; axis++)
+		if (sizes[axis] <= 0)
+			sizes[axis] = 1;
+
+	// computed once here, rather than with trigonometry for each pixel
+	parallelFor(0, _vertexCount, 4096, [&](int from, int to)
+	{
+		for (int i = from ; i < to ; i++)
+		{
+			const Vector3 &p = vertices[i].position;
+			Vector3 position((p.x() - box.point1.x()) / sizes.x(), (p.y() - box.point1.y()) / sizes.y(),
+				(p.z() - box.point1.z()) / sizes.z());
+
+			vertices[i].texCoord = mapVertex(mapping, vertices[i], position, center);
+		}
+	});
 }
-#endif
@@ -25,6 +25,16 @@
 #include "Material.h"
 #include <string>
 
+/* where texture coordinates of the vertices come from */
+enum TEXTURE_MAPPING
+{
+	TEXTURE_MAPPING_MODEL,		/* as given by the model file */
+	TEXTURE_MAPPING_PLANAR,		/* projected along Z on the bounding box */
+	TEXTURE_MAPPING_CYLINDER,	/* around the Y axis */
+	TEXTURE_MAPPING_SPHERE,
+	TEXTURE_MAPPING_BOX,		/* projected along the axis closest to the normal */
+};
+
 class Model 
 {
 public:
@@ -55,6 +65,10 @@ public:
 	void invertVertexNormals();
 	void invertPolygonNormals();
 
+	/* computes the texture coordinates of all vertices again (from positions and normals) */
+	void setTextureMapping(TEXTURE_MAPPING mapping);
+	TEXTURE_MAPPING getTextureMapping() const { return _textureMapping; }
+
 	// continuation of construction
 	PolygonData* allocatePolygon(void);
 	int allocateVertex(const Vertex &v);
@@ -77,6 +91,10 @@ private:
 	int _vertexCount;
 	int _polygonCount;
 
+	// texture coordinates of the file, while generated ones replace them
+	TEXTURE_MAPPING _textureMapping;
+	Vector3 *_modelTexCoords;
+
 	// construction
 	int vertexMaxCount;
 	PolygonData *currentPolygonData;
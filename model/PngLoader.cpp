@@ -176,6 +176,67 @@ bool PngLoader::ReadPng()
 }
 
 
+bool PngLoader::ReadPngHeader()
+{
+	if ((m_fp = fopen(m_fileName, "rb")) == NULL)
+		return false;
+
+	if (!IsPngFile())
+		return false;
+
+	m_png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (m_png_ptr == NULL)
+		return false;
+
+	m_info_ptr = png_create_info_struct(m_png_ptr);
+	if (m_info_ptr == NULL) {
+		png_destroy_read_struct(&m_png_ptr, NULL, NULL);
+		return false;
+	}
+
+	if (setjmp(png_jmpbuf(m_png_ptr)))
+		return false;
+
+	png_init_io(m_png_ptr, m_fp);
+	png_set_sig_bytes(m_png_ptr, PNG_BYTES_TO_CHECK);
+	png_read_info(m_png_ptr, m_info_ptr);
+
+	// palette, gray and 16 bit images to 8 bit RGB, alpha replaced by filler, in the order of the texels
+	png_set_expand(m_png_ptr);
+	png_set_strip_16(m_png_ptr);
+	png_set_gray_to_rgb(m_png_ptr);
+	png_set_strip_alpha(m_png_ptr);
+	png_set_bgr(m_png_ptr);
+	png_set_filler(m_png_ptr, 0xFF, PNG_FILLER_AFTER);
+	png_set_interlace_handling(m_png_ptr);
+	png_read_update_info(m_png_ptr, m_info_ptr);
+
+	m_width = png_get_image_width(m_png_ptr, m_info_ptr);
+	m_height = png_get_image_height(m_png_ptr, m_info_ptr);
+	return png_get_rowbytes(m_png_ptr, m_info_ptr) == (png_size_t)m_width * 4;
+}
+
+bool PngLoader::ReadPngPixels(unsigned char *pixels, int stride)
+{
+	if (!m_png_ptr || !m_info_ptr)
+		return false;
+
+	png_bytep *rows = new png_bytep[m_height];
+	for (int y = 0 ; y < m_height ; y++)
+		rows[y] = pixels + (size_t)y * stride;
+
+	if (setjmp(png_jmpbuf(m_png_ptr))) {
+		delete [] rows;
+		return false;
+	}
+
+	png_read_image(m_png_ptr, rows);
+	png_read_end(m_png_ptr, NULL);
+
+	delete [] rows;
+	return true;
+}
+
 void PngLoader::SetWidth(int width)
 {
 	m_width = width;
@@ -64,6 +64,14 @@ public:
 	bool InitWritePng();
 	bool WritePng();
 
+	/*
+	 * Reading without a copy of the image: ReadPngHeader opens the file and reads the size, and
+	 * ReadPngPixels decodes it straight into rows of 4 bytes per pixel in B, G, R, X order, from
+	 * any color type and bit depth. ClosePng frees everything after both, even if they failed
+	 */
+	bool ReadPngHeader();
+	bool ReadPngPixels(unsigned char *pixels, int stride);
+
 	void ClosePng();
 private:
 	bool IsPngFile();
@@ -21,4 +21,4 @@
 
 TEMPLATE = subdirs
 CONFIG += ordered
-SUBDIRS = renderer engine model/mtlparser model/objparser model gui bin
+SUBDIRS = renderer engine model/mtlparser model/objparser model gui bin benchmarks
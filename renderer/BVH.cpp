@@ -0,0 +1,376 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "BVH.h"
+#include "common/ThreadPool.h"
+#include <algorithm>
+#include <assert.h>
+
+/* split planes tried along the longest axis of each node */
+#define BVH_BINS 16
+
+/* nodes with that many triangles or less are never split, and with more are always split */
+#define BVH_MIN_LEAF 2
+#define BVH_MAX_LEAF 8
+
+/* cost of visiting a node, relative to testing one triangle */
+#define BVH_TRAVERSAL_COST 1.0
+
+/* subtrees of nodes bigger than that are built in parallel */
+#define BVH_PARALLEL_BUILD 4096
+
+/* deeper nodes are leaves no matter how big they are, this bounds the traversal stack */
+#define BVH_MAX_DEPTH 64
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static double boxArea(const double min[3], const double max[3])
+{
+	double x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+	return x * y + y * z + z * x;
+}
+
+static void growBox(double min[3], double max[3], const double otherMin[3], const double otherMax[3])
+{
+	for (int k = 0 ; k < 3 ; k++) {
+		min[k] = std::min(min[k], otherMin[k]);
+		max[k] = std::max(max[k], otherMax[k]);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void BVH::clear()
+{
+	std::vector<Node>().swap(_nodes);
+	std::vector<PreparedTriangle>().swap(_triangles);
+	_nodeCount = 0;
+}
+
+void BVH::build(std::vector<Triangle> &triangles)
+{
+	clear();
+
+	int count = triangles.size();
+	if (!count)
+		return;
+
+	std::vector<BuildItem> items(count);
+
+	parallelFor(0, count, 4096, [&](int from, int to)
+	{
+		for (int i = from ; i < to ; i++)
+		{
+			const Triangle &t = triangles[i];
+			BuildItem &item = items[i];
+
+			for (int k = 0 ; k < 3 ; k++) {
+				item.min[k] = std::min(t.v0[k], std::min(t.v1[k], t.v2[k]));
+				item.max[k] = std::max(t.v0[k], std::max(t.v1[k], t.v2[k]));
+				item.center[k] = (item.min[k] + item.max[k]) * 0.5;
+			}
+			item.triangle = i;
+		}
+	});
+
+	// a binary tree with at least one triangle in each leaf has at most that many nodes
+	_nodes.resize(2 * count - 1);
+	_nodeCount = 1;
+	buildNode(0, &items[0], count, 0, 0);
+	_nodes.resize(_nodeCount);
+	std::vector<Node>(_nodes).swap(_nodes);
+
+	// leaves refer to ranges of the items, so the triangles are stored in their order
+	_triangles.resize(count);
+
+	parallelFor(0, count, 4096, [&](int from, int to)
+	{
+		for (int i = from ; i < to ; i++)
+		{
+			const Triangle &t = triangles[items[i].triangle];
+			PreparedTriangle &p = _triangles[i];
+
+			p.v0 = t.v0;
+			p.e1 = t.v1 - t.v0;
+			p.e2 = t.v2 - t.v0;
+		}
+	});
+
+	std::vector<Triangle>().swap(triangles);
+}
+
+void BVH::buildNode(int index, BuildItem *items, int count, int first, int depth)
+{
+	Node &node = _nodes[index];
+	double centerMin[3], centerMax[3];
+
+	for (int k = 0 ; k < 3 ; k++) {
+		node.min[k] = items[0].min[k];
+		node.max[k] = items[0].max[k];
+		centerMin[k] = centerMax[k] = items[0].center[k];
+	}
+
+	for (int i = 1 ; i < count ; i++) {
+		growBox(node.min, node.max, items[i].min, items[i].max);
+		growBox(centerMin, centerMax, items[i].center, items[i].center);
+	}
+
+	node.first = first;
+	node.count = count;
+
+	if (count <= BVH_MIN_LEAF || depth >= BVH_MAX_DEPTH)
+		return;
+
+	int axis = 0;
+	for (int k = 1 ; k < 3 ; k++)
+		if (centerMax[k] - centerMin[k] > centerMax[axis] - centerMin[axis])
+			axis = k;
+
+	double extent = centerMax[axis] - centerMin[axis];
+	int left = count / 2;
+
+	if (extent > 0)
+	{
+		struct Bin {
+			double min[3];
+			double max[3];
+			int count;
+		} bins[BVH_BINS];
+
+		for (int b = 0 ; b < BVH_BINS ; b++) {
+			bins[b].count = 0;
+			for (int k = 0 ; k < 3 ; k++) {
+				bins[b].min[k] = 1e300;
+				bins[b].max[k] = -1e300;
+			}
+		}
+
+		double scale = BVH_BINS / extent;
+		const double base = centerMin[axis];
+
+		auto binOf = [=](const BuildItem &item) {
+			return std::min((int)((item.center[axis] - base) * scale), BVH_BINS - 1);
+		};
+
+		for (int i = 0 ; i < count ; i++) {
+			Bin &bin = bins[binOf(items[i])];
+			growBox(bin.min, bin.max, items[i].min, items[i].max);
+			bin.count++;
+		}
+
+		// area and triangle count of everything right of each split
+		double rightArea[BVH_BINS];
+		int rightCount[BVH_BINS];
+		double boxMin[3] = { 1e300, 1e300, 1e300 }, boxMax[3] = { -1e300, -1e300, -1e300 };
+		int sum = 0;
+
+		for (int b = BVH_BINS - 1 ; b > 0 ; b--) {
+			growBox(boxMin, boxMax, bins[b].min, bins[b].max);
+			sum += bins[b].count;
+			rightArea[b] = sum ? boxArea(boxMin, boxMax) : 0;
+			rightCount[b] = sum;
+		}
+
+		// split after bin 'best', both sides must have something
+		int best = -1;
+		double bestCost = 1e300;
+
+		for (int k = 0 ; k < 3 ; k++) {
+			boxMin[k] = 1e300;
+			boxMax[k] = -1e300;
+		}
+		sum = 0;
+
+		for (int b = 0 ; b < BVH_BINS - 1 ; b++)
+		{
+			growBox(boxMin, boxMax, bins[b].min, bins[b].max);
+			sum += bins[b].count;
+
+			if (!sum || !rightCount[b + 1])
+				continue;
+
+			double cost = boxArea(boxMin, boxMax) * sum + rightArea[b + 1] * rightCount[b + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				best = b;
+			}
+		}
+
+		// both in units of testing one triangle
+		double area = boxArea(node.min, node.max);
+		double splitCost = BVH_TRAVERSAL_COST + (area > 0 ? bestCost / area : 0);
+
+		if (best < 0 || (count <= BVH_MAX_LEAF && splitCost >= count))
+			return;
+
+		left = std::partition(items, items + count, [=](const BuildItem &item) { return binOf(item) <= best; }) - items;
+	}
+	else if (count <= BVH_MAX_LEAF)
+		return;
+
+	// all centers are the same otherwise, and the triangles are just split in halves
+	int children = _nodeCount.fetch_add(2);
+	node.first = children;
+	node.count = 0;
+
+	if (count > BVH_PARALLEL_BUILD)
+	{
+		TaskGroup group;
+		group.run([=] { buildNode(children, items, left, first, depth + 1); });
+		buildNode(children + 1, items + left, count - left, first + left, depth + 1);
+		group.wait();
+	}
+	else
+	{
+		buildNode(children, items, left, first, depth + 1);
+		buildNode(children + 1, items + left, count - left, first + left, depth + 1);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+size_t BVH::getMemoryUsage() const
+{
+	return _nodes.capacity() * sizeof(Node) + _triangles.capacity() * sizeof(PreparedTriangle);
+}
+
+Vector3 BVH::getMin() const
+{
+	if (isEmpty())
+		return Vector3(0, 0, 0);
+	return Vector3(_nodes[0].min[0], _nodes[0].min[1], _nodes[0].min[2]);
+}
+
+Vector3 BVH::getMax() const
+{
+	if (isEmpty())
+		return Vector3(0, 0, 0);
+	return Vector3(_nodes[0].max[0], _nodes[0].max[1], _nodes[0].max[2]);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool BVH::occluded(const Vector3 &origin, const Vector3 &direction) const
+{
+	bool result;
+	occluded(origin, &direction, 1, &result);
+	return result;
+}
+
+void BVH::occluded(const Vector3 &origin, const Vector3 directions[], int count, bool result[]) const
+{
+	assert(count <= MAX_PACKET);
+
+	double inverse[MAX_PACKET][3];
+	unsigned int active = 0;
+
+	for (int i = 0 ; i < count ; i++)
+	{
+		result[i] = false;
+		active |= 1 << i;
+
+		// no infinities, since those are not expected with fast math
+		for (int k = 0 ; k < 3 ; k++) {
+			double d = directions[i][k];
+			inverse[i][k] = fabs(d) > 1e-30 ? 1.0 / d : (d < 0 ? -1e30 : 1e30);
+		}
+	}
+
+	if (isEmpty() || !active)
+		return;
+
+	int stack[BVH_MAX_DEPTH * 2 + 2];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top)
+	{
+		const Node &node = _nodes[stack[--top]];
+
+		// rays that still didn't hit anything and pass through the box, between the origin and the end
+		unsigned int rays = 0;
+
+		for (int i = 0 ; i < count ; i++)
+		{
+			if (!(active & (1 << i)))
+				continue;
+
+			double t0 = 0, t1 = 1;
+
+			for (int k = 0 ; k < 3 ; k++) {
+				double a = (node.min[k] - origin[k]) * inverse[i][k];
+				double b = (node.max[k] - origin[k]) * inverse[i][k];
+				t0 = std::max(t0, std::min(a, b));
+				t1 = std::min(t1, std::max(a, b));
+			}
+
+			if (t0 <= t1)
+				rays |= 1 << i;
+		}
+
+		if (!rays)
+			continue;
+
+		if (!node.count) {
+			stack[top++] = node.first;
+			stack[top++] = node.first + 1;
+			continue;
+		}
+
+		for (int j = 0 ; j < node.count && rays ; j++)
+		{
+			const PreparedTriangle &t = _triangles[node.first + j];
+			Vector3 s = origin - t.v0;
+			Vector3 q = s.cross(t.e1);
+
+			for (int i = 0 ; i < count ; i++)
+			{
+				if (!(rays & (1 << i)))
+					continue;
+
+				// Moller-Trumbore
+				const Vector3 &d = directions[i];
+				Vector3 p = d.cross(t.e2);
+				double det = t.e1.dot(p);
+				if (det == 0)
+					continue;
+
+				double inv = 1.0 / det;
+				double u = s.dot(p) * inv;
+				if (u < 0 || u > 1)
+					continue;
+
+				double v = d.dot(q) * inv;
+				if (v < 0 || u + v > 1)
+					continue;
+
+				double distance = t.e2.dot(q) * inv;
+				if (distance <= 0 || distance >= 1)
+					continue;
+
+				rays &= ~(1 << i);
+				active &= ~(1 << i);
+				result[i] = true;
+			}
+		}
+
+		if (!active)
+			return;
+	}
+}
@@ -0,0 +1,107 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BVH_H
+#define BVH_H
+
+#include "common/Vector3.h"
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+/*
+ * Bounding volume hierarchy over triangles, for shadow rays (it only answers if anything is hit).
+ *
+ * Built top down: each node is split where the surface area heuristic is the lowest,
+ * among a few planes between bins of triangle centers. Subtrees of big nodes are built
+ * in parallel on the thread pool. Children of a node are next to each other in one array
+ * of nodes, and triangles of each leaf are next to each other as well.
+ */
+class BVH
+{
+public:
+	struct Triangle
+	{
+		Vector3 v0, v1, v2;
+	};
+
+	/* rays traced together at most */
+	static const int MAX_PACKET = 8;
+
+	BVH() : _nodeCount(0) {}
+
+	/* build over the given triangles, the vector is left empty */
+	void build(std::vector<Triangle> &triangles);
+	void clear();
+
+	bool isEmpty() const { return _nodeCount == 0; }
+	int getTriangleCount() const { return _triangles.size(); }
+	int getNodeCount() const { return _nodeCount; }
+	size_t getMemoryUsage() const;
+
+	/* box of all triangles */
+	Vector3 getMin() const;
+	Vector3 getMax() const;
+
+	/* true if anything is between origin and origin + direction */
+	bool occluded(const Vector3 &origin, const Vector3 &direction) const;
+
+	/*
+	 * Rays from one origin (a point toward several lights) traced together: each node is visited once
+	 * for all rays that still didn't hit anything and pass through its box
+	 */
+	void occluded(const Vector3 &origin, const Vector3 directions[], int count, bool result[]) const;
+
+private:
+	struct Node
+	{
+		double min[3];
+		double max[3];
+
+		/* first child of inner nodes, first triangle of leaves */
+		int first;
+
+		/* number of triangles, zero for inner nodes */
+		int count;
+	};
+
+	/* triangle as the intersection test wants it */
+	struct PreparedTriangle
+	{
+		Vector3 v0;
+		Vector3 e1;
+		Vector3 e2;
+	};
+
+	/* bounds and center of a triangle, while building */
+	struct BuildItem
+	{
+		double min[3];
+		double max[3];
+		double center[3];
+		int triangle;
+	};
+
+	void buildNode(int node, BuildItem *items, int count, int first, int depth);
+
+	std::vector<Node> _nodes;
+	std::vector<PreparedTriangle> _triangles;
+	std::atomic<int> _nodeCount;
+};
+
+#endif
@@ -0,0 +1,422 @@
+/*
+    This file is part of CG4.
+
+    Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Depth only pipeline, used to render shadow maps.
+ *
+ * Same clipping and rasterization rules as renderPolygons, but vertices are just
+ * positions transformed by a matrix, and only Z is interpolated, from the plane
+ * equation of the triangle. Spans are written with SIMD min, which is the same as
+ * the Z test followed by a write.
+ */
+
+#include "Renderer.h"
+#include "Texture.h"
+
+#include "common/Mat4.h"
+#include "common/Vector4.h"
+#include "common/Vector3.h"
+
+#include <assert.h>
+#include <algorithm>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Renderer::renderDepthPolygons( unsigned int* geometry, int count, const Mat4 &objectToClip )
+{
+	assert(_zBuffer);
+
+	/* there is nothing to compute per vertex but the position, so transform all of them at once */
+	_depthVertices.resize(_vertexCount);
+
+	for (int i = 0 ; i < _vertexCount ; i++)
+		transformDepthVertex(i, objectToClip);
+
+	for (unsigned int *polygon = geometry ; count > 0 ; count--, polygon += *polygon + 1)
+	{
+		if (_abort && _abort->load(std::memory_order_relaxed))
+			return;
+
+		drawDepthPolygon(polygon);
+	}
+}
+
+void Renderer::renderDepthPolygons( unsigned int* geometry, const unsigned int *polygons, int count, const Mat4 &objectToClip )
+{
+	assert(_zBuffer);
+
+	/* vertices are transformed when first used, the pass number tells which ones already are */
+	_depthVertices.resize(_vertexCount);
+	_depthVertexPasses.resize(_vertexCount, 0);
+
+	if (++_depthPass == 0) {
+		std::fill(_depthVertexPasses.begin(), _depthVertexPasses.end(), 0);
+		_depthPass = 1;
+	}
+
+	for (int p = 0 ; p < count ; p++)
+	{
+		if (_abort && _abort->load(std::memory_order_relaxed))
+			return;
+
+		unsigned int *polygon = geometry + polygons[p];
+
+		for (unsigned int i = 1 ; i <= polygon[0] ; i++)
+			if (_depthVertexPasses[polygon[i]] != _depthPass) {
+				_depthVertexPasses[polygon[i]] = _depthPass;
+				transformDepthVertex(polygon[i], objectToClip);
+			}
+
+		drawDepthPolygon(polygon);
+	}
+}
+
+void Renderer::transformDepthVertex( int i, const Mat4 &objectToClip )
+{
+	const Vector3 &position = *(const Vector3*)((char*)_vertexBuffer + _vertexBufferStride * i);
+	DepthVertex &v = _depthVertices[i];
+
+	v.pos = vmul4point(position, objectToClip);
+	if (v.pos.w() > 0)
+		v.sp = NDC_to_DeviceSpace(&v.pos);
+}
+
+/* polygon is its vertex count followed by indexes of the vertices, which are already transformed */
+void Renderer::drawDepthPolygon( const unsigned int *polygon )
+{
+	DepthVertex* vt[128];
+	DepthVertex* vt2[128];
+	DepthVertex tempVertices[128];
+
+	int vtCount = polygon[0];
+	int clipx = 0,clipy = 0;
+	bool clip = false;
+
+	/* test trivial clipping */
+	for (int i = 0 ; i < vtCount ; i++)
+	{
+		vt[i] = &_depthVertices[polygon[i+1]];
+		const Vector4 &pos = vt[i]->pos;
+
+		if (std::abs(pos.x()) > pos.w() * clip_x) {
+			clipx += pos.x() > 0 ? 1 : -1;
+			clip  = true;
+		}
+
+		if (std::abs(pos.y()) > pos.w() * clip_y) {
+			clipy  += pos.y() > 0 ? 1 : -1;
+			clip = true;
+		}
+	}
+
+	vt[vtCount] = vt[0];
+
+	/* clipping */
+	if (clip)
+	{
+		/* trivial reject - all vertices are out on same side */
+		if (abs(clipx) == vtCount || abs(clipy) == vtCount)
+			return;
+
+		DepthVertex *temp = tempVertices;
+		vtCount = clipDepthAgainstPlane(vt,  vtCount, vt2, temp, Vector4(-1, 0, 0,clip_x));
+		vtCount = clipDepthAgainstPlane(vt2, vtCount, vt,  temp, Vector4( 0, 1, 0,clip_y));
+		vtCount = clipDepthAgainstPlane(vt,  vtCount, vt2, temp, Vector4( 1, 0, 0,clip_x));
+		vtCount = clipDepthAgainstPlane(vt2, vtCount, vt,  temp, Vector4( 0,-1, 0,clip_y));
+
+		if (!vtCount) return;
+	}
+
+	/* face culling */
+	if (_backFaceCulling || _frontFaceCulling)
+	{
+		double z = 0;
+		for (int i = 0 ; i < vtCount ; i++)
+			z += (vt[i]->sp.x() - vt[i+1]->sp.x()) * (vt[i]->sp.y()+vt[i+1]->sp.y());
+
+		bool frontface = z < 0;
+		if ((!frontface && _backFaceCulling) || (frontface && _frontFaceCulling))
+			return;
+	}
+
+	for (int i = 1 ; i < vtCount - 1 ; i++)
+		drawDepthTriangle(vt[0], vt[i], vt[i+1]);
+}
+
+int Renderer::clipDepthAgainstPlane(DepthVertex* input[], int in_count, DepthVertex* output[], DepthVertex *&temp, const Vector4 &plane)
+{
+	int out_count = 0;
+
+	for (int i = 0 ; i < in_count ; i++)
+	{
+		DepthVertex* p1 = input[i], *p2 = input[i+1];
+
+		double dot1 =  p1->pos.dot(plane);
+		double dot2 =  p2->pos.dot(plane);
+
+		bool in1 = dot1 > 0.0;
+		bool in2 = dot2 > 0.0;
+
+		if (in1) output[out_count++] = p1;
+
+		if (in1 != in2)
+		{
+			DepthVertex* newVertex = temp++;
+
+			if (in1 == false) {
+				swap(p1,p2);
+				swap(dot1,dot2);
+			}
+
+			double t = dot1 / (dot1 - dot2);
+
+			newVertex->pos = p1->pos + (p2->pos - p1->pos) * t;
+			newVertex->sp = NDC_to_DeviceSpace(&newVertex->pos);
+			output[out_count++] = newVertex;
+		}
+	}
+
+	if (out_count)
+		output[out_count] = output[0];
+
+	return out_count;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* depth test and write of pixels [x, end] of a row, z is depth of first pixel */
+static inline void drawDepthSpan(double *row, int x, int end, double z, double dzx)
+{
+	/*
+	 * min(z, old) is the Z test and the write at once, and keeps the old value when z is NaN
+	 * (degenerate triangles). Most spans of a detailed mesh are short, so vectors are set up only for long ones
+	 */
+#if defined(__AVX__)
+	if (end - x >= 7)
+	{
+		__m256d z4 = _mm256_add_pd(_mm256_set1_pd(z), _mm256_mul_pd(_mm256_set1_pd(dzx), _mm256_set_pd(3, 2, 1, 0)));
+		const __m256d step4 = _mm256_set1_pd(dzx * 4);
+
+		for ( ; x + 3 <= end ; x += 4) {
+			_mm256_storeu_pd(row + x, _mm256_min_pd(z4, _mm256_loadu_pd(row + x)));
+			z4 = _mm256_add_pd(z4, step4);
+		}
+		z = _mm256_cvtsd_f64(z4);
+	}
+#elif defined(__SSE2__)
+	if (end - x >= 3)
+	{
+		__m128d z2 = _mm_set_pd(z + dzx, z);
+		const __m128d step2 = _mm_set1_pd(dzx * 2);
+
+		for ( ; x + 1 <= end ; x += 2) {
+			_mm_storeu_pd(row + x, _mm_min_pd(z2, _mm_loadu_pd(row + x)));
+			z2 = _mm_add_pd(z2, step2);
+		}
+		z = _mm_cvtsd_f64(z2);
+	}
+#endif
+
+	for ( ; x <= end ; x++, z += dzx)
+		row[x] = (z < row[x]) ? z : row[x];
+}
+
+#if defined(__AVX__)
+
+/*
+ * Small triangles cover just a few pixels per row, so instead of walking the edges row by row,
+ * all pixels of the bounding box are tested against the edge functions, 4 at a time.
+ * Pixel centers are at integer coordinates, and pixels on the edges are drawn, as in drawTriangle.
+ */
+static void drawSmallDepthTriangle(double *buffer, int stride, int height,
+		const Vector4 &v1, const Vector4 &v2, const Vector4 &v3,
+		double z0, double dzx, double dzy, double area)
+{
+	int minX = ceil(min(v1.x(), min(v2.x(), v3.x()))), maxX = floor(max(v1.x(), max(v2.x(), v3.x())));
+	int minY = ceil(min(v1.y(), min(v2.y(), v3.y()))), maxY = floor(max(v1.y(), max(v2.y(), v3.y())));
+
+	minX = max(minX, 0); maxX = min(maxX, stride - 1);
+	minY = max(minY, 0); maxY = min(maxY, height - 1);
+
+	/* edge functions a*x + b*y + c, positive inside the triangle (area is positive for clockwise ones) */
+	const Vector4 *p[4] = { &v1, &v2, &v3, &v1 };
+	double sign = area > 0 ? -1 : 1;
+	__m256d ex[3], ey[3], row[3];
+
+	const __m256d lanes = _mm256_set_pd(3, 2, 1, 0);
+	const __m256d x0 = _mm256_add_pd(_mm256_set1_pd(minX), lanes);
+
+	for (int e = 0 ; e < 3 ; e++)
+	{
+		double a = (p[e]->y() - p[e+1]->y()) * sign;
+		double b = (p[e+1]->x() - p[e]->x()) * sign;
+		double c = (p[e]->x() * p[e+1]->y() - p[e]->y() * p[e+1]->x()) * sign;
+
+		ex[e] = _mm256_set1_pd(a * 4);
+		ey[e] = _mm256_set1_pd(b);
+		row[e] = _mm256_add_pd(_mm256_mul_pd(x0, _mm256_set1_pd(a)), _mm256_set1_pd(b * minY + c));
+	}
+
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d lastX = _mm256_set1_pd(maxX);
+	const __m256d zx4 = _mm256_set1_pd(dzx * 4), zy = _mm256_set1_pd(dzy);
+	__m256d zrow = _mm256_add_pd(_mm256_set1_pd(z0 + dzy * minY), _mm256_mul_pd(x0, _mm256_set1_pd(dzx)));
+
+	for (int y = minY ; y <= maxY ; y++)
+	{
+		__m256d e0 = row[0], e1 = row[1], e2 = row[2], z = zrow, x = x0;
+		double *pixels = buffer + y * stride;
+
+		for (int px = minX ; px <= maxX ; px += 4)
+		{
+			__m256d inside = _mm256_and_pd(
+					_mm256_and_pd(_mm256_cmp_pd(e0, zero, _CMP_GE_OQ), _mm256_cmp_pd(e1, zero, _CMP_GE_OQ)),
+					_mm256_and_pd(_mm256_cmp_pd(e2, zero, _CMP_GE_OQ), _mm256_cmp_pd(x, lastX, _CMP_LE_OQ)));
+
+			/* masked load/store don't touch pixels outside of the triangle, even past end of the buffer */
+			__m256i mask = _mm256_castpd_si256(inside);
+			__m256d old = _mm256_maskload_pd(pixels + px, mask);
+			_mm256_maskstore_pd(pixels + px, mask, _mm256_min_pd(z, old));
+
+			e0 = _mm256_add_pd(e0, ex[0]); e1 = _mm256_add_pd(e1, ex[1]); e2 = _mm256_add_pd(e2, ex[2]);
+			z = _mm256_add_pd(z, zx4);
+			x = _mm256_add_pd(x, _mm256_set1_pd(4));
+		}
+
+		row[0] = _mm256_add_pd(row[0], ey[0]); row[1] = _mm256_add_pd(row[1], ey[1]); row[2] = _mm256_add_pd(row[2], ey[2]);
+		zrow = _mm256_add_pd(zrow, zy);
+	}
+}
+
+#endif
+
+/* horizontal edges (and points, at the poles of a sphere) are only used on their own row, where any slope does */
+static inline double slope(const DepthVertex* p1, const DepthVertex* p2)
+{
+	double dy = p2->sp.y() - p1->sp.y();
+	return dy != 0 ? (p2->sp.x() - p1->sp.x()) / dy : 0;
+}
+
+void Renderer::drawDepthTriangle(const DepthVertex* p1, const DepthVertex* p2, const DepthVertex* p3)
+{
+	double x1, x2, dxdy1 ,dxdy2;
+	bool swap_x;
+
+	// sort the points from bottom to top by Y
+	if (p2->sp.y() > p3->sp.y()) std::swap(p3, p2);
+	if (p1->sp.y() > p2->sp.y()) std::swap(p2, p1);
+	if (p2->sp.y() > p3->sp.y()) std::swap(p3, p2);
+
+	int y_start = ceil(p1->sp.y()), y_middle = ceil(p2->sp.y()), y_end = floor(p3->sp.y());
+
+	/*
+	 * clipping keeps the triangle in the viewport, but vertices that are almost at w = 0
+	 * (point lights inside of the scene) can still end up far outside, or not finite at all
+	 */
+	y_start = max(y_start, 0);
+	y_end = min(y_end, _zBuffer->getHeight() - 1);
+
+	if (y_start > y_end)
+		return;
+
+	/* depth plane of the triangle */
+	double dx1 = (p1->sp.x() - p2->sp.x()); double dx2 = (p3->sp.x() - p1->sp.x());
+	double dy1 = (p1->sp.y() - p2->sp.y()); double dy2 = (p3->sp.y() - p1->sp.y());
+	double area = dx1 * dy2 - dy1 * dx2;
+	double ooa  = 1.0 / area;
+
+	double dz1 = (p1->sp.z() - p2->sp.z()), dz2 = (p3->sp.z() - p1->sp.z());
+	double dzx = (dz1 * dy2 - dz2 * dy1) * ooa;
+	double dzy = (dz2 * dx1 - dz1 * dx2) * ooa;
+
+	/* slope scaled bias, so that surfaces at steep angle to the light don't shadow themselves */
+	double z0 = p1->sp.z() + _depthBiasConstant;
+	if (_depthBiasSlope)
+		z0 += _depthBiasSlope * max(std::abs(dzx), std::abs(dzy));
+
+	double *buffer = _zBuffer->getPointer();
+	const int stride = _zBuffer->getWidth();
+
+#if defined(__AVX__)
+	if (y_end - y_start < 16)
+	{
+		double width = max(p1->sp.x(), max(p2->sp.x(), p3->sp.x())) - min(p1->sp.x(), min(p2->sp.x(), p3->sp.x()));
+
+		if (width < 16) {
+			if (area != 0)
+				drawSmallDepthTriangle(buffer, stride, _zBuffer->getHeight(), p1->sp, p2->sp, p3->sp,
+						z0 - dzx * p1->sp.x() - dzy * p1->sp.y(), dzx, dzy, area);
+			return;
+		}
+	}
+#endif
+
+	/* setup slopes and start/end locations, same as drawTriangle */
+	if (y_start < y_middle) {
+		dxdy1 = slope(p1,p3); dxdy2 = slope(p1,p2);
+		double y_fraction = (double)y_start - p1->sp.y();
+		x1 = p1->sp.x() + dxdy1 * y_fraction;
+		x2 = p1->sp.x() + dxdy2 * y_fraction;
+		swap_x = dxdy1 > dxdy2;
+
+	} else {
+		dxdy1 = slope(p1,p3); dxdy2 = slope(p2,p3);
+		x1 = p1->sp.x() + dxdy1 * ((double)y_start - p1->sp.y());
+		x2 = p2->sp.x() + dxdy2 * ((double)y_start - p2->sp.y());
+		swap_x = dxdy1 < dxdy2;
+	}
+
+	if (swap_x) {
+		std::swap(dxdy1,dxdy2);
+		std::swap(x1,x2);
+	}
+
+	for (int y = y_start ; ; )
+	{
+		int x_start = max((int)ceil(x1), 0), x_end = min((int)floor(x2), stride - 1);
+		double z = z0 + dzx * ((double)x_start - p1->sp.x()) + dzy * ((double)y - p1->sp.y());
+
+		drawDepthSpan(buffer + y * stride, x_start, x_end, z, dzx);
+
+		if (y == y_end) break;
+
+		/* advance one scan-line, and switch to bottom trapezoid in the middle */
+		if (++y == y_middle)
+		{
+			double dxdy = slope(p2,p3);
+			double x = p2->sp.x() + dxdy * (((double)y_middle) - p2->sp.y());
+
+			if (swap_x) {
+				x1 = x; dxdy1 = dxdy;
+				x2 += dxdy2;
+			} else {
+				x1 += dxdy1;
+				x2 = x; dxdy2 = dxdy;
+			}
+		} else {
+			x1 += dxdy1; x2 += dxdy2;
+		}
+	}
+}
@@ -46,7 +46,10 @@ void Renderer::drawLine( TVertex *p1, TVertex *p2, const Color &c )
 	int d = dx - dy;
 
 	while (1) {
-		if (!_zBuffer || _zBuffer->zTest(x1,y1, z1))
+		// shifted images reach up to a pixel past the viewport
+		bool inside = x1 >= 0 && y1 >= 0 && x1 < _viewportSizeX && y1 < _viewportSizeY;
+
+		if (inside && (!_zBuffer || _zBuffer->zTest(x1,y1, z1)))
 			drawPixel(x1, y1, c);
 
 		if (x1 == x2 && y1 == y2) break;
@@ -141,9 +144,12 @@ void PixelState::stepYX(const TriangleSetup &s, const int x_steps)
 
 void PixelState::setupPSInputs(const TriangleSetup &s, PS_INPUTS &ps)
 {
+	double w = 1.0 / inv_w;
+	ps.w = w;
+
 	for (int i = s.first_attr ; i < s.first_no_persp ; i++)
-		ps.attributes[i] = attrbs[i] / inv_w;
-	for (int i = s.first_no_persp ; i < s.first_no_persp ; i++)
+		ps.attributes[i] = attrbs[i] * w;
+	for (int i = s.first_no_persp ; i < s.last_attr ; i++)
 		ps.attributes[i] = attrbs[i];
 }
 
@@ -200,22 +206,53 @@ void Renderer::drawTriangle(const TVertex* p1, const TVertex* p2, const TVertex*
 
 	while (1)
 	{
-		/* rasterize one scan line now */
+		/*
+		 * rasterize one scan line now, clamped to the viewport: clipping leaves
+		 * up to a pixel around it when the image is shifted (setSubpixelOffset)
+		 */
 		PixelState pixel(firstColumnPixel);
-		for (_psInputs.x = x_start ; _psInputs.x <= x_end ; _psInputs.x++, pixel.stepX(_setup))
+		int x_first = max(x_start, 0), x_last = min(x_end, _viewportSizeX - 1);
+
+		if (_psInputs.y < 0 || _psInputs.y >= _viewportSizeY)
+			x_last = x_first - 1;
+
+		if (x_first > x_start && x_first <= x_last)
+			pixel.start(_setup, p1, x_first, _psInputs.y);
+
+		int spanCount = 0;
+
+		for (_psInputs.x = x_first ; _psInputs.x <= x_last ; _psInputs.x++, pixel.stepX(_setup))
 		{
 			/* do the (early Z test)*/
 			if (_zBuffer && !_zBuffer->zTest(_psInputs.x,_psInputs.y, pixel.z))
 				continue;
 
 			/* run pixel shader if we have output buffer */
-			if (_outputTexture) {
+			if (_outputTexture && _spanShader) {
+				/* or keep the pixel for the span shader */
+				PS_INPUTS &in = _spanInputs[spanCount++];
+				in.x = _psInputs.x;
+				in.y = _psInputs.y;
+				in.d = pixel.z;
+				in.frontface = _psInputs.frontface;
+				for (int i = 0 ; i < _setup.first_attr ; i++)
+					in.attributes[i] = _psInputs.attributes[i];
+				pixel.setupPSInputs(_setup, in);
+
+				if (spanCount == SPAN_PIXELS) {
+					drawSpan(spanCount);
+					spanCount = 0;
+				}
+			} else if (_outputTexture) {
 				_psInputs.d = pixel.z;
 				pixel.setupPSInputs(_setup, _psInputs);
 				drawPixel(_psInputs.x, _psInputs.y, _pixelShader(_psPriv, _psInputs));
 			}
 		}
 
+		if (spanCount)
+			drawSpan(spanCount);
+
 		/* end condition */
 		if (_psInputs.y == y_end) break;
 
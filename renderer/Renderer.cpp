@@ -23,6 +23,7 @@
 #include "common/Mat4.h"
 #include "common/Vector4.h"
 #include "common/Vector3.h"
+#include "common/ThreadPool.h"
 
 #include <assert.h>
 
@@ -30,16 +31,20 @@
 Renderer::Renderer(void) : 
 
 	// output buffer
-	_viewportSizeX(0), _viewportSizeY(0), _aspectRatio(1.0),
+	_viewportSizeX(0), _viewportSizeY(0), _aspectRatio(1.0), _subpixelX(0), _subpixelY(0),
 	_outputTexture(NULL), _zBuffer(NULL),
 
 	// shaders
-	_vertexShader(NULL), _pixelShader(NULL),
+	_vertexShader(NULL), _pixelShader(NULL), _spanShader(NULL),
 	// settings
 	_backFaceCulling(false), _frontFaceCulling(false),
-	_wireframeColor(0,0,0)
+	_wireframeColor(0,0,0), _abort(NULL),
+	_vertexBuffer(NULL), _vertexBufferStride(0), _vertexCount(0),
+	_depthPass(0), _depthBiasSlope(0), _depthBiasConstant(0)
 {
 	_psInputs._renderer = this;
+	for (int i = 0 ; i < SPAN_PIXELS ; i++)
+		_spanInputs[i]._renderer = this;
 	setVertexAttributes(0,0,0);
 }
 
@@ -59,6 +64,14 @@ void Renderer::setAspectRatio( double ratio )
 	updateViewportDimisions();
 }
 
+// shift the whole image by a fraction of pixel, used for antialiasing
+void Renderer::setSubpixelOffset( double x, double y )
+{
+	_subpixelX = clamp(x, -0.5, 0.5);
+	_subpixelY = clamp(y, -0.5, 0.5);
+	updateViewportDimisions();
+}
+
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 // user calls this to set output buffers
@@ -80,6 +93,7 @@ void Renderer::setZBuffer(DepthTexture *z)
 void Renderer::setVertexAttributes( 
 	unsigned char flatCount, unsigned char smoothCount, unsigned char noPerspectiveCount )
 {
+	assert(flatCount + smoothCount + noPerspectiveCount <= MAX_ATTRIBUTES);
 	_vFlatACount = flatCount;
 	_vSmoothACount = smoothCount;
 	_vNoPersACount = noPerspectiveCount;
@@ -91,6 +105,7 @@ void Renderer::uploadVertices(void* vertices, int vertexSize, int count)
 {
 	_vertexBuffer = vertices;
 	_vertexBufferStride = vertexSize;
+	_vertexCount = count;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -111,9 +126,78 @@ void Renderer::renderBackground( const Texture &texture, double scaleX, double s
 	s.bindTexture(&texture);
 	s.setScale(scaleX,scaleY);
 
-	for (int y=0; y<_viewportSizeY ; y++)
-		for (int x=0; x<_viewportSizeX ; x++)
-			drawPixel(x, y, s.sampleBiLinear((double)x/_viewportSizeX, (double)y/_viewportSizeY));
+	// rows are independent, and each is sampled a few pixels at a time
+	parallelFor(0, _viewportSizeY, 16, [&] (int fromY, int toY)
+	{
+		const int span = 8;
+		double u[span], v[span];
+		Color colors[span];
+
+		for (int y = fromY ; y < toY ; y++)
+			for (int x = 0 ; x < _viewportSizeX ; x += span)
+			{
+				int count = min(span, _viewportSizeX - x);
+
+				for (int i = 0 ; i < count ; i++) {
+					u[i] = (double)(x + i) / _viewportSizeX;
+					v[i] = (double)y / _viewportSizeY;
+				}
+
+				s.sampleBiLinear(u, v, count, colors);
+
+				for (int i = 0 ; i < count ; i++)
+					drawPixel(x + i, y, colors[i]);
+			}
+	});
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static inline unsigned char blendChannel(int c00, int c10, int c01, int c11, int wx, int wy)
+{
+	int top = c00 * (256 - wx) + c10 * wx;
+	int bottom = c01 * (256 - wx) + c11 * wx;
+	return (unsigned char)((top * (256 - wy) + bottom * wy) >> 16);
+}
+
+void Renderer::renderUpscaled( const Texture &source, int width, int height )
+{
+	/* bilinear filter with pixel centers aligned, positions are in 16.16 fixed point */
+	const int stepX = (width << 16) / _viewportSizeX;
+	const int stepY = (height << 16) / _viewportSizeY;
+
+	const int sizeX = _viewportSizeX;
+	Texture *output = _outputTexture;
+
+	// rows are independent, so they are split between threads
+	parallelFor(0, _viewportSizeY, 16, [&] (int fromY, int toY)
+	{
+		for (int y = fromY ; y < toY ; y++)
+		{
+			int sy = max(0, y * stepY + stepY / 2 - (1 << 15));
+			int y0 = min(sy >> 16, height - 1);
+			int y1 = min(y0 + 1, height - 1);
+			int wy = (sy >> 8) & 0xFF;
+
+			for (int x = 0 ; x < sizeX ; x++)
+			{
+				int sx = max(0, x * stepX + stepX / 2 - (1 << 15));
+				int x0 = min(sx >> 16, width - 1);
+				int x1 = min(x0 + 1, width - 1);
+				int wx = (sx >> 8) & 0xFF;
+
+				const DEVICE_PIXEL p00 = source.getPixelValue(x0, y0);
+				const DEVICE_PIXEL p10 = source.getPixelValue(x1, y0);
+				const DEVICE_PIXEL p01 = source.getPixelValue(x0, y1);
+				const DEVICE_PIXEL p11 = source.getPixelValue(x1, y1);
+
+				output->setPixelValue(x, y, DEVICE_PIXEL(
+					blendChannel(p00.Red, p10.Red, p01.Red, p11.Red, wx, wy),
+					blendChannel(p00.Green, p10.Green, p01.Green, p11.Green, wx, wy),
+					blendChannel(p00.Blue, p10.Blue, p01.Blue, p11.Blue, wx, wy)));
+			}
+		}
+	});
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -125,6 +209,9 @@ void Renderer::renderPolygons( unsigned int* geometry, int count, enum Renderer:
 
 	for (polygonIterator iter(geometry, count); iter.hasmore() ; iter.next())
 	{
+		if (_abort && _abort->load(std::memory_order_relaxed))
+			return;
+
 		cache.newPolygon();
 		int vtCount = iter.vertexCount();
 
@@ -272,6 +359,14 @@ void Renderer::drawPixel( int x, int y, const Color &value )
 		DEVICE_PIXEL((uint8_t)(value[0]*255+0.5), (uint8_t)(value[1]*255+0.5), (uint8_t)(value[2]*255+0.5)));
 }
 
+void Renderer::drawSpan( int count )
+{
+	_spanShader(_psPriv, _spanInputs, count, _spanColors);
+
+	for (int i = 0 ; i < count ; i++)
+		drawPixel(_spanInputs[i].x, _spanInputs[i].y, _spanColors[i]);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 
 Vector4 Renderer::NDC_to_DeviceSpace( const Vector4* input )
@@ -300,11 +395,15 @@ void Renderer::updateViewportDimisions()
 		scaleFactorX = scaleFactorY * _aspectRatio;
 	}
 
-	clip_x = ((double)_viewportSizeX-0.5) / (2 * scaleFactorX);
-	clip_y = ((double)_viewportSizeY-0.5) / (2 * scaleFactorY);
+	/*
+	 * clip to the pixels of the viewport (their centers are at 0 .. size - 1) wherever the image is shifted,
+	 * the clip region is centered on the image, so it reaches a bit past the other side, and rasterizers clamp to the viewport
+	 */
+	clip_x = ((double)_viewportSizeX + 1 + 2 * std::abs(_subpixelX)) / (2 * scaleFactorX);
+	clip_y = ((double)_viewportSizeY + 1 + 2 * std::abs(_subpixelY)) / (2 * scaleFactorY);
 
-	moveFactorX = _viewportSizeX / 2;
-	moveFactorY = _viewportSizeY / 2;
+	moveFactorX = _viewportSizeX / 2 + _subpixelX;
+	moveFactorY = _viewportSizeY / 2 + _subpixelY;
 
 	/* update the matrices we give users to do the transforms we do ourselves manually*/
 	mat_NDCtoDeviceTransform =
@@ -318,9 +417,24 @@ void Renderer::updateViewportDimisions()
 }
 
 
-void Renderer::queryLOD( int attributeIndex, double &x_step, double &y_step ) const
+/*
+ * Perspective correct attributes are interpolated as a/w together with 1/w, both linear in screen space,
+ * so the derivative of a = (a/w) / (1/w) is (d(a/w) - a * d(1/w)) * w
+ */
+void Renderer::queryLOD( int attributeIndex, Vector3 &x_step, Vector3 &y_step ) const
 {
-	/*TODO*/
+	const TriangleSetup &s = _setup;
+	const Vector3 &a = _psInputs.attributes[attributeIndex];
+
+	if (attributeIndex < s.first_attr) {
+		x_step = y_step = Vector3(0, 0, 0);
+	} else if (attributeIndex < s.first_no_persp) {
+		x_step = (s.dax[attributeIndex] - a * s.d_inv_wx) * _psInputs.w;
+		y_step = (s.day[attributeIndex] - a * s.d_inv_wy) * _psInputs.w;
+	} else {
+		x_step = s.dax[attributeIndex];
+		y_step = s.day[attributeIndex];
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
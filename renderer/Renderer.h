@@ -25,12 +25,15 @@
 #include "common/Vector3.h"
 #include "common/Math.h"
 #include "common/Iterators.h"
+#include <atomic>
+#include <vector>
 
 class Texture;
 class DepthTexture;
 class IntegerTexture;
 
-#define MAX_ATTRIBUTES 5
+/* position, normal and texture coordinates, and light space coordinates for each light with a shadow */
+#define MAX_ATTRIBUTES 12
 
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -49,6 +52,9 @@ struct PS_INPUTS {
 	/* Pixel depth*/
 	double d;
 
+	/* clip space w of the pixel (perspective correct attributes are divided by it) */
+	double w;
+
 	/* set if the polygon this pixel belongs is front face*/
 	bool frontface;
 
@@ -90,6 +96,16 @@ struct TVertex
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/* vertex of the depth only pipeline, there are no attributes */
+struct DepthVertex
+{
+	/* location of the vertex in clip and screen spaces */
+	Vector4 pos;
+	Vector4 sp;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
 class VertexCache
 {
 public:
@@ -202,6 +218,13 @@ public:
 	typedef void (*vertexShader) (void* priv, void *in, Vector4 &out_position, Vector3 out_attributes[]);
 	typedef Color (*pixelShader) (void* priv, const PS_INPUTS &in);
 
+	/*
+	 * optional shader of up to SPAN_PIXELS pixels of a scan line at once (that passed the Z test),
+	 * used instead of the pixel shader. It can't use queryLOD
+	 */
+	enum { SPAN_PIXELS = 8 };
+	typedef void (*spanShader) (void* priv, const PS_INPUTS in[], int count, Color out[]);
+
 	// set output buffers
 	void setOutputTexture(Texture *t);
 	void setZBuffer(DepthTexture *z);
@@ -209,12 +232,13 @@ public:
 	// set rendering window
 	void setViewport(int width, int height);
 	void setAspectRatio(double ratio);
+	void setSubpixelOffset(double x, double y);
 	Mat4 getDeviceToScreenMatrix() { return mat_DeviceToNDCTransform; }
 	Mat4 getNDCTODeviceMatrix() { return mat_NDCtoDeviceTransform; }
 
 	// shaders
 	void setVertexShader( vertexShader vs, void* priv ) { _vertexShader = vs; _vsPriv = priv;}
-	void setPixelShader( pixelShader ps, void* priv ) {_pixelShader = ps;_psPriv = priv;}
+	void setPixelShader( pixelShader ps, void* priv, spanShader ss = NULL ) {_pixelShader = ps;_psPriv = priv;_spanShader = ss;}
 
 	// shader attributes
 	void setVertexAttributes(unsigned char flatCount, 
@@ -225,15 +249,31 @@ public:
 	void setFrontFaceCulling(bool enable) { _frontFaceCulling = enable; }
 	void setWireframeColor(Color c) { _wireframeColor = c; }
 
+	// renderPolygons returns early when this flag is set
+	void setAbortFlag(const std::atomic<bool> *abort) { _abort = abort; }
+
 	// rendering
 	void renderBackgroundColor(Color background);
 	void renderBackground(const Texture &texture, double scaleX, double scaleY);
+	void renderUpscaled(const Texture &source, int width, int height);
 
 	void uploadVertices(void* vertices, int vertexSize, int count);
 	void renderPolygons(unsigned int* geometry, int count, enum RENDER_MODE mode);
 
-	// used for pixel shaders
-	void queryLOD(int attributeIndex, double &x_step, double &y_step) const;
+	/*
+	 * depth only rendering (for shadow maps) - writes only the Z buffer, doesn't use shaders.
+	 * Vertices are transformed by the given matrix, and each must start with its position (Vector3)
+	 */
+	void renderDepthPolygons(unsigned int* geometry, int count, const Mat4 &objectToClip);
+
+	/* same, but only for the polygons that start at given offsets of the geometry, and only their vertices are transformed */
+	void renderDepthPolygons(unsigned int* geometry, const unsigned int *polygons, int count, const Mat4 &objectToClip);
+
+	/* added to depth of each polygon rendered by renderDepthPolygons: slopeScale * max depth slope + constant */
+	void setDepthBias(double slopeScale, double constant) { _depthBiasSlope = slopeScale; _depthBiasConstant = constant; }
+
+	// used for pixel shaders - change of an attribute from the current pixel to the next one along x and y
+	void queryLOD(int attributeIndex, Vector3 &x_step, Vector3 &y_step) const;
 
 	Renderer();
 private:
@@ -241,6 +281,10 @@ private:
 	// rasterizers helpers
 	PS_INPUTS _psInputs;
 
+	// pixels of a scan line waiting for the span shader
+	PS_INPUTS _spanInputs[SPAN_PIXELS];
+	Color _spanColors[SPAN_PIXELS];
+
 	TriangleSetup _setup;
 
 	// output buffer
@@ -250,10 +294,13 @@ private:
 	int _viewportSizeX;
 	int _viewportSizeY;
 	double _aspectRatio;
+	double _subpixelX;
+	double _subpixelY;
 
 	// vertex and pixel shaders
 	vertexShader _vertexShader;
 	pixelShader _pixelShader;
+	spanShader _spanShader;
 	void* _vsPriv;
 	void* _psPriv;
 
@@ -266,6 +313,14 @@ private:
 	// vertex buffer
 	void* _vertexBuffer;
 	int _vertexBufferStride;
+	int _vertexCount;
+
+	// depth only pipeline
+	std::vector<DepthVertex> _depthVertices;
+	std::vector<unsigned int> _depthVertexPasses;
+	unsigned int _depthPass;
+	double _depthBiasSlope;
+	double _depthBiasConstant;
 
 	double clip_x;
 	double clip_y;
@@ -279,6 +334,7 @@ private:
 	bool _backFaceCulling;
 	bool _frontFaceCulling;
 	Color _wireframeColor;
+	const std::atomic<bool> *_abort;
 
 	// matrices for output transform
 	Mat4 mat_NDCtoDeviceTransform;
@@ -289,10 +345,16 @@ private:
 	void drawTriangle(const TVertex* p1, const TVertex* p2, const TVertex* p3);
 	void drawLine(TVertex *p1, TVertex *p2, const Color &c);
 	void drawPixel(int x, int y, const Color &value);
+	void drawSpan(int count);
 
 	void updateViewportDimisions();
 	Vector4 NDC_to_DeviceSpace(const Vector4* input);
 	int clipAgainstPlane(VertexCache &cache, TVertex* input[], int point_count, TVertex* output[], Vector4 plane);
+
+	void transformDepthVertex(int i, const Mat4 &objectToClip);
+	void drawDepthPolygon(const unsigned int *polygon);
+	void drawDepthTriangle(const DepthVertex* p1, const DepthVertex* p2, const DepthVertex* p3);
+	int clipDepthAgainstPlane(DepthVertex* input[], int point_count, DepthVertex* output[], DepthVertex *&temp, const Vector4 &plane);
 };
 
 
@@ -23,11 +23,16 @@
 #include "Renderer.h"
 #include "Texture.h"
 #include "Samplers.h"
+#include "ShadowAtlas.h"
 
 #include "common/Mat4.h"
 #include "common/Vector4.h"
 #include "common/Math.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 const static double poissonDisk[4][2] = 
 {
@@ -49,6 +54,27 @@ void TextureSampler::bindTexture( const Texture* texture )
 	_mipmapCount = texture->getMipmapCount();
 	_scaleX = texture->getWidth();
 	_scaleY = texture->getHeight();
+
+	assert(_mipmapCount <= MAX_MIPMAPS);
+
+	int width = texture->getWidth(), height = texture->getHeight();
+	_powerOfTwo = !(width & (width - 1)) && !(height & (height - 1));
+
+	updateLevels();
+}
+
+void TextureSampler::updateLevels()
+{
+	for (int i = 0 ; i < _mipmapCount ; i++)
+	{
+		Level &level = _levels[i];
+		level.scaleX = _scaleX / (1 << i);
+		level.scaleY = _scaleY / (1 << i);
+		level.width = _texture[i].getWidth();
+		level.height = _texture[i].getHeight();
+		level.invWidth = 1.0 / level.width;
+		level.invHeight = 1.0 / level.height;
+	}
 }
 
 void TextureSampler::unbindTexture()
@@ -62,6 +88,9 @@ void TextureSampler::setScale( double new_scalex, double new_scaley )
 {
 	_scaleX = new_scalex;
 	_scaleY = new_scaley;
+
+	if (_texture)
+		updateLevels();
 }
 
 Color TextureSampler::sample( double x, double y ) const
@@ -74,48 +103,363 @@ Color TextureSampler::sample( double x, double y ) const
 	return _texture->sample(tx,ty);
 }
 
-Color TextureSampler::sampleBiLinear( double x, double y, int mipNumber /*= 0*/ ) const
+/* coordinate modulo size, for non negative coordinates */
+static inline int wrapCoordinate(int t, int size, double inv, bool powerOfTwo)
+{
+	if (powerOfTwo)
+		return t & (size - 1);
+
+	// the quotient might be one less than the exact one
+	int result = t - (int)(t * inv) * size;
+	return result >= size ? result - size : result;
+}
+
+/*
+ * Weights of the bilinear blend are in 1/16384, and the result of the vertical blend keeps 7 bits
+ * below the texel values, so the whole blend is within half of one of the exact blend, and 16 bit
+ * operands (multiplied and added into 32 bits) still do
+ */
+#define BLEND_WEIGHT_BITS 14
+#define BLEND_ROW_BITS 7
+
+static inline int texelBits(const DEVICE_PIXEL &p)
+{
+	int bits;
+	memcpy(&bits, &p, sizeof(bits));
+	return bits;
+}
+
+/* blend of texels p00, p10, p01, p11 with weights of the second column and row */
+static inline DEVICE_PIXEL blendQuad(const DEVICE_PIXEL quad[4], int wx, int wy)
+{
+	const int one = 1 << BLEND_WEIGHT_BITS;
+	const int rowShift = BLEND_WEIGHT_BITS - BLEND_ROW_BITS, shift = BLEND_WEIGHT_BITS + BLEND_ROW_BITS;
+
+#if defined(__SSE2__)
+	// each channel of the top texel next to the same one of the bottom texel, for both columns
+	// texels are loaded one by one, as they were stored (one load of all of them couldn't be forwarded from those stores)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i top = _mm_unpacklo_epi32(_mm_cvtsi32_si128(texelBits(quad[0])), _mm_cvtsi32_si128(texelBits(quad[1])));
+	__m128i bottom = _mm_unpacklo_epi32(_mm_cvtsi32_si128(texelBits(quad[2])), _mm_cvtsi32_si128(texelBits(quad[3])));
+	top = _mm_unpacklo_epi8(top, zero);
+	bottom = _mm_unpacklo_epi8(bottom, zero);
+
+	const __m128i weightsY = _mm_set1_epi32((wy << 16) | (one - wy));
+	__m128i left = _mm_srli_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(top, bottom), weightsY), rowShift);
+	__m128i right = _mm_srli_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(top, bottom), weightsY), rowShift);
+
+	// same again for the columns
+	__m128i rows = _mm_packs_epi32(left, right);
+	rows = _mm_unpacklo_epi16(rows, _mm_unpackhi_epi64(rows, rows));
+
+	const __m128i weightsX = _mm_set1_epi32((wx << 16) | (one - wx));
+	__m128i result = _mm_madd_epi16(rows, weightsX);
+	result = _mm_srli_epi32(_mm_add_epi32(result, _mm_set1_epi32(1 << (shift - 1))), shift);
+
+	// blue, green and red from the lowest byte
+	result = _mm_packs_epi32(result, result);
+	int packed = _mm_cvtsi128_si32(_mm_packus_epi16(result, result));
+	return DEVICE_PIXEL((packed >> 16) & 0xFF, (packed >> 8) & 0xFF, packed & 0xFF);
+#else
+	int channels[3];
+	const unsigned char *p[4] = { &quad[0].Blue, &quad[1].Blue, &quad[2].Blue, &quad[3].Blue };
+
+	for (int c = 0 ; c < 3 ; c++) {
+		int left = (p[0][c] * (one - wy) + p[2][c] * wy) >> rowShift;
+		int right = (p[1][c] * (one - wy) + p[3][c] * wy) >> rowShift;
+		channels[c] = (left * (one - wx) + right * wx + (1 << (shift - 1))) >> shift;
+	}
+
+	return DEVICE_PIXEL(channels[2], channels[1], channels[0]);
+#endif
+}
+
+DEVICE_PIXEL TextureSampler::blendBiLinear( double x, double y, int mipNumber ) const
 {
-	const Texture &t = _texture[mipNumber];
+	const Level &level = _levels[mipNumber];
 
 	// scale the the input coordinates by current scale.
-	x = std::abs(x) * _scaleX / (1 << mipNumber);
-	y = std::abs(1-y) * _scaleY / (1 << mipNumber);
+	x = std::abs(x) * level.scaleX;
+	y = std::abs(1-y) * level.scaleY;
 
-	// find texel coordinates
-	int tx = (int)x % t.getWidth();
-	int ty = (int)y %  t.getHeight();
+	// find texel coordinates, and the weights of the next texels
+	int ix = (int)x, iy = (int)y;
+	int wx = (int)((x - ix) * (1 << BLEND_WEIGHT_BITS) + 0.5), wy = (int)((y - iy) * (1 << BLEND_WEIGHT_BITS) + 0.5);
 
-	// find weights of the four pixels
-	double wx = frac(x), wy = frac(y);
+	int tx = wrapCoordinate(ix, level.width, level.invWidth, _powerOfTwo);
+	int ty = wrapCoordinate(iy, level.height, level.invHeight, _powerOfTwo);
 
-	Color c1 = t.sample(tx, ty)   * (1.0 - wx) + t.sample(tx+1, ty) * wx;
-	Color c2 = t.sample(tx, ty+1) * (1.0 - wx) + t.sample(tx+1, ty+1) * wx;
-	return (c1 * (1.0-wy)) + (c2 * (wy));
+	DEVICE_PIXEL quad[4];
+	_texture[mipNumber].getQuad(tx, ty, quad);
+	return blendQuad(quad, wx, wy);
 }
 
-Color TextureSampler::sampleBiLinearMipmapped( double x, double y, double dx, double dy ) const
+static inline Color toColor(const DEVICE_PIXEL &p)
 {
-	dx *= _texture->getWidth();
-	dy *= _texture->getHeight();
+	const double scale = 1.0 / 255;
+	return Color(p.Red * scale, p.Green * scale, p.Blue * scale);
+}
+
+Color TextureSampler::sampleBiLinear( double x, double y, int mipNumber /*= 0*/ ) const
+{
+	return toColor(blendBiLinear(x, y, mipNumber));
+}
 
-	double lod = log2(dx*dx+dy*dy) / 2;
-	int level = clamp((int)lod, 0, _mipmapCount -1);
+#if defined(__SSE2__)
+
+/* texel coordinates (whole numbers) modulo size, same as wrapCoordinate */
+static inline __m128d wrapCoordinates(__m128d t, __m128d size, __m128d inv)
+{
+	__m128d result = _mm_sub_pd(t, _mm_mul_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(_mm_mul_pd(t, inv))), size));
+	return _mm_sub_pd(result, _mm_and_pd(_mm_cmpge_pd(result, size), size));
+}
+
+/* texels at the given offsets from each of 4 texels */
+static inline __m128i gatherTexels(const DEVICE_PIXEL *const p[4], const int offset[4])
+{
+	return _mm_setr_epi32(texelBits(p[0][offset[0]]), texelBits(p[1][offset[1]]),
+		texelBits(p[2][offset[2]]), texelBits(p[3][offset[3]]));
+}
+
+/*
+ * blendBiLinear for 4 points, one in each lane: the same coordinates, weights, wrapping and addressing
+ * (as getQuad does it), and the same blend as blendQuad - so the results are the same (but for the
+ * rounding of the weights)
+ */
+void TextureSampler::blendBiLinear4( const double x[4], const double y[4], int mipNumber, DEVICE_PIXEL result[4] ) const
+{
+	const Level &level = _levels[mipNumber];
+	const Texture &texture = _texture[mipNumber];
+
+	const __m128d sign = _mm_set1_pd(-0.0), one = _mm_set1_pd(1.0), half = _mm_set1_pd(0.5);
+	const __m128d scaleX = _mm_set1_pd(level.scaleX), scaleY = _mm_set1_pd(level.scaleY);
+	const __m128d weightScale = _mm_set1_pd(1 << BLEND_WEIGHT_BITS);
+	const __m128d width = _mm_set1_pd(level.width), height = _mm_set1_pd(level.height);
+	const __m128d invWidth = _mm_set1_pd(level.invWidth), invHeight = _mm_set1_pd(level.invHeight);
+
+	// texel coordinates and the weights of the next texels, of two lanes at a time
+	__m128i tx[2], ty[2], wx[2], wy[2];
+
+	for (int h = 0 ; h < 2 ; h++)
+	{
+		__m128d px = _mm_mul_pd(_mm_andnot_pd(sign, _mm_loadu_pd(x + h * 2)), scaleX);
+		__m128d py = _mm_mul_pd(_mm_andnot_pd(sign, _mm_sub_pd(one, _mm_loadu_pd(y + h * 2))), scaleY);
+
+		__m128d ix = _mm_cvtepi32_pd(_mm_cvttpd_epi32(px)), iy = _mm_cvtepi32_pd(_mm_cvttpd_epi32(py));
+		wx[h] = _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(_mm_sub_pd(px, ix), weightScale), half));
+		wy[h] = _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(_mm_sub_pd(py, iy), weightScale), half));
+
+		if (!_powerOfTwo) {
+			ix = wrapCoordinates(ix, width, invWidth);
+			iy = wrapCoordinates(iy, height, invHeight);
+		}
+
+		tx[h] = _mm_cvttpd_epi32(ix);
+		ty[h] = _mm_cvttpd_epi32(iy);
+	}
+
+	__m128i texelX = _mm_unpacklo_epi64(tx[0], tx[1]), texelY = _mm_unpacklo_epi64(ty[0], ty[1]);
+
+	if (_powerOfTwo) {
+		texelX = _mm_and_si128(texelX, _mm_set1_epi32(level.width - 1));
+		texelY = _mm_and_si128(texelY, _mm_set1_epi32(level.height - 1));
+	}
+
+	// index of each texel and distances to the next ones along x and y, as in getQuad
+	// (coordinates are below 2^15, so they are multiplied as 16 bit numbers)
+	__m128i index, dx, dy;
+
+	if (texture.getLayout() == TEXTURE_LAYOUT_LINEAR) {
+		index = _mm_add_epi32(_mm_madd_epi16(texelY, _mm_set1_epi32(level.width)), texelX);
+		dx = _mm_set1_epi32(1);
+		dy = _mm_set1_epi32(level.width);
+	} else {
+		const int tilesX = texture.getTilesPerRow();
+		const __m128i three = _mm_set1_epi32(3);
+
+		__m128i tile = _mm_add_epi32(_mm_madd_epi16(_mm_srli_epi32(texelY, 2), _mm_set1_epi32(tilesX)), _mm_srli_epi32(texelX, 2));
+		index = _mm_add_epi32(_mm_slli_epi32(tile, 4),
+			_mm_add_epi32(_mm_slli_epi32(_mm_and_si128(texelY, three), 2), _mm_and_si128(texelX, three)));
+
+		__m128i lastColumn = _mm_cmpeq_epi32(_mm_and_si128(texelX, three), three);
+		__m128i lastRow = _mm_cmpeq_epi32(_mm_and_si128(texelY, three), three);
+		dx = _mm_add_epi32(_mm_set1_epi32(1), _mm_and_si128(lastColumn, _mm_set1_epi32(16 - 3 - 1)));
+		dy = _mm_add_epi32(_mm_set1_epi32(4), _mm_and_si128(lastRow, _mm_set1_epi32(tilesX * 16 - 12 - 4)));
+	}
+
+	dx = _mm_andnot_si128(_mm_cmpeq_epi32(texelX, _mm_set1_epi32(level.width - 1)), dx);
+	dy = _mm_andnot_si128(_mm_cmpeq_epi32(texelY, _mm_set1_epi32(level.height - 1)), dy);
+
+	int indices[4], offsets[3][4];
+	_mm_storeu_si128((__m128i*)indices, index);
+	_mm_storeu_si128((__m128i*)offsets[0], dx);
+	_mm_storeu_si128((__m128i*)offsets[1], dy);
+	_mm_storeu_si128((__m128i*)offsets[2], _mm_add_epi32(dx, dy));
+
+	const DEVICE_PIXEL *texels = texture.getPointer();
+	const DEVICE_PIXEL *const p[4] = { texels + indices[0], texels + indices[1], texels + indices[2], texels + indices[3] };
+	const int none[4] = { 0, 0, 0, 0 };
+
+	// the texels of each corner, one lane each
+	const __m128i top[2] = { gatherTexels(p, none), gatherTexels(p, offsets[0]) };
+	const __m128i bottom[2] = { gatherTexels(p, offsets[1]), gatherTexels(p, offsets[2]) };
+
+	// weights of both rows (and columns) next to each other, for all the channels of each lane
+	const int oneWeight = 1 << BLEND_WEIGHT_BITS;
+	const int rowShift = BLEND_WEIGHT_BITS - BLEND_ROW_BITS, shift = BLEND_WEIGHT_BITS + BLEND_ROW_BITS;
+
+	const __m128i weightsY = _mm_or_si128(_mm_slli_epi32(_mm_unpacklo_epi64(wy[0], wy[1]), 16),
+		_mm_sub_epi32(_mm_set1_epi32(oneWeight), _mm_unpacklo_epi64(wy[0], wy[1])));
+	const __m128i weightsX = _mm_or_si128(_mm_slli_epi32(_mm_unpacklo_epi64(wx[0], wx[1]), 16),
+		_mm_sub_epi32(_mm_set1_epi32(oneWeight), _mm_unpacklo_epi64(wx[0], wx[1])));
+
+	const __m128i laneWeightsY[4] = { _mm_shuffle_epi32(weightsY, 0x00), _mm_shuffle_epi32(weightsY, 0x55),
+		_mm_shuffle_epi32(weightsY, 0xAA), _mm_shuffle_epi32(weightsY, 0xFF) };
+	const __m128i laneWeightsX[4] = { _mm_shuffle_epi32(weightsX, 0x00), _mm_shuffle_epi32(weightsX, 0x55),
+		_mm_shuffle_epi32(weightsX, 0xAA), _mm_shuffle_epi32(weightsX, 0xFF) };
+
+	// each channel of the top texel next to the same one of the bottom texel, blended along y, for both columns
+	const __m128i zero = _mm_setzero_si128();
+	__m128i columns[2][4];
+
+	for (int c = 0 ; c < 2 ; c++)
+	{
+		__m128i t = _mm_unpacklo_epi8(top[c], zero), b = _mm_unpacklo_epi8(bottom[c], zero);
+		columns[c][0] = _mm_srli_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(t, b), laneWeightsY[0]), rowShift);
+		columns[c][1] = _mm_srli_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(t, b), laneWeightsY[1]), rowShift);
+
+		t = _mm_unpackhi_epi8(top[c], zero);
+		b = _mm_unpackhi_epi8(bottom[c], zero);
+		columns[c][2] = _mm_srli_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(t, b), laneWeightsY[2]), rowShift);
+		columns[c][3] = _mm_srli_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(t, b), laneWeightsY[3]), rowShift);
+	}
+
+	// same again for the columns, two lanes at a time
+	const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+	__m128i blended[4];
+
+	for (int l = 0 ; l < 4 ; l += 2)
+	{
+		__m128i left = _mm_packs_epi32(columns[0][l], columns[0][l + 1]);
+		__m128i right = _mm_packs_epi32(columns[1][l], columns[1][l + 1]);
+
+		blended[l] = _mm_madd_epi16(_mm_unpacklo_epi16(left, right), laneWeightsX[l]);
+		blended[l + 1] = _mm_madd_epi16(_mm_unpackhi_epi16(left, right), laneWeightsX[l + 1]);
+		blended[l] = _mm_srli_epi32(_mm_add_epi32(blended[l], round), shift);
+		blended[l + 1] = _mm_srli_epi32(_mm_add_epi32(blended[l + 1], round), shift);
+	}
+
+	// channels are in the order of the texels
+	__m128i packed = _mm_packus_epi16(_mm_packs_epi32(blended[0], blended[1]), _mm_packs_epi32(blended[2], blended[3]));
+	_mm_storeu_si128((__m128i*)result, packed);
+}
+
+#endif
+
+void TextureSampler::sampleBiLinear( const double x[], const double y[], int count, Color result[], int mipNumber ) const
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	const Texture &texture = _texture[mipNumber];
+
+	// compressed tiles are decoded through the cache, one texel at a time
+	if (texture.getLayout() != TEXTURE_LAYOUT_COMPRESSED && texture.getWidth() < 0x8000 && texture.getHeight() < 0x8000)
+	{
+		DEVICE_PIXEL pixels[4];
+
+		for ( ; i + 4 <= count ; i += 4) {
+			blendBiLinear4(x + i, y + i, mipNumber, pixels);
+			for (int j = 0 ; j < 4 ; j++)
+				result[i + j] = toColor(pixels[j]);
+		}
+	}
+#endif
+
+	for ( ; i < count ; i++)
+		result[i] = toColor(blendBiLinear(x[i], y[i], mipNumber));
+}
+
+/* squared length of a step in the texture coordinates, in texels of the first mipmap */
+double TextureSampler::footprint( const Vector3 &step ) const
+{
+	double x = step[0] * _scaleX, y = step[1] * _scaleY;
+	return x * x + y * y;
+}
+
+/* trilinear sample at fractional mipmap level */
+Color TextureSampler::sampleLOD( double x, double y, double lod ) const
+{
+	lod = clamp(lod, 0.0, (double)(_mipmapCount - 1));
+
+	int level = (int)lod;
+	double weight = lod - level;
+
+	Color c = sampleBiLinear(x, y, level);
+	if (weight > 0 && level + 1 < _mipmapCount)
+		c = c * (1.0 - weight) + sampleBiLinear(x, y, level + 1) * weight;
+	return c;
+}
+
+Color TextureSampler::sampleBiLinearMipmapped( double x, double y, const Vector3 &x_step, const Vector3 &y_step ) const
+{
+	// the mipmap where the pixel is about one texel, along its longer axis
+	double size = max(max(footprint(x_step), footprint(y_step)), 1e-12);
+	double lod = log2(size) / 2;
+
+	int level = clamp((int)(lod + 0.5), 0, _mipmapCount - 1);
 	return sampleBiLinear(x, y, level);
 }
 
+Color TextureSampler::sampleTriLinear( double x, double y, const Vector3 &x_step, const Vector3 &y_step ) const
+{
+	double size = max(max(footprint(x_step), footprint(y_step)), 1e-12);
+	return sampleLOD(x, y, log2(size) / 2);
+}
+
+Color TextureSampler::sampleAnisotropic( double x, double y, const Vector3 &x_step, const Vector3 &y_step, int maxAnisotropy ) const
+{
+	double sizeX = footprint(x_step), sizeY = footprint(y_step);
+	const Vector3 &axis = sizeX > sizeY ? x_step : y_step;
+
+	double major = sqrt(max(sizeX, sizeY)), minor = sqrt(min(sizeX, sizeY));
+
+	// samples are about one texel of the chosen mipmap apart, unless there are too many of them
+	int taps = clamp((int)ceil(major / max(minor, 1e-6)), 1, maxAnisotropy);
+	double lod = log2(max(major / taps, 1e-6));
+
+	if (taps == 1)
+		return sampleLOD(x, y, lod);
+
+	Color c(0, 0, 0);
+
+	for (int i = 0 ; i < taps ; i++) {
+		double t = (i + 0.5) / taps - 0.5;
+		c += sampleLOD(x + axis[0] * t, y + axis[1] * t, lod);
+	}
+
+	return c / taps;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////
 
-ShadowSampler::ShadowSampler() : _depthbuffer(NULL) {}
+ShadowSampler::ShadowSampler() : _texels(NULL), _moments(NULL) {}
 
-void ShadowSampler::bindTexture( const DepthTexture* texture )
+void ShadowSampler::bind( const ShadowAtlas *atlas, const ShadowAtlasRegion &region )
 {
-	_depthbuffer = texture;
+	_texels = atlas->getTexel(ShadowAtlas::LAYER_MAPS, region.x, region.y);
+	_stride = atlas->getStride();
+	_texelBytes = atlas->getTexelBytes();
+	_mask = atlas->getMask();
+	_scale = atlas->getScale();
+	_moments = atlas->getMoments(region.x, region.y);
+	_momentsStride = atlas->getMomentsStride();
+	_width = _height = region.size;
+}
 
-	if (_depthbuffer) {
-		_width = texture->getWidth();
-		_height = texture->getHeight();
-	}
+void ShadowSampler::unbind()
+{
+	_texels = NULL;
 }
 
 
@@ -126,7 +470,7 @@ double ShadowSampler::sample( double x, double y, double z ) const
 	// regular simple sample
 	int x_int = clamp((int)(x * _width +0.5), 0, _width - 1);
 	int y_int = clamp((int)(y *_height +0.5), 0, _height - 1);
-	return _depthbuffer->getPixelValue(x_int,y_int) >= z ? 1.0 : 0;
+	return getDepth(x_int,y_int) >= z ? 1.0 : 0;
 }
 
 
@@ -143,7 +487,7 @@ double ShadowSampler::samplePCF( double x, double y, double z, int kernelSize )
 
 	for (int x = x1 ; x < x1 + kernelSize ; x++) 
 		for (int y = y1 ; y < y1 + kernelSize ; y++)
-			result  += ((_depthbuffer->getPixelValue(x,y) >= z) ? 1.0 : 0);
+			result  += ((getDepth(x,y) >= z) ? 1.0 : 0);
 
 	return result / (kernelSize*kernelSize);
 }
@@ -164,19 +508,55 @@ double ShadowSampler::samplePoisonPCF( double x, double y, double z, int taps )
 	return result / 4;
 }
 
+double ShadowSampler::sampleVariance( double x, double y, double z ) const
+{
+	// variance smaller than that is just precision noise of flat surfaces (moments are 16 bit)
+	static const double minVariance = 0.00004;
+	static const double momentsScale = 1.0 / 0xFFFF;
+
+	// part of Chebyshev bound that is cut off, it shows up as light leaking between overlapping occluders
+	static const double lightBleedCut = 0.2;
+
+	// bilinear sample of the moments (texel centers are at i / width, as in sample)
+	// (clamped as integers, points outside of the light frustum can come as inf/nan)
+	x *= _width;
+	y *= _height;
+
+	int x0 = clamp((int)floor(x), 0, _width - 1), y0 = clamp((int)floor(y), 0, _height - 1);
+	int x1 = min(x0 + 1, _width - 1), y1 = min(y0 + 1, _height - 1);
+	double wx = clamp(x - x0, 0.0, 1.0), wy = clamp(y - y0, 0.0, 1.0);
+
+	const uint16_t *m00 = _moments + y0 * _momentsStride + x0 * 2, *m10 = _moments + y0 * _momentsStride + x1 * 2;
+	const uint16_t *m01 = _moments + y1 * _momentsStride + x0 * 2, *m11 = _moments + y1 * _momentsStride + x1 * 2;
+
+	double m1 = ((m00[0] * (1 - wx) + m10[0] * wx) * (1 - wy) + (m01[0] * (1 - wx) + m11[0] * wx) * wy) * momentsScale;
+	double m2 = ((m00[1] * (1 - wx) + m10[1] * wx) * (1 - wy) + (m01[1] * (1 - wx) + m11[1] * wx) * wy) * momentsScale;
+
+	if (z <= m1)
+		return 1.0;
+
+	// upper bound of the fraction of the filter area that is closer to the light than z
+	double variance = max(m2 - m1 * m1, minVariance);
+	double d = z - m1;
+	double lit = variance / (variance + d * d);
+
+	return clamp((lit - lightBleedCut) / (1 - lightBleedCut), 0.0, 1.0);
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 
-void ShadowCubemapSampler::bindTextures( const DepthTexture** textures )
+void ShadowCubemapSampler::bind( const ShadowAtlas *atlas, const ShadowAtlasRegion regions[6] )
 {
-	_isBound = (textures != NULL);
+	_isBound = true;
+	for (int i=0 ; i < 6 ;i++)
+		_faceSamplers[i].bind(atlas, regions[i]);
+}
 
-	if (_isBound) {
-		for (int i=0 ; i < 6 ;i++)
-			_faceSamplers[i].bindTexture(textures[i]);
-	} else {
-		for (int i=0 ; i < 6 ;i++)
-			_faceSamplers[i].bindTexture(NULL);
-	}
+void ShadowCubemapSampler::unbind()
+{
+	_isBound = false;
+	for (int i=0 ; i < 6 ;i++)
+		_faceSamplers[i].unbind();
 }
 
 int ShadowCubemapSampler::selectFace(const Vector3 &dir) const
@@ -212,3 +592,8 @@ double ShadowCubemapSampler::samplePoisonPCF( int face, double x, double y, doub
 {
 	return _faceSamplers[face].samplePoisonPCF(x,y,z,taps);
 }
+
+double ShadowCubemapSampler::sampleVariance( int face, double x, double y, double z ) const
+{
+	return _faceSamplers[face].sampleVariance(x,y,z);
+}
@@ -21,8 +21,12 @@
 
 #include "common/Mat4.h"
 #include "common/Vector4.h"
+#include <stdint.h>
+#include <string.h>
 
 class Texture;
+class ShadowAtlas;
+struct ShadowAtlasRegion;
 
 class TextureSampler
 {
@@ -38,32 +42,85 @@ public:
 	/* main sampling functions */
 	Color sample(double x, double y) const;
 	Color sampleBiLinear(double x, double y, int mipNumber = 0) const;
-	Color sampleBiLinearMipmapped(double x, double y, double x_step, double y_step) const;
+
+	/* bilinear samples of several coordinates at once (a span of pixels) */
+	void sampleBiLinear(const double x[], const double y[], int count, Color result[], int mipNumber = 0) const;
+
+	/*
+	 * filtered sampling, x_step and y_step are the changes of the texture coordinates from the pixel
+	 * to the next one along screen x and y (from Renderer::queryLOD). Bilinear from the nearest mipmap,
+	 * trilinear between two mipmaps, and anisotropic - up to maxAnisotropy trilinear samples along
+	 * the longer axis of the pixel footprint, from the mipmap that fits its shorter axis
+	 */
+	Color sampleBiLinearMipmapped(double x, double y, const Vector3 &x_step, const Vector3 &y_step) const;
+	Color sampleTriLinear(double x, double y, const Vector3 &x_step, const Vector3 &y_step) const;
+	Color sampleAnisotropic(double x, double y, const Vector3 &x_step, const Vector3 &y_step, int maxAnisotropy = 16) const;
 
 private:
+	double footprint(const Vector3 &step) const;
+	Color sampleLOD(double x, double y, double lod) const;
+	void updateLevels();
+
+	/* bilinear blend of the texels around a point, in 8 bit fixed point */
+	DEVICE_PIXEL blendBiLinear(double x, double y, int mipNumber) const;
+
+	/* same for 4 points at once (SSE2 only, and not for compressed textures) */
+	void blendBiLinear4(const double x[4], const double y[4], int mipNumber, DEVICE_PIXEL result[4]) const;
+
 	const Texture* _texture;
 	int _mipmapCount;
 	double _scaleX;
 	double _scaleY;
+
+	/*
+	 * scale and size of each mipmap, so texel coordinates are wrapped with a mask for power of two
+	 * sizes and with a multiplication by the reciprocal otherwise, instead of a division
+	 */
+	struct Level
+	{
+		double scaleX, scaleY;
+		int width, height;
+		double invWidth, invHeight;
+	};
+
+	enum { MAX_MIPMAPS = 16 };
+	Level _levels[MAX_MIPMAPS];
+	bool _powerOfTwo;
 };
 
 class ShadowSampler
 {
 public:
 	ShadowSampler();
-	void bindTexture(const DepthTexture* texture);
+	void bind(const ShadowAtlas *atlas, const ShadowAtlasRegion &region);
+	void unbind();
 
 	double sample(double x, double y, double z) const;
 	double samplePCF(double x, double y, double z, int taps) const;
 	double samplePoison(double x, double y, double z) const;
 	double samplePoisonPCF(double x, double y, double z, int taps) const;
 
-	bool isBound() const { return _depthbuffer != NULL; }
-public:
-	const DepthTexture* getBuffer()  { return _depthbuffer;}
-	void clear();
+	/* variance shadow map - one bilinear lookup of prefiltered moments (of the atlas), however soft the shadow is */
+	double sampleVariance(double x, double y, double z) const;
+
+	bool isBound() const { return _texels != NULL; }
 private:
-	const DepthTexture *_depthbuffer;
+	/* depth stored in a texel of the region (texels are little endian, 16 or 24 bit) */
+	double getDepth(int x, int y) const
+	{
+		uint32_t value;
+		memcpy(&value, _texels + y * _stride + x * _texelBytes, sizeof(value));
+		return (value & _mask) * _scale;
+	}
+
+	const uint8_t *_texels;
+	int _stride;
+	int _texelBytes;
+	uint32_t _mask;
+	double _scale;
+
+	const uint16_t *_moments;
+	int _momentsStride;
 	int _width;
 	int _height;
 };
@@ -72,12 +129,14 @@ class ShadowCubemapSampler
 {
 public:
 	ShadowCubemapSampler() : _isBound(false) {}
-	void bindTextures(const DepthTexture** textures);
+	void bind(const ShadowAtlas *atlas, const ShadowAtlasRegion regions[6]);
+	void unbind();
 
 	double sample(int face, double x, double y, double z) const;
 	double samplePCF(int face, double x, double y, double z, int taps) const;
 	double samplePoison(int face, double x, double y, double z) const;
 	double samplePoisonPCF(int face, double x, double y, double z, int taps) const;
+	double sampleVariance(int face, double x, double y, double z) const;
 
 	bool isBound() const { return _isBound; }
 	int selectFace(const Vector3 &dir) const;
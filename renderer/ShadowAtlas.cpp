@@ -0,0 +1,248 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ShadowAtlas.h"
+#include "Texture.h"
+#include <assert.h>
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* texels are kept in little endian order, samplers read them as (unaligned) 32 bit words */
+template <int BYTES>
+static void storeRow(uint8_t *out, const double *in, int count, uint32_t mask)
+{
+	const double scale = mask - 1;
+
+	for (int x = 0 ; x < count ; x++, out += BYTES)
+	{
+		double d = in[x];
+		uint32_t value = (d > 1) ? mask : (uint32_t)(max(d, 0.0) * scale + 0.5);
+
+		out[0] = (uint8_t)value;
+		out[1] = (uint8_t)(value >> 8);
+		if (BYTES > 2)
+			out[2] = (uint8_t)(value >> 16);
+	}
+}
+
+template <int BYTES>
+static void loadRow(double *out, const uint8_t *in, int count, double scale)
+{
+	for (int x = 0 ; x < count ; x++, in += BYTES)
+	{
+		uint32_t value = in[0] | (in[1] << 8);
+		if (BYTES > 2)
+			value |= in[2] << 16;
+		out[x] = value * scale;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ShadowAtlas::ShadowAtlas() : _size(0), _texelBytes(2), _mask(0xFFFF) {}
+
+bool ShadowAtlas::setup( size_t budget, int depthBits, bool moments )
+{
+	int texelBytes = (depthBits > 16) ? 3 : 2;
+	size_t bytes = texelBytes * LAYER_COUNT + (moments ? 2 * sizeof(uint16_t) : 0);
+
+	int size = 64;
+	while ((size_t)size * size * 4 * bytes <= budget)
+		size *= 2;
+
+	if (size == _size && texelBytes == _texelBytes && moments == hasMoments())
+		return false;
+
+	_size = size;
+	_texelBytes = texelBytes;
+	_mask = (texelBytes == 3) ? 0xFFFFFF : 0xFFFF;
+
+	for (int i = 0 ; i < LAYER_COUNT ; i++) {
+		std::vector<uint8_t>().swap(_layers[i]);
+		_layers[i].resize((size_t)_size * _size * _texelBytes + sizeof(uint32_t));
+	}
+
+	std::vector<uint16_t>().swap(_moments);
+	if (moments)
+		_moments.resize((size_t)_size * _size * 2);
+
+	releaseAll();
+	return true;
+}
+
+size_t ShadowAtlas::getMemoryUsage() const
+{
+	size_t result = 0;
+	for (int i = 0 ; i < LAYER_COUNT ; i++)
+		result += _layers[i].size();
+	return result + _moments.size() * sizeof(uint16_t);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int ShadowAtlas::getLevel( int size ) const
+{
+	int level = 0;
+	while ((_size >> level) > size)
+		level++;
+	return level;
+}
+
+bool ShadowAtlas::allocate( int size, ShadowAtlasRegion &region )
+{
+	// only power of two sizes fit the buddy scheme
+	if (size <= 0 || size > _size || (size & (size - 1)))
+		return false;
+
+	int level = getLevel(size);
+
+	// smallest free square that is big enough
+	int found = level;
+	while (found >= 0 && _free[found].empty())
+		found--;
+
+	if (found < 0)
+		return false;
+
+	ShadowAtlasRegion square = _free[found].back();
+	_free[found].pop_back();
+
+	// split it until it is of the right size, keeping the first quarter each time
+	for ( ; found < level ; found++)
+	{
+		square.size /= 2;
+
+		for (int quarter = 1 ; quarter < 4 ; quarter++) {
+			ShadowAtlasRegion buddy = square;
+			buddy.x += (quarter & 1) ? square.size : 0;
+			buddy.y += (quarter & 2) ? square.size : 0;
+			_free[found + 1].push_back(buddy);
+		}
+	}
+
+	region = square;
+	return true;
+}
+
+void ShadowAtlas::release( ShadowAtlasRegion &region )
+{
+	if (!region.isValid())
+		return;
+
+	ShadowAtlasRegion square = region;
+	region = ShadowAtlasRegion();
+
+	// merge with the buddies while all of them are free
+	for (int level = getLevel(square.size) ; ; level--)
+	{
+		std::vector<ShadowAtlasRegion> &freeList = _free[level];
+
+		if (level == 0) {
+			freeList.push_back(square);
+			return;
+		}
+
+		int parentSize = square.size * 2;
+		int parentX = square.x - square.x % parentSize;
+		int parentY = square.y - square.y % parentSize;
+
+		int buddies[3], buddyCount = 0;
+
+		for (int i = 0 ; i < (int)freeList.size() && buddyCount < 3 ; i++)
+			if (freeList[i].x - freeList[i].x % parentSize == parentX &&
+					freeList[i].y - freeList[i].y % parentSize == parentY)
+				buddies[buddyCount++] = i;
+
+		if (buddyCount < 3) {
+			freeList.push_back(square);
+			return;
+		}
+
+		// indexes are increasing, so remove from the end
+		for (int i = 2 ; i >= 0 ; i--) {
+			freeList[buddies[i]] = freeList.back();
+			freeList.pop_back();
+		}
+
+		square.x = parentX;
+		square.y = parentY;
+		square.size = parentSize;
+	}
+}
+
+void ShadowAtlas::releaseAll()
+{
+	_free.clear();
+	_free.resize(getLevel(1) + 1);
+
+	ShadowAtlasRegion whole;
+	whole.size = _size;
+	_free[0].push_back(whole);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void ShadowAtlas::store( Layer layer, const ShadowAtlasRegion &region, const DepthTexture &depth )
+{
+	assert(depth.getWidth() == region.size && depth.getHeight() == region.size);
+
+	for (int y = 0 ; y < region.size ; y++)
+	{
+		uint8_t *out = &_layers[layer][((size_t)(region.y + y) * _size + region.x) * _texelBytes];
+		const double *in = depth.getPointer() + y * region.size;
+
+		if (_texelBytes == 3)
+			storeRow<3>(out, in, region.size, _mask);
+		else
+			storeRow<2>(out, in, region.size, _mask);
+	}
+}
+
+void ShadowAtlas::load( Layer layer, const ShadowAtlasRegion &region, DepthTexture &depth ) const
+{
+	assert(depth.getWidth() == region.size && depth.getHeight() == region.size);
+
+	for (int y = 0 ; y < region.size ; y++)
+	{
+		const uint8_t *in = getTexel(layer, region.x, region.y + y);
+		double *out = depth.getPointer() + y * region.size;
+
+		if (_texelBytes == 3)
+			loadRow<3>(out, in, region.size, getScale());
+		else
+			loadRow<2>(out, in, region.size, getScale());
+	}
+}
+
+void ShadowAtlas::storeMoments( const ShadowAtlasRegion &region, const MomentsTexture &moments )
+{
+	assert(hasMoments() && moments.getWidth() == region.size && moments.getHeight() == region.size);
+
+	// moments are in [0,1], as depth is clamped before they are computed
+	for (int y = 0 ; y < region.size ; y++)
+	{
+		uint16_t *out = &_moments[((size_t)(region.y + y) * _size + region.x) * 2];
+		const DepthMoments *in = moments.getPointer() + y * region.size;
+
+		for (int x = 0 ; x < region.size ; x++) {
+			out[x * 2] = (uint16_t)(clamp(in[x].m1, 0.0, 1.0) * 0xFFFF + 0.5);
+			out[x * 2 + 1] = (uint16_t)(clamp(in[x].m2, 0.0, 1.0) * 0xFFFF + 0.5);
+		}
+	}
+}
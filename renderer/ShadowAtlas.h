@@ -0,0 +1,117 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SHADOWATLAS_H
+#define SHADOWATLAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class DepthTexture;
+class MomentsTexture;
+
+/* square part of the atlas that holds one map */
+struct ShadowAtlasRegion
+{
+	int x;
+	int y;
+	int size;
+
+	ShadowAtlasRegion() : x(0), y(0), size(0) {}
+	bool isValid() const { return size > 0; }
+};
+
+/*
+ * All shadow maps packed in one buffer of normalized 16 or 24 bit depth,
+ * instead of a texture of doubles for each map.
+ *
+ * Regions are power of two squares, given out by a buddy allocator (each free square
+ * is split to four when a smaller one is needed), so a map keeps its place as long as
+ * its size doesn't change.
+ *
+ * Atlas has several layers with the same layout: the maps themselves, and the static
+ * part of them that the engine keeps between updates.
+ *
+ * Maps are rendered into a regular DepthTexture and stored into the atlas after that.
+ * Depth is clamped to [0,1], and empty texels are stored as the largest value,
+ * which is read back as a bit more than 1, so nothing is shadowed by them.
+ *
+ * For variance shadow maps, the atlas also holds the filtered moments of the maps (depth and
+ * its square, each as normalized 16 bit value), in the same layout and within the same budget.
+ */
+class ShadowAtlas
+{
+public:
+	enum Layer
+	{
+		LAYER_MAPS,
+		LAYER_STATIC,
+		LAYER_COUNT
+	};
+
+	ShadowAtlas();
+
+	/* biggest atlas that fits into the budget (in bytes), returns true if it changed and all regions were dropped */
+	bool setup(size_t budget, int depthBits, bool moments);
+
+	int getSize() const { return _size; }
+	int getDepthBits() const { return _texelBytes * 8; }
+	size_t getMemoryUsage() const;
+
+	/* regions */
+	bool allocate(int size, ShadowAtlasRegion &region);
+	void release(ShadowAtlasRegion &region);
+	void releaseAll();
+
+	/* transfer of a map to and from a region */
+	void store(Layer layer, const ShadowAtlasRegion &region, const DepthTexture &depth);
+	void load(Layer layer, const ShadowAtlasRegion &region, DepthTexture &depth) const;
+	void storeMoments(const ShadowAtlasRegion &region, const MomentsTexture &moments);
+
+	/* raw texels, for the samplers */
+	const uint8_t* getTexel(Layer layer, int x, int y) const { return &_layers[layer][((size_t)y * _size + x) * _texelBytes]; }
+	int getStride() const { return _size * _texelBytes; }
+	int getTexelBytes() const { return _texelBytes; }
+	uint32_t getMask() const { return _mask; }
+	double getScale() const { return 1.0 / (_mask - 1); }
+
+	/* moments of a texel (m1, m2), NULL without them */
+	bool hasMoments() const { return !_moments.empty(); }
+	const uint16_t* getMoments(int x, int y) const { return hasMoments() ? &_moments[((size_t)y * _size + x) * 2] : NULL; }
+	int getMomentsStride() const { return _size * 2; }
+
+private:
+	ShadowAtlas(const ShadowAtlas &other);
+	ShadowAtlas& operator=(const ShadowAtlas &other);
+
+	int getLevel(int size) const;
+
+	int _size;
+	int _texelBytes;
+	uint32_t _mask;
+
+	/* texels are read 4 bytes at a time, so there is some padding at the end */
+	std::vector<uint8_t> _layers[LAYER_COUNT];
+	std::vector<uint16_t> _moments;
+
+	/* free squares of each size, level 0 is the whole atlas */
+	std::vector<std::vector<ShadowAtlasRegion> > _free;
+};
+
+#endif
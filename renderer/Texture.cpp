@@ -19,22 +19,306 @@
 
 #include "Texture.h"
 #include "common/Vector4.h"
+#include "common/ThreadPool.h"
 #include <cmath>
+#include <vector>
 #include "model/PngLoader.h"
+#include <atomic>
+#include <climits>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-static std::map<std::string, const Texture*> textureCache;
+/*
+ * Loaded textures, with the number of references to each. Textures without references stay loaded until
+ * the memory they take is needed for other textures, and are freed least recently used first
+ */
+struct TextureCacheEntry
+{
+	TextureCacheEntry() : texture(NULL), references(0), bytes(0) {}
+
+	/* the texture is being loaded (by the thread that added the entry), others wait for it */
+	bool loading() const { return !texture; }
+
+	const Texture *texture;
+	int references;
+	size_t bytes;
+	std::list<std::string>::iterator unused;
+};
+
+static std::mutex cacheLock;
+static std::condition_variable cacheLoaded;
+static std::map<std::string, TextureCacheEntry> textureCache;
+static std::list<std::string> unusedTextures;
+static TextureCacheStats cacheStats = { 0, TEXTURE_CACHE_DEFAULT_BUDGET, 0, 0, 0, 0, 0 };
+
+/* textures are cached for each layout they were loaded with */
+static std::string cacheKey(const std::string &name, TEXTURE_LAYOUT layout)
+{
+	return name + (char)('0' + layout);
+}
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 Texture::Texture(DEVICE_PIXEL *data, int width, int height) : TextureBase(data,width,height)
 {
-	refcount = 1;
 	_mipmapCount = 0;
+	_layout = TEXTURE_LAYOUT_LINEAR; _tilesX = 0;
+	_blocks = NULL; _blocksID = 0;
+	_mapping = NULL; _mappingSize = 0;
 }
 
 Texture::Texture(int width, int height) : TextureBase(width, height)
 {
-	refcount = 1; _mipmapCount = 0;
+	// a single level, so it can be bound to a sampler
+	_mipmapCount = 1;
+	_layout = TEXTURE_LAYOUT_LINEAR; _tilesX = 0;
+	_blocks = NULL; _blocksID = 0;
+	_mapping = NULL; _mappingSize = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* 5:6:5 color to 8 bits per channel, with the high bits repeated in the low ones so that white stays white */
+static inline DEVICE_PIXEL unpackColor(unsigned short c)
+{
+	int r = c >> 11, g = (c >> 5) & 63, b = c & 31;
+	return DEVICE_PIXEL((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2));
+}
+
+static inline unsigned short packColor(double r, double g, double b)
+{
+	int r5 = clamp((int)(r * 31 / 255 + 0.5), 0, 31);
+	int g6 = clamp((int)(g * 63 / 255 + 0.5), 0, 63);
+	int b5 = clamp((int)(b * 31 / 255 + 0.5), 0, 31);
+	return (unsigned short)((r5 << 11) | (g6 << 5) | b5);
+}
+
+static void blockPalette(const TextureBlock &block, DEVICE_PIXEL palette[4])
+{
+	palette[0] = unpackColor(block.color0);
+	palette[1] = unpackColor(block.color1);
+	palette[2] = DEVICE_PIXEL(
+		(palette[0].Red * 2 + palette[1].Red) / 3,
+		(palette[0].Green * 2 + palette[1].Green) / 3,
+		(palette[0].Blue * 2 + palette[1].Blue) / 3);
+	palette[3] = DEVICE_PIXEL(
+		(palette[0].Red + palette[1].Red * 2) / 3,
+		(palette[0].Green + palette[1].Green * 2) / 3,
+		(palette[0].Blue + palette[1].Blue * 2) / 3);
+}
+
+/*
+ * The two colors are the ends of the texels projected on the line that fits them best
+ * (the main axis of their covariance, found with a few power iterations), and each texel
+ * then takes the closest of the four colors
+ */
+static void encodeBlock(const DEVICE_PIXEL texels[16], TextureBlock &block)
+{
+	double mean[3] = { 0, 0, 0 };
+
+	for (int i = 0 ; i < 16 ; i++) {
+		mean[0] += texels[i].Red;
+		mean[1] += texels[i].Green;
+		mean[2] += texels[i].Blue;
+	}
+
+	for (int k = 0 ; k < 3 ; k++)
+		mean[k] /= 16;
+
+	double cov[3][3] = { { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 } };
+
+	for (int i = 0 ; i < 16 ; i++) {
+		double d[3] = { texels[i].Red - mean[0], texels[i].Green - mean[1], texels[i].Blue - mean[2] };
+		for (int j = 0 ; j < 3 ; j++)
+			for (int k = 0 ; k < 3 ; k++)
+				cov[j][k] += d[j] * d[k];
+	}
+
+	double axis[3] = { 1, 1, 1 };
+
+	for (int iteration = 0 ; iteration < 8 ; iteration++)
+	{
+		double next[3];
+		for (int j = 0 ; j < 3 ; j++)
+			next[j] = cov[j][0] * axis[0] + cov[j][1] * axis[1] + cov[j][2] * axis[2];
+
+		double length = std::max(std::abs(next[0]), std::max(std::abs(next[1]), std::abs(next[2])));
+
+		// all texels are the same color
+		if (length < 1e-9)
+			break;
+
+		for (int j = 0 ; j < 3 ; j++)
+			axis[j] = next[j] / length;
+	}
+
+	double low = 0, high = 0;
+
+	for (int i = 0 ; i < 16 ; i++) {
+		double t = (texels[i].Red - mean[0]) * axis[0] + (texels[i].Green - mean[1]) * axis[1] + (texels[i].Blue - mean[2]) * axis[2];
+		low = std::min(low, t);
+		high = std::max(high, t);
+	}
+
+	double scale = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	low /= scale;
+	high /= scale;
+
+	block.color0 = packColor(mean[0] + axis[0] * high, mean[1] + axis[1] * high, mean[2] + axis[2] * high);
+	block.color1 = packColor(mean[0] + axis[0] * low, mean[1] + axis[1] * low, mean[2] + axis[2] * low);
+	block.indices = 0;
+
+	DEVICE_PIXEL palette[4];
+	blockPalette(block, palette);
+
+	for (int i = 0 ; i < 16 ; i++)
+	{
+		int best = 0, bestDistance = INT_MAX;
+
+		for (int j = 0 ; j < 4 ; j++) {
+			int r = texels[i].Red - palette[j].Red, g = texels[i].Green - palette[j].Green, b = texels[i].Blue - palette[j].Blue;
+			int distance = r * r + g * g + b * b;
+			if (distance < bestDistance) {
+				bestDistance = distance;
+				best = j;
+			}
+		}
+
+		block.indices |= best << (i * 2);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* identifies texels of each compression in the decoded block cache, so a new texture at the address of a freed one doesn't hit */
+static std::atomic<unsigned int> nextBlocksID(1);
+
+unsigned int Texture::newBlocksID()
+{
+	return nextBlocksID++;
+}
+
+/* recently decoded blocks, of any texture, in each thread */
+struct DecodedBlock
+{
+	unsigned int blocksID;
+	int block;
+	DEVICE_PIXEL texels[16];
+};
+
+#define DECODED_BLOCK_CACHE_BITS 8
+static thread_local DecodedBlock decodedBlocks[1 << DECODED_BLOCK_CACHE_BITS];
+
+const DEVICE_PIXEL* Texture::decodeBlock(int block) const
+{
+	// hashed, since rows of tiles are often a power of two apart, and would share the entries otherwise
+	unsigned int hash = ((unsigned int)block + _blocksID * 7919) * 2654435761u;
+	DecodedBlock &entry = decodedBlocks[hash >> (32 - DECODED_BLOCK_CACHE_BITS)];
+
+	if (entry.blocksID == _blocksID && entry.block == block)
+		return entry.texels;
+
+	const TextureBlock &b = _blocks[block];
+	DEVICE_PIXEL palette[4];
+	blockPalette(b, palette);
+
+	for (int i = 0 ; i < 16 ; i++)
+		entry.texels[i] = palette[(b.indices >> (i * 2)) & 3];
+
+	entry.blocksID = _blocksID;
+	entry.block = block;
+	return entry.texels;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Texture::setLayout(TEXTURE_LAYOUT layout)
+{
+	if (layout == _layout)
+		return;
+
+	// wrapped data can't be resized, and the first level owns the memory of all of them
+	assert(_allocated || _mapping);
+
+	const bool linear = layout == TEXTURE_LAYOUT_LINEAR;
+	const bool compressed = layout == TEXTURE_LAYOUT_COMPRESSED;
+	const int count = max(_mipmapCount, 1);
+
+	// the levels stay in a single allocation, these are their offsets in texels (or blocks)
+	std::vector<int> offsets(count + 1, 0);
+
+	for (int level = 0 ; level < count ; level++) {
+		const Texture &t = this[level];
+		int tiles = ((t._width + 3) / 4) * ((t._height + 3) / 4);
+		offsets[level + 1] = offsets[level] + (linear ? t._width * t._height : compressed ? tiles : tiles * 16);
+	}
+
+	DEVICE_PIXEL *data = compressed ? NULL : new DEVICE_PIXEL[offsets[count]];
+	TextureBlock *blocks = compressed ? new TextureBlock[offsets[count]] : NULL;
+
+	for (int level = 0 ; level < count ; level++)
+	{
+		const Texture &t = this[level];
+		int tilesX = (t._width + 3) / 4, tilesY = (t._height + 3) / 4;
+
+		// tiles on the right and bottom edges are padded with the last column and row
+		int width = linear ? t._width : tilesX * 4;
+		int height = linear ? t._height : tilesY * 4;
+
+		DEVICE_PIXEL *texels = compressed ? new DEVICE_PIXEL[width * height] : data + offsets[level];
+
+		parallelFor(0, height, 64, [&] (int from, int to) {
+			for (int y = from ; y < to ; y++)
+				for (int x = 0 ; x < width ; x++)
+					texels[linear ? y * width + x : tiledIndex(x, y, tilesX)] = t.getTexel(min(x, t._width - 1), min(y, t._height - 1));
+		});
+
+		if (compressed)
+		{
+			TextureBlock *levelBlocks = blocks + offsets[level];
+
+			parallelFor(0, tilesX * tilesY, 256, [&] (int from, int to) {
+				for (int i = from ; i < to ; i++)
+					encodeBlock(texels + i * 16, levelBlocks[i]);
+			});
+
+			delete [] texels;
+		}
+	}
+
+	releaseStorage();
+
+	for (int level = 0 ; level < count ; level++)
+	{
+		Texture &t = this[level];
+		t._data = data ? data + offsets[level] : NULL;
+		t._blocks = blocks ? blocks + offsets[level] : NULL;
+		t._blocksID = blocks ? nextBlocksID++ : 0;
+		t._layout = layout;
+		t._tilesX = (t._width + 3) / 4;
+		t._allocated = level == 0;
+	}
+}
+
+size_t Texture::getMemoryUsage() const
+{
+	int tiles = _tilesX * ((_height + 3) / 4);
+
+	switch (_layout) {
+	case TEXTURE_LAYOUT_TILED:
+		return tiles * 16 * sizeof(DEVICE_PIXEL);
+	case TEXTURE_LAYOUT_COMPRESSED:
+		return tiles * sizeof(TextureBlock);
+	default:
+		return _width * _height * sizeof(DEVICE_PIXEL);
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -43,107 +327,542 @@ Color Texture::sample( int x, int y ) const
 {
 	x = min(_width-1, x);
 	y = min(_height-1,y);
-	const DEVICE_PIXEL & p = getPixelValue(x,y);
+	const DEVICE_PIXEL p = getTexel(x,y);
 	return Color((double)p.Red/255, (double)p.Green/255, (double)p.Blue/255);
 }
 
+void Texture::getCompressedQuad( int x, int y, DEVICE_PIXEL quad[4] ) const
+{
+	// mostly all four are in one block (the padding of the edge tiles repeats the last texels as the clamping does)
+	if ((x & 3) != 3 && (y & 3) != 3) {
+		int index = tiledIndex(x, y, _tilesX);
+		const DEVICE_PIXEL *p = decodeBlock(index >> 4) + (index & 15);
+		quad[0] = p[0];
+		quad[1] = p[1];
+		quad[2] = p[4];
+		quad[3] = p[5];
+		return;
+	}
+
+	int x1 = min(_width-1, x+1), y1 = min(_height-1, y+1);
+	quad[0] = getTexel(x, y);
+	quad[1] = getTexel(x1, y);
+	quad[2] = getTexel(x, y1);
+	quad[3] = getTexel(x1, y1);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-const Texture* Texture::loadCached( const char* name, bool mipmaps )
+/* called with the lock held: unused textures are freed, least recently used first, until the cache fits */
+static void evictTextures()
+{
+	while (cacheStats.residentBytes > cacheStats.budget && !unusedTextures.empty())
+	{
+		auto iter = textureCache.find(unusedTextures.back());
+		unusedTextures.pop_back();
+
+		cacheStats.residentBytes -= iter->second.bytes;
+		cacheStats.evictions++;
+		delete [] iter->second.texture;
+		textureCache.erase(iter);
+	}
+}
+
+/* called with the lock held, for a texture that was just loaded (or failed to) */
+static const Texture* finishLoad(const std::string &key, Texture *texture)
+{
+	auto iter = textureCache.find(key);
+	cacheLoaded.notify_all();
+
+	if (!texture) {
+		textureCache.erase(iter);
+		return NULL;
+	}
+
+	TextureCacheEntry &entry = iter->second;
+	entry.texture = texture;
+	entry.references = 1;
+	entry.bytes = 0;
+
+	for (int level = 0 ; level < texture->getMipmapCount() ; level++)
+		entry.bytes += texture[level].getMemoryUsage();
+
+	cacheStats.residentBytes += entry.bytes;
+	evictTextures();
+	return texture;
+}
+
+/*
+ * called with the lock held: a reference to the texture if it is cached, NULL if it's not (then the caller loads it,
+ * and the entry marks that it does). Waits for textures that other threads load
+ */
+static const Texture* findCached(std::unique_lock<std::mutex> &lock, const std::string &key, bool &found)
+{
+	while (true)
+	{
+		auto iter = textureCache.find(key);
+
+		if (iter == textureCache.end()) {
+			cacheStats.misses++;
+			textureCache[key] = TextureCacheEntry();
+			found = false;
+			return NULL;
+		}
+
+		TextureCacheEntry &entry = iter->second;
+
+		if (entry.loading()) {
+			cacheLoaded.wait(lock);
+			continue;
+		}
+
+		if (!entry.references++)
+			unusedTextures.erase(entry.unused);
+
+		cacheStats.hits++;
+		found = true;
+		return entry.texture;
+	}
+}
+
+const Texture* Texture::loadCached( const char* name, bool mipmaps, TEXTURE_LAYOUT layout )
 {
 	if (strlen(name) == 0)
 		return NULL;
 
-	auto iter = textureCache.find(name);
-	if (iter != textureCache.end()) 
+	const std::string key = cacheKey(name, layout);
+	std::unique_lock<std::mutex> lock(cacheLock);
+
+	bool found;
+	const Texture* result = findCached(lock, key, found);
+	if (found)
+		return result;
+
+	// other threads can use the cache meanwhile, and wait only if they need this texture
+	lock.unlock();
+	Texture *texture = load(name, mipmaps, layout);
+	lock.lock();
+
+	return finishLoad(key, texture);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Texture::loadCached(const std::vector<std::string> &names, bool mipmaps, TEXTURE_LAYOUT layout, std::vector<const Texture*> &result)
+{
+	std::vector<int> missing, later;
+	std::unique_lock<std::mutex> lock(cacheLock);
+
+	result.assign(names.size(), NULL);
+
+	for (size_t i = 0 ; i < names.size() ; i++)
 	{
-		iter->second->refcount++;
-		return iter->second;
+		if (names[i].empty())
+			continue;
+
+		// repeated names and textures that other threads load are taken after these are loaded
+		auto iter = textureCache.find(cacheKey(names[i], layout));
+		if (iter != textureCache.end() && iter->second.loading()) {
+			later.push_back(i);
+			continue;
+		}
+
+		bool found;
+		result[i] = findCached(lock, cacheKey(names[i], layout), found);
+		if (!found)
+			missing.push_back(i);
 	}
 
-	Texture* result = load(name, mipmaps);
+	lock.unlock();
 
-	if (!result)
-		return NULL;
+	// decoding and building the mipmaps is independent for each file
+	std::vector<Texture*> loaded(missing.size());
+	parallelFor(0, missing.size(), 1, [&](int from, int to)
+	{
+		for (int i = from ; i < to ; i++)
+			loaded[i] = load(names[missing[i]].c_str(), mipmaps, layout);
+	});
+
+	lock.lock();
+	for (size_t i = 0 ; i < missing.size() ; i++)
+		result[missing[i]] = finishLoad(cacheKey(names[missing[i]], layout), loaded[i]);
+	lock.unlock();
 
-	textureCache[name] = result;
-	return result;
+	for (int i : later)
+		result[i] = loadCached(names[i].c_str(), mipmaps, layout);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 void Texture::unloadCached(const Texture*t)
 {
-	Texture* tex = const_cast<Texture*>(t);
-	if (tex->refcount > 1)
-		tex->refcount--;
-	else {
-		textureCache.erase(tex->filename);
-		delete [] tex;
+	const std::string key = cacheKey(t->filename, t->_layout);
+	std::lock_guard<std::mutex> lock(cacheLock);
+
+	auto iter = textureCache.find(key);
+	assert(iter != textureCache.end() && iter->second.texture == t);
+
+	// kept until the memory is needed, in case it is loaded again
+	TextureCacheEntry &entry = iter->second;
+	if (--entry.references == 0) {
+		unusedTextures.push_front(key);
+		entry.unused = unusedTextures.begin();
+		evictTextures();
 	}
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-Texture* Texture::load(const char* name, bool mipmaps)
+void Texture::setCacheBudget(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(cacheLock);
+	cacheStats.budget = bytes;
+	evictTextures();
+}
+
+TextureCacheStats Texture::getCacheStats()
 {
-	Texture * t = NULL;
+	std::lock_guard<std::mutex> lock(cacheLock);
+	TextureCacheStats stats = cacheStats;
+	stats.textures = textureCache.size();
+	stats.unusedTextures = unusedTextures.size();
+	return stats;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Texture* Texture::load(const char* name, bool mipmaps, TEXTURE_LAYOUT layout, bool gammaCorrectMipmaps)
+{
+	Texture * t = loadFromDiskCache(name, mipmaps, layout, gammaCorrectMipmaps);
+
+	if (t) {
+		t->filename = name;
+		return t;
+	}
 
 	PngLoader p;
 	p.SetFileName(name);
 
-	if (!p.ReadPng())
+	if (!p.ReadPngHeader()) {
+		p.ClosePng();
 		return NULL;
+	}
 
 	int mip_count = mipmaps ? (int)log2(min(p.GetWidth(), p.GetHeight())) : 1;
-	t = new Texture[mip_count];
-	t->_mipmapCount = mip_count;
-	t->allocate(p.GetWidth(), p.GetHeight());
+	t = allocateMipmaps(p.GetWidth(), p.GetHeight(), mip_count);
+
+	// libpng writes the rows in the order of DEVICE_PIXEL, so there is nothing to convert
+	bool ok = p.ReadPngPixels((unsigned char*)t->_data, t->_width * sizeof(DEVICE_PIXEL));
+	p.ClosePng();
+
+	if (!ok) {
+		delete [] t;
+		return NULL;
+	}
+
+	t->filename = name;
+	t->generateMipmaps(gammaCorrectMipmaps);
+
+	// mipmaps are made from the linear level above them, so the layout is changed only now
+	t->setLayout(layout);
+
+	saveToDiskCache(t, mipmaps, gammaCorrectMipmaps);
+	return t;
+}
 
-	for (int y = 0 ; y < t->_height ; y++)
-		for (int x = 0 ; x < t->_width ; x++) 
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Texture* Texture::allocateMipmaps(int width, int height, int count)
+{
+	assert(count >= 1);
+
+	Texture *t = new Texture[count];
+	t->_mipmapCount = count;
+
+	int total = 0;
+	for (int level = 0, w = width, h = height ; level < count ; level++, w = max(w / 2, 1), h = max(h / 2, 1))
+		total += w * h;
+
+	DEVICE_PIXEL *data = new DEVICE_PIXEL[total];
+
+	for (int level = 0, w = width, h = height ; level < count ; level++, w = max(w / 2, 1), h = max(h / 2, 1)) {
+		t[level]._data = data;
+		t[level]._width = w;
+		t[level]._height = h;
+		data += w * h;
+	}
+
+	t->_allocated = true;
+	return t;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* sRGB values to linear light in 16 bits, and back from the top 12 bits of it */
+struct GammaTables
+{
+	unsigned short toLinear[256];
+	unsigned char fromLinear[4096];
+
+	GammaTables()
+	{
+		for (int i = 0 ; i < 256 ; i++) {
+			double c = i / 255.0;
+			c = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+			toLinear[i] = (unsigned short)(c * 65535 + 0.5);
+		}
+
+		for (int i = 0 ; i < 4096 ; i++) {
+			double c = (i + 0.5) / 4096;
+			c = c <= 0.0031308 ? c * 12.92 : 1.055 * pow(c, 1 / 2.4) - 0.055;
+			fromLinear[i] = (unsigned char)clamp((int)(c * 255 + 0.5), 0, 255);
+		}
+	}
+};
+
+static const GammaTables& gammaTables()
+{
+	static const GammaTables tables;
+	return tables;
+}
+
+/*
+ * Texel i of the next level covers texels 2i and 2i+1 of a level of even size. Of a level of odd size
+ * 2n+1 it covers 2+1/n of them: a part of 2i, all of 2i+1, and a part of 2i+2. Weights are in 1/4096
+ */
+#define MIPMAP_WEIGHT_BITS 12
+
+struct MipmapTaps
+{
+	int first;
+	int count;
+	unsigned int weights[3];
+};
+
+static void mipmapTaps(int size, std::vector<MipmapTaps> &taps)
+{
+	const int n = size / 2, one = 1 << MIPMAP_WEIGHT_BITS;
+	taps.resize(n);
+
+	for (int i = 0 ; i < n ; i++)
+	{
+		MipmapTaps &t = taps[i];
+		t.first = i * 2;
+
+		if (size % 2 == 0) {
+			t.count = 2;
+			t.weights[0] = t.weights[1] = one / 2;
+			t.weights[2] = 0;
+		} else {
+			t.count = 3;
+			t.weights[0] = ((n - i) * one + n) / (2 * n + 1);
+			t.weights[2] = ((i + 1) * one + n) / (2 * n + 1);
+			t.weights[1] = one - t.weights[0] - t.weights[2];
+		}
+	}
+}
+
+/* average of 2x2 texels of two rows, for 'width' texels of the next level (the exact rounded average) */
+static void downsampleRows2x2(const DEVICE_PIXEL *row0, const DEVICE_PIXEL *row1, DEVICE_PIXEL *out, int width)
+{
+	int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+
+	for ( ; x + 4 <= width ; x += 4)
+	{
+		// 8 texels of each row, 16 bits per channel, summed along y and then pairs of them along x
+		__m128i sums[2];
+
+		for (int half = 0 ; half < 2 ; half++)
 		{
-			int value = p.GetValue(x,y);
-			t->setPixelValue(x,y, DEVICE_PIXEL((uint8_t)GET_R(value), (uint8_t)GET_G(value), (uint8_t)GET_B(value)));
+			__m128i a = _mm_loadu_si128((const __m128i*)(row0 + x * 2 + half * 4));
+			__m128i b = _mm_loadu_si128((const __m128i*)(row1 + x * 2 + half * 4));
+			__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+			__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+			sums[half] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
 		}
 
-	p.ClosePng();
+		_mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(sums[0], sums[1]));
+	}
+#endif
 
-	t->filename = name;
+	const unsigned char *a = (const unsigned char*)row0, *b = (const unsigned char*)row1;
+	unsigned char *o = (unsigned char*)out;
+
+	for ( ; x < width ; x++)
+		for (int c = 0 ; c < 4 ; c++)
+			o[x * 4 + c] = (a[x * 8 + c] + a[x * 8 + 4 + c] + b[x * 8 + c] + b[x * 8 + 4 + c] + 2) >> 2;
+}
 
-	Texture *prev_level = t;
-	for (int level = 1 ; level < t->_mipmapCount ; level++) 
+/* any size, and optionally in linear light: each of the 4 channels is the weighted sum of up to 3x3 texels */
+static void downsampleRowFiltered(const TextureBase<DEVICE_PIXEL> &source, const MipmapTaps &row,
+		const std::vector<MipmapTaps> &columns, DEVICE_PIXEL *out, const GammaTables *gamma)
+{
+	const int width = source.getWidth();
+	const int shift = MIPMAP_WEIGHT_BITS * 2;
+	const uint64_t half = (uint64_t)1 << (shift - 1);
+	const unsigned char *rows[3];
+
+	for (int j = 0 ; j < row.count ; j++)
+		rows[j] = (const unsigned char*)(source.getPointer() + (row.first + j) * width);
+
+	for (size_t x = 0 ; x < columns.size() ; x++)
 	{
-		Texture *next_level = prev_level+1;
-		next_level->allocate(prev_level->getWidth() / 2, prev_level->getHeight() /2);
+		const MipmapTaps &column = columns[x];
+
+		// 64 bits, for the 16 bit linear values times the 24 bit weights
+		uint64_t sums[4] = { 0, 0, 0, 0 };
 
-		for (int x = 0 ; x < next_level->_width ; x++)
-			for (int y = 0 ; y < next_level->_height ; y++) 
+		for (int j = 0 ; j < row.count ; j++)
+			for (int k = 0 ; k < column.count ; k++)
 			{
-				Color c = prev_level->sample(x*2, y*2);
-				c += prev_level->sample(x*2+1, y*2);
-				c +=  prev_level->sample(x*2, y*2+1);
-				c +=  prev_level->sample(x*2+1, y*2+1);
-				c /= 4;
-				next_level->setPixelValue(x,y, DEVICE_PIXEL(
-						(unsigned char)(c.x()*255),
-						(unsigned char)(c.y()*255),
-						(unsigned char)(c.z()*255)));
+				unsigned int weight = row.weights[j] * column.weights[k];
+				const unsigned char *texel = rows[j] + (column.first + k) * 4;
+
+				for (int c = 0 ; c < 3 ; c++)
+					sums[c] += (uint64_t)weight * (gamma ? gamma->toLinear[texel[c]] : texel[c]);
+				sums[3] += (uint64_t)weight * texel[3];
 			}
 
-			prev_level = next_level;
+		unsigned char *o = (unsigned char*)(out + x);
+
+		for (int c = 0 ; c < 3 ; c++)
+			o[c] = gamma ? gamma->fromLinear[sums[c] >> (shift + 4)] : (unsigned char)((sums[c] + half) >> shift);
+		o[3] = (unsigned char)((sums[3] + half) >> shift);
 	}
+}
 
-	
-	return t;
+void Texture::generateMipmaps(bool gammaCorrect)
+{
+	assert(_layout == TEXTURE_LAYOUT_LINEAR);
+
+	const GammaTables *gamma = gammaCorrect ? &gammaTables() : NULL;
+	std::vector<MipmapTaps> rows, columns;
+
+	for (int level = 1 ; level < _mipmapCount ; level++)
+	{
+		const Texture &source = this[level - 1];
+		Texture &target = this[level];
+
+		mipmapTaps(source._width, columns);
+		mipmapTaps(source._height, rows);
+		assert((int)columns.size() == target._width && (int)rows.size() == target._height);
+
+		const bool box = !gamma && source._width % 2 == 0 && source._height % 2 == 0;
+
+		parallelFor(0, target._height, 16, [&] (int from, int to) {
+			for (int y = from ; y < to ; y++) {
+				DEVICE_PIXEL *out = target._data + y * target._width;
+
+				if (box)
+					downsampleRows2x2(source._data + y * 2 * source._width, source._data + (y * 2 + 1) * source._width, out, target._width);
+				else
+					downsampleRowFiltered(source, rows[y], columns, out, gamma);
+			}
+		});
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 
 Texture::~Texture()
 {
-	refcount--;
-	assert(refcount == 0);
+	releaseStorage();
+}
+
+void Texture::releaseStorage()
+{
+	// the other levels only point into the storage of the first one
+	if (_mapping)
+		munmap(_mapping, _mappingSize);
+	else if (_allocated) {
+		delete [] _data;
+		delete [] _blocks;
+	}
+
+	_data = NULL;
+	_blocks = NULL;
+	_mapping = NULL;
+	_mappingSize = 0;
+	_allocated = false;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* adds (or subtracts) a row of moments to the running sums, for all columns at once */
+static inline void accumulateRow(double *sum, const DepthMoments *row, int width, double sign)
+{
+	const double *values = &row[0].m1;
+	for (int i = 0 ; i < width * 2 ; i++)
+		sum[i] += values[i] * sign;
+}
+
+void MomentsTexture::computeFrom(const DepthTexture &depth, int kernelSize)
+{
+	assert(depth.getWidth() == _width && depth.getHeight() == _height);
+
+	const int radius = max(kernelSize, 1) / 2;
+	const double scale = 1.0 / (radius * 2 + 1);
+	const double *source = depth.getPointer();
+
+	/* horizontally filtered moments */
+	std::vector<DepthMoments> rows(_width * _height);
+
+	parallelFor(0, _height, 16, [&] (int from, int to)
+	{
+		/* moments of one row, edge texels repeated to cover the kernel */
+		std::vector<DepthMoments> line(_width + radius * 2);
+
+		for (int y = from ; y < to ; y++)
+		{
+			for (int x = -radius ; x < _width + radius ; x++) {
+				/* empty texels are at the far plane */
+				double z = clamp(source[y * _width + clamp(x, 0, _width - 1)], 0.0, 1.0);
+				line[x + radius].m1 = z;
+				line[x + radius].m2 = z * z;
+			}
+
+			DepthMoments sum = { 0, 0 };
+			for (int i = 0 ; i < radius * 2 ; i++) {
+				sum.m1 += line[i].m1;
+				sum.m2 += line[i].m2;
+			}
+
+			DepthMoments *out = &rows[y * _width];
+
+			for (int x = 0 ; x < _width ; x++) {
+				sum.m1 += line[x + radius * 2].m1;
+				sum.m2 += line[x + radius * 2].m2;
+				out[x].m1 = sum.m1 * scale;
+				out[x].m2 = sum.m2 * scale;
+				sum.m1 -= line[x].m1;
+				sum.m2 -= line[x].m2;
+			}
+		}
+	});
+
+	/* vertical pass: running sums of rows, whole rows at a time so the inner loops are vectorized */
+	parallelFor(0, _height, 16, [&] (int from, int to)
+	{
+		std::vector<double> sum(_width * 2, 0.0);
+
+		for (int y = from - radius ; y < from + radius ; y++)
+			accumulateRow(&sum[0], &rows[clamp(y, 0, _height - 1) * _width], _width, 1);
+
+		for (int y = from ; y < to ; y++)
+		{
+			accumulateRow(&sum[0], &rows[clamp(y + radius, 0, _height - 1) * _width], _width, 1);
+
+			double *out = &_data[y * _width].m1;
+			for (int i = 0 ; i < _width * 2 ; i++)
+				out[i] = sum[i] * scale;
+
+			accumulateRow(&sum[0], &rows[clamp(y - radius, 0, _height - 1) * _width], _width, -1);
+		}
+	});
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
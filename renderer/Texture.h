@@ -23,6 +23,8 @@
 #include "Renderer.h"
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -82,6 +84,12 @@ public:
 				setPixelValue(x,y, value);
 	}
 
+	void copyFrom(const TextureBase<T> &other)
+	{
+		assert(other._width == _width && other._height == _height);
+		std::copy(other._data, other._data + _width * _height, _data);
+	}
+
 	void setPixelValue(int x, int y, T value) const
 	{
 		assert(x < _width && y < _height);
@@ -102,6 +110,7 @@ public:
 	bool saveToFile(const char* file) const;
 
 	T* getPointer() { return _data; }
+	const T* getPointer() const { return _data; }
 
 private:
 	TextureBase(const TextureBase &other);
@@ -115,6 +124,51 @@ protected:
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/* order of the texels in memory */
+enum TEXTURE_LAYOUT
+{
+	/* row after row */
+	TEXTURE_LAYOUT_LINEAR,
+
+	/*
+	 * tiles of 4x4 texels (64 bytes, a cache line) row after row, and texels of each tile row after row.
+	 * Texels close to each other along any direction are mostly in the same cache line this way
+	 */
+	TEXTURE_LAYOUT_TILED,
+
+	/* same tiles, each compressed to a TextureBlock (8 times smaller, but lossy) */
+	TEXTURE_LAYOUT_COMPRESSED
+};
+
+/*
+ * 4x4 texels in 8 bytes, as in BC1 (DXT1) without its transparent mode: two RGB 5:6:5 colors,
+ * and two bits for each texel that select one of the colors or one of two between them
+ */
+struct TextureBlock
+{
+	unsigned short color0;
+	unsigned short color1;
+	unsigned int indices;
+};
+
+/* textures are kept loaded after their last reference is gone, as long as all of them take less than that */
+#define TEXTURE_CACHE_DEFAULT_BUDGET ((size_t)256 << 20)
+
+struct TextureCacheStats
+{
+	/* memory taken by all the cached textures (used or not), and the most it is allowed to take */
+	size_t residentBytes;
+	size_t budget;
+
+	int textures;
+	int unusedTextures;
+
+	/* since the start */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
 class Texture : public TextureBase<DEVICE_PIXEL>
 {
 public:
@@ -125,18 +179,108 @@ public:
 	Texture(int width, int height);
 
 
-	// load a texture
-	static Texture* load(const char* name, bool mipmaps = false);
-
-	/* Static texture loading functions*/
-	static const Texture* loadCached(const char* name, bool mipmaps);
+	// load a texture, it is tiled unless asked otherwise (the rendered result is the same)
+	static Texture* load(const char* name, bool mipmaps = false, TEXTURE_LAYOUT layout = TEXTURE_LAYOUT_TILED,
+			bool gammaCorrectMipmaps = false);
+
+	/*
+	 * a texture with 'count' mipmap levels (each half the size of the one before it) in a single allocation,
+	 * freed with delete []. Only the first level is meant to be written, the others by generateMipmaps
+	 */
+	static Texture* allocateMipmaps(int width, int height, int count);
+
+	/*
+	 * build the levels after the first one from it (the texture must be linear). Each texel of the next level
+	 * is the box filtered area of the level above it that it covers, so odd sizes lose nothing. With gamma
+	 * correction the texels are averaged as linear light, instead of as the sRGB values they are stored as
+	 */
+	void generateMipmaps(bool gammaCorrect = false);
+
+	/*
+	 * Static texture loading functions. They can be called from any thread, and a texture that many threads
+	 * ask for at once is loaded once. Unloaded textures are freed only when the cache is over its budget
+	 */
+	static const Texture* loadCached(const char* name, bool mipmaps, TEXTURE_LAYOUT layout = TEXTURE_LAYOUT_TILED);
 	static void unloadCached(const Texture*t);
 
+	static void setCacheBudget(size_t bytes);
+	static TextureCacheStats getCacheStats();
+
+	/*
+	 * same for many textures at once, the files that aren't cached yet are loaded in parallel.
+	 * result[i] is the texture of names[i] (NULL if it is empty or failed to load)
+	 */
+	static void loadCached(const std::vector<std::string> &names, bool mipmaps, TEXTURE_LAYOUT layout,
+			std::vector<const Texture*> &result);
+
+	/*
+	 * directory where loaded textures (decoded, with their mipmaps and in their layout) are kept between runs,
+	 * so that loading them again only maps the file. It is $CG_TEXTURE_CACHE if set, ~/.cache/cg4/textures
+	 * otherwise, and empty disables it
+	 */
+	static void setDiskCacheDirectory(const std::string &directory);
+	static std::string getDiskCacheDirectory();
+
 	/* texture information */
 	const char* getFilename()  const { return filename.c_str(); }
 
+	/*
+	 * change the order of the texels (of all the mipmap levels). getPixelValue/setPixelValue (and everything
+	 * else from TextureBase) assume the linear layout, tiled and compressed textures are only read by the functions below
+	 */
+	void setLayout(TEXTURE_LAYOUT layout);
+	TEXTURE_LAYOUT getLayout() const { return _layout; }
+
+	/* tiles in each row of them, for the tiled and compressed layouts */
+	int getTilesPerRow() const { return _tilesX; }
+
+	/* memory taken by the texels of this level, in bytes */
+	size_t getMemoryUsage() const;
+
 	/* main sampling functions */
 	Color sample(int x, int y) const;
+
+	/* texels at x..x+1, y..y+1 (repeating the last row and column) */
+	void getQuad(int x, int y, DEVICE_PIXEL quad[4]) const
+	{
+		x = min(_width-1, x);
+		y = min(_height-1,y);
+
+		if (_layout == TEXTURE_LAYOUT_COMPRESSED) {
+			getCompressedQuad(x, y, quad);
+			return;
+		}
+
+		// distances to the next texel along x and y, in tiles they are only bigger on the last column and row of a tile
+		int dx, dy;
+
+		if (_layout == TEXTURE_LAYOUT_LINEAR) {
+			dx = 1;
+			dy = _width;
+		} else {
+			dx = (x & 3) == 3 ? 16 - 3 : 1;
+			dy = (y & 3) == 3 ? _tilesX * 16 - 12 : 4;
+		}
+
+		if (x == _width - 1) dx = 0;
+		if (y == _height - 1) dy = 0;
+
+		const DEVICE_PIXEL *p = _data + texelIndex(x,y);
+		quad[0] = p[0];
+		quad[1] = p[dx];
+		quad[2] = p[dy];
+		quad[3] = p[dx + dy];
+	}
+
+	DEVICE_PIXEL getTexel(int x, int y) const
+	{
+		if (_layout == TEXTURE_LAYOUT_COMPRESSED) {
+			int index = tiledIndex(x, y, _tilesX);
+			return decodeBlock(index >> 4)[index & 15];
+		}
+		return _data[texelIndex(x, y)];
+	}
+
 	~Texture();
 
 	virtual Color debugGetPixel(int x, int y) const  { return sample(x,y);  }
@@ -147,16 +291,47 @@ private:
 	std::string filename;
 	int _mipmapCount;
 
+	/* layout, and the number of tiles in each row of them */
+	TEXTURE_LAYOUT _layout;
+	int _tilesX;
+
+	/* compressed tiles (instead of the texels), and a number that identifies them in the cache of decoded ones */
+	TextureBlock *_blocks;
+	unsigned int _blocksID;
+	static unsigned int newBlocksID();
+
+	/* file of the disk cache that the levels are in, instead of an allocation (first level only) */
+	void *_mapping;
+	size_t _mappingSize;
+
+	/* frees the texels (or the mapping) of all levels, which the first level owns */
+	void releaseStorage();
+
+	/* disk cache (TextureDiskCache.cpp) */
+	static Texture* loadFromDiskCache(const char* name, bool mipmaps, TEXTURE_LAYOUT layout, bool gammaCorrectMipmaps);
+	static void saveToDiskCache(const Texture *t, bool mipmaps, bool gammaCorrectMipmaps);
+
+	/* texels of a compressed tile, decoded or taken from the cache */
+	const DEVICE_PIXEL* decodeBlock(int block) const;
+	void getCompressedQuad(int x, int y, DEVICE_PIXEL quad[4]) const;
+
+	static int tiledIndex(int x, int y, int tilesX)
+	{
+		return (((y >> 2) * tilesX + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3);
+	}
+
+	int texelIndex(int x, int y) const
+	{
+		return _layout == TEXTURE_LAYOUT_LINEAR ? y * _width + x : tiledIndex(x, y, _tilesX);
+	}
+
 	/* to be a good citizen */
 	Texture(const Texture &other);
 	Texture& operator=(const Texture &other);
 
 	static Texture* load_failback(const char* name, bool mipmaps);
 
-	/* RO texture cache */
-	mutable int refcount;
-
-	Texture() { _mipmapCount = 0 ; _allocated = false ; refcount = 1;}
+	Texture() { _mipmapCount = 0 ; _allocated = false ; _layout = TEXTURE_LAYOUT_LINEAR; _tilesX = 0; _blocks = NULL; _blocksID = 0; _mapping = NULL; _mappingSize = 0; }
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -207,4 +382,26 @@ public:
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/* mean of depth and of its square, over the filter area of a texel */
+struct DepthMoments
+{
+	double m1;
+	double m2;
+};
+
+/* variance shadow map, made from a regular depth map */
+class MomentsTexture : public TextureBase<DepthMoments>
+{
+public:
+	MomentsTexture(int width, int height) : TextureBase(width, height) {}
+
+	/*
+	 * moments of the depth map (of same size), box filtered with kernel of kernelSize texels.
+	 * Filter is separable and uses running sums, so its cost doesn't depend on kernel size
+	 */
+	void computeFrom(const DepthTexture &depth, int kernelSize);
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////
+
 #endif
@@ -0,0 +1,303 @@
+/*
+	This file is part of CG4.
+
+	Copyright (c) Inbar Donag and Maxim Levitsky
+
+    CG4 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    CG4 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CG4.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Texture.h"
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * Each loaded texture is a file named by a hash of its path and of how it was loaded. The file is this
+ * header, the path, and the levels exactly as they are in memory, each starting at a multiple of
+ * TEXTURE_CACHE_ALIGNMENT bytes, so the levels of a mapped file are used in place
+ */
+#define TEXTURE_CACHE_MAGIC 0x58455434 /* "4TEX" */
+#define TEXTURE_CACHE_VERSION 1
+#define TEXTURE_CACHE_MAX_LEVELS 32
+#define TEXTURE_CACHE_ALIGNMENT 64
+
+struct TextureCacheLevel
+{
+	uint32_t width;
+	uint32_t height;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct TextureCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+
+	/* the file the texture was loaded from, when it was loaded */
+	int64_t sourceSize;
+	int64_t sourceTime;
+	uint32_t nameLength;
+
+	/* how it was loaded */
+	uint32_t layout;
+	uint32_t mipmaps;
+	uint32_t gammaCorrectMipmaps;
+
+	uint32_t levelCount;
+	TextureCacheLevel levels[TEXTURE_CACHE_MAX_LEVELS];
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static std::mutex directoryLock;
+static bool directoryInitialized = false;
+static std::string diskCacheDirectory;
+
+void Texture::setDiskCacheDirectory(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(directoryLock);
+	diskCacheDirectory = path;
+	directoryInitialized = true;
+}
+
+std::string Texture::getDiskCacheDirectory()
+{
+	std::lock_guard<std::mutex> lock(directoryLock);
+
+	if (!directoryInitialized)
+	{
+		const char *path = getenv("CG_TEXTURE_CACHE");
+		const char *home = getenv("HOME");
+
+		if (path)
+			diskCacheDirectory = path;
+		else if (home)
+			diskCacheDirectory = std::string(home) + "/.cache/cg4/textures";
+
+		directoryInitialized = true;
+	}
+
+	return diskCacheDirectory;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/* mkdir -p */
+static bool createDirectory(const std::string &path)
+{
+	for (size_t i = 1 ; i <= path.size() ; i++)
+	{
+		if (i < path.size() && path[i] != '/')
+			continue;
+
+		if (mkdir(path.substr(0, i).c_str(), 0755) && errno != EEXIST)
+			return false;
+	}
+	return true;
+}
+
+/* the absolute path of the texture, and its size and modification time */
+static bool sourceInfo(const char* name, std::string &path, struct stat &info)
+{
+	if (stat(name, &info))
+		return false;
+
+	char buffer[PATH_MAX];
+	path = realpath(name, buffer) ? buffer : name;
+	return true;
+}
+
+static std::string cacheFileName(const std::string &directory, const std::string &path,
+		bool mipmaps, TEXTURE_LAYOUT layout, bool gammaCorrectMipmaps)
+{
+	// FNV-1a, the same in every run (unlike std::hash)
+	uint64_t hash = 14695981039346656037ull;
+	std::string key = path + (char)('0' + layout) + (mipmaps ? 'm' : '-') + (gammaCorrectMipmaps ? 'g' : '-');
+
+	for (unsigned char c : key)
+		hash = (hash ^ c) * 1099511628211ull;
+
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.tex", (unsigned long long)hash);
+	return directory + name;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Texture* Texture::loadFromDiskCache(const char* name, bool mipmaps, TEXTURE_LAYOUT layout, bool gammaCorrectMipmaps)
+{
+	std::string directory = getDiskCacheDirectory();
+	std::string path;
+	struct stat source, info;
+
+	if (directory.empty() || !sourceInfo(name, path, source))
+		return NULL;
+
+	int fd = open(cacheFileName(directory, path, mipmaps, layout, gammaCorrectMipmaps).c_str(), O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &info) || info.st_size < (off_t)sizeof(TextureCacheHeader)) {
+		close(fd);
+		return NULL;
+	}
+
+	// private and writable, so that the texels can still be changed like those of any other texture
+	size_t size = info.st_size;
+	void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	const unsigned char *file = (const unsigned char*)mapping;
+	const TextureCacheHeader &header = *(const TextureCacheHeader*)file;
+
+	// a different texture with the same hash, or an older version of the file, is just loaded again
+	bool valid = header.magic == TEXTURE_CACHE_MAGIC && header.version == TEXTURE_CACHE_VERSION &&
+		header.sourceSize == (int64_t)source.st_size && header.sourceTime == (int64_t)source.st_mtime &&
+		header.layout == (uint32_t)layout && header.mipmaps == (uint32_t)mipmaps &&
+		header.gammaCorrectMipmaps == (uint32_t)gammaCorrectMipmaps &&
+		header.levelCount >= 1 && header.levelCount <= TEXTURE_CACHE_MAX_LEVELS &&
+		header.nameLength == path.size() && sizeof(header) + header.nameLength <= size &&
+		!path.compare(0, path.size(), (const char*)file + sizeof(header), header.nameLength);
+
+	Texture *t = NULL;
+
+	if (valid)
+	{
+		t = new Texture[header.levelCount];
+		t->_mipmapCount = header.levelCount;
+
+		for (unsigned int level = 0 ; level < header.levelCount && valid ; level++)
+		{
+			const TextureCacheLevel &l = header.levels[level];
+			Texture &texture = t[level];
+			unsigned char *texels = (unsigned char*)mapping + l.offset;
+
+			texture._width = l.width;
+			texture._height = l.height;
+			texture._layout = layout;
+			texture._tilesX = (l.width + 3) / 4;
+
+			if (layout == TEXTURE_LAYOUT_COMPRESSED) {
+				texture._blocks = (TextureBlock*)texels;
+				texture._blocksID = newBlocksID();
+			} else
+				texture._data = (DEVICE_PIXEL*)texels;
+
+			valid = l.offset % TEXTURE_CACHE_ALIGNMENT == 0 && l.offset + l.size <= size &&
+				l.size == texture.getMemoryUsage();
+		}
+
+		if (!valid) {
+			delete [] t;
+			t = NULL;
+		}
+	}
+
+	if (!t) {
+		munmap(mapping, size);
+		return NULL;
+	}
+
+	// start reading the rest of the file now, rather than at the first sample of each page
+	madvise(mapping, size, MADV_WILLNEED);
+
+	t->_mapping = mapping;
+	t->_mappingSize = size;
+	return t;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Texture::saveToDiskCache(const Texture *t, bool mipmaps, bool gammaCorrectMipmaps)
+{
+	std::string directory = getDiskCacheDirectory();
+	std::string path;
+	struct stat source;
+
+	if (directory.empty() || t->_mipmapCount > TEXTURE_CACHE_MAX_LEVELS || !sourceInfo(t->getFilename(), path, source))
+		return;
+
+	if (!createDirectory(directory))
+		return;
+
+	TextureCacheHeader header;
+	memset(&header, 0, sizeof(header));
+
+	header.magic = TEXTURE_CACHE_MAGIC;
+	header.version = TEXTURE_CACHE_VERSION;
+	header.sourceSize = source.st_size;
+	header.sourceTime = source.st_mtime;
+	header.nameLength = path.size();
+	header.layout = t->_layout;
+	header.mipmaps = mipmaps;
+	header.gammaCorrectMipmaps = gammaCorrectMipmaps;
+	header.levelCount = t->_mipmapCount;
+
+	uint64_t offset = sizeof(header) + path.size();
+
+	for (int level = 0 ; level < t->_mipmapCount ; level++) {
+		offset = (offset + TEXTURE_CACHE_ALIGNMENT - 1) / TEXTURE_CACHE_ALIGNMENT * TEXTURE_CACHE_ALIGNMENT;
+		header.levels[level].width = t[level]._width;
+		header.levels[level].height = t[level]._height;
+		header.levels[level].offset = offset;
+		header.levels[level].size = t[level].getMemoryUsage();
+		offset += header.levels[level].size;
+	}
+
+	// written to a temporary file first, so that a file of the cache is either complete or not there
+	std::string file = cacheFileName(directory, path, mipmaps, t->_layout, gammaCorrectMipmaps);
+	std::string temporary = file + ".XXXXXX";
+
+	int fd = mkstemp(&temporary[0]);
+	if (fd < 0)
+		return;
+
+	FILE *out = fdopen(fd, "wb");
+	if (!out) {
+		close(fd);
+		unlink(temporary.c_str());
+		return;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1 && fwrite(path.c_str(), path.size(), 1, out) == 1;
+	uint64_t position = sizeof(header) + path.size();
+
+	for (int level = 0 ; level < t->_mipmapCount && ok ; level++)
+	{
+		static const char padding[TEXTURE_CACHE_ALIGNMENT] = { 0 };
+		const TextureCacheLevel &l = header.levels[level];
+		const void *texels = t->_layout == TEXTURE_LAYOUT_COMPRESSED ? (const void*)t[level]._blocks : (const void*)t[level]._data;
+
+		ok = (l.offset == position || fwrite(padding, l.offset - position, 1, out) == 1) &&
+			fwrite(texels, l.size, 1, out) == 1;
+		position = l.offset + l.size;
+	}
+
+	ok = !fclose(out) && ok;
+
+	if (!ok || rename(temporary.c_str(), file.c_str()))
+		unlink(temporary.c_str());
+}